@@ -1,17 +1,48 @@
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <zlib.h>  // inflate for .gz and .zip inputs
+
+// x86-64 always has SSE2, AVX2 is picked at run time when the CPU has it
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <immintrin.h>
+    #define HAVE_SIMD_SCAN 1
+#endif
 
 #define MAX_LENGTH 1024
 #define MAX_FIELDS 55
 
+// Records per arena chunk when the row count is not known up front
+#define ARENA_CHUNK_RECORDS 1024
+
+// Smallest byte range worth handing to its own loader thread
+#define MIN_THREAD_BYTES (1 << 20)
+
+// Binary sidecar written next to the CSV, bump the version with any layout change
+#define CACHE_SUFFIX ".aqsc"
+#define CACHE_VERSION 4
+
 #ifdef _WIN32
     #include <conio.h>  // Windows: _getch()
+    #include <io.h>  // Windows: _isatty()
 #else
+    #include <dirent.h>  // Linux/macOS: directory and glob inputs
+    #include <fcntl.h>
+    #include <glob.h>
+    #include <pthread.h>  // Linux/macOS: worker threads for the parallel loader
+    #include <signal.h>
+    #include <sys/resource.h>  // Linux/macOS: peak RSS for --stats
+    #include <sys/mman.h>  // Linux/macOS: mmap for zero-copy input
+    #include <sys/socket.h>  // Linux/macOS: Unix domain socket for --serve
+    #include <sys/un.h>
     #include <termios.h>  // Linux/macOS: termios for raw input
     #include <unistd.h>
 
@@ -62,17 +93,17 @@ typedef struct {
     double arithmetic_mean;
     double arithmetic_std_dev;
     double first_max_value;
-    char first_max_datetime[20];
+    int64_t first_max_datetime; // seconds since 1970 as written (local standard time)
     double second_max_value;
-    char second_max_datetime[20];
+    int64_t second_max_datetime;
     double third_max_value;
-    char third_max_datetime[20];
+    int64_t third_max_datetime;
     double fourth_max_value;
-    char fourth_max_datetime[20];
-    double first_no_max_value; // May need to handle missing data
-    char first_no_max_datetime[20];
-    double second_no_max_value; // May need to handle missing data
-    char second_no_max_datetime[20];
+    int64_t fourth_max_datetime;
+    double first_no_max_value; // NaN when missing
+    int64_t first_no_max_datetime;
+    double second_no_max_value; // NaN when missing
+    int64_t second_no_max_datetime;
     double percentile_99;
     double percentile_98;
     double percentile_95;
@@ -87,625 +118,9422 @@ typedef struct {
     char city_name[50];
     char cbsa_name[50];
     char date_of_last_change[15];
+    uint64_t missing;  // bit n set when numeric field n was empty, doubles also hold NaN
 } AQSData;
 
-// * Functions * // 
+// Chunked slab of AQSData records, records never move once pushed
+typedef struct {
+    AQSData **chunks;
+    size_t chunk_count;
+    size_t chunk_slots;    // capacity of chunks[]
+    size_t chunk_records;  // records per chunk
+    size_t len;
+} AQSArena;
 
-// Read data from CSV file
-AQSData *read_data(const char *filename, size_t *len);
+// Structural characters of one 64-byte block, bit i stands for byte i
+typedef struct {
+    uint64_t quote;
+    uint64_t comma;
+    uint64_t newline;
+} BlockMasks;
 
-// Function to Parse Each Line
-char *parse_csv_line(char *line, int len);
+// Read-only image of a whole file, mmapped where the platform allows it
+typedef struct {
+    const char *data;
+    size_t size;
+    bool owned;  // true when data was malloc'd instead of mapped
+} MappedFile;
 
-// Function for Autocomplete
-void autocomplete(char *buffer, int param_count, char **param_names);
+// Byte range of one field inside a mapped file (quotes already trimmed)
+typedef struct {
+    size_t offset;
+    size_t length;
+} FieldView;
 
-// Function to compare nums and letters for qsort
-int comp(const void *a, const void *b);
+// One tokenized record, field starts are relative to the record offset
+// starts[n + 1] - 1 is where field n ends, so nothing is copied at tokenize time
+typedef struct {
+    size_t offset;
+    uint16_t starts[MAX_FIELDS + 1];
+} AQSRowView;
 
-// * MAIN * //
+// Zero-copy counterpart of an AQSData array
+typedef struct {
+    MappedFile file;
+    AQSRowView *rows;
+    size_t len;
+} AQSView;
 
-int main(int argc, char *argv[])
-{
+// Where each record and its parameter_name sit, nothing else is parsed until a row is selected
+// 12 bytes a row (16 once ids are filled) against a full AQSData record, record 0 is the header
+typedef struct {
+    MappedFile file;
+    size_t *offsets;         // record i starts at data[offsets[i]]
+    uint16_t *name_starts;   // parameter_name relative to the record, quotes trimmed
+    uint16_t *name_lens;
+    int32_t *ids;            // parameter id of each record, filled while interning
+    size_t len;
+} LazyIndex;
 
-    const char *filename = argv[1];
+// Outcome of parsing one numeric field
+typedef enum {
+    NUM_OK,
+    NUM_MISSING,  // empty field
+    NUM_INVALID
+} NumStatus;
 
-    if (argc < 2)
-    {
-        printf("Error: Not enough arguments\nUsage: ./reduce input_file_path\n");
-        return EXIT_FAILURE;
-    }
+// Storage class of an AQS column
+typedef enum {
+    COL_STR,
+    COL_INT,
+    COL_DBL,
+    COL_TIME,  // "YYYY-MM-DD HH:MM" as int64 seconds since 1970
+    COL_DICT   // repeated text as uint32 codes into a per-column string pool
+} ColumnType;
 
-    size_t aqs_len;
-    // Populate structs
-    AQSData *data = read_data(filename, &aqs_len);
+// Name and storage class of one AQS field
+typedef struct {
+    const char *name;
+    ColumnType type;
+} FieldDesc;
 
-    // Check for error first
-    if(data == NULL)
-    {
-        fprintf(stderr, "Failed to read data\n");
-        return EXIT_FAILURE;
-    }
+// AQS fields in file order, names follow the AQSData members
+static const FieldDesc AQS_FIELDS[MAX_FIELDS] = {
+    {"state_code", COL_STR},
+    {"county_code", COL_STR},
+    {"site_num", COL_STR},
+    {"parameter_code", COL_STR},
+    {"poc", COL_INT},
+    {"latitude", COL_DBL},
+    {"longitude", COL_DBL},
+    {"datum", COL_DICT},
+    {"parameter_name", COL_DICT},
+    {"sample_duration", COL_DICT},
+    {"pollutant_standard", COL_DICT},
+    {"metric_used", COL_DICT},
+    {"method_name", COL_DICT},
+    {"year", COL_INT},
+    {"units_of_measure", COL_DICT},
+    {"event_type", COL_DICT},
+    {"observation_count", COL_INT},
+    {"observation_percent", COL_INT},
+    {"completeness_indicator", COL_DICT},
+    {"valid_day_count", COL_INT},
+    {"required_day_count", COL_INT},
+    {"exceptional_data_count", COL_INT},
+    {"null_data_count", COL_INT},
+    {"primary_exceedance_count", COL_INT},
+    {"secondary_exceedance_count", COL_INT},
+    {"certification_indicator", COL_DICT},
+    {"num_obs_below_mdl", COL_INT},
+    {"arithmetic_mean", COL_DBL},
+    {"arithmetic_std_dev", COL_DBL},
+    {"first_max_value", COL_DBL},
+    {"first_max_datetime", COL_TIME},
+    {"second_max_value", COL_DBL},
+    {"second_max_datetime", COL_TIME},
+    {"third_max_value", COL_DBL},
+    {"third_max_datetime", COL_TIME},
+    {"fourth_max_value", COL_DBL},
+    {"fourth_max_datetime", COL_TIME},
+    {"first_no_max_value", COL_DBL},
+    {"first_no_max_datetime", COL_TIME},
+    {"second_no_max_value", COL_DBL},
+    {"second_no_max_datetime", COL_TIME},
+    {"percentile_99", COL_DBL},
+    {"percentile_98", COL_DBL},
+    {"percentile_95", COL_DBL},
+    {"percentile_90", COL_DBL},
+    {"percentile_75", COL_DBL},
+    {"percentile_50", COL_DBL},
+    {"percentile_10", COL_DBL},
+    {"local_site_name", COL_DICT},
+    {"address", COL_DICT},
+    {"state_name", COL_DICT},
+    {"county_name", COL_DICT},
+    {"city_name", COL_DICT},
+    {"cbsa_name", COL_DICT},
+    {"date_of_last_change", COL_STR},
+};
 
-    // array for unique parameter names
-    char **param_names = NULL;
-    size_t size = 0;
+// One contiguous column, only the array matching type is used
+// String i lives at blob[offsets[i]] .. blob[offsets[i + 1]], not NUL terminated
+// Dictionary columns hold codes[i] per row instead, blob / offsets are then indexed by code
+// Numeric columns carry a validity bitmap, bit i clear when row i was empty (doubles are NaN too)
+typedef struct {
+    ColumnType type;
+    int32_t *i32;
+    double *f64;
+    int64_t *i64;
+    uint8_t *valid;
+    uint32_t *codes;
+    size_t *offsets;
+    char *blob;
+    size_t blob_len;
+    size_t blob_cap;
+    size_t dict_len;    // distinct strings of a COL_DICT column
+    size_t dict_cap;
+    uint32_t *slots;    // code + 1 by string hash, NULL when the pool came from a cache
+    size_t slot_count;  // power of two
+} Column;
 
-    // Place a solid cap on params to start
-    int capacity = MAX_LENGTH;
+// Struct-of-arrays form of AQSData, the header row is not stored
+typedef struct {
+    size_t len;
+    size_t capacity;
+    bool borrowed;  // arrays point into a cache mapping, nothing to free
+    Column cols[MAX_FIELDS];
+} AQSColumns;
 
-    // Allocate Array 
-    param_names = malloc(capacity * sizeof(char *));
+// Interned parameter names, ids are stable and dense in first-seen order
+// Open addressing over precomputed hashes, slots hold id + 1 (0 = empty)
+typedef struct {
+    char **names;       // id -> name, quotes stripped and lowercased
+    size_t *counts;     // id -> rows carrying the name
+    uint64_t *hashes;   // id -> hash of the normalised name
+    size_t len;
+    size_t cap;
+    uint32_t *slots;
+    size_t slot_count;  // power of two
+} ParamTable;
 
-    // Check for Allocation Error
-    if (!param_names)
-    {
-        perror("Failed to allocate param_names");
-        return EXIT_FAILURE;
-    }
+// Container detected from the first bytes of an input
+typedef enum { INPUT_PLAIN, INPUT_GZIP, INPUT_ZIP } InputFormat;
 
-    // Implement Loop for pushing unique params to param_names array from csv file
+// Inflate state and the ring it fills, private to the compressed input code
+typedef struct Inflater Inflater;
 
-    // i = 1 to skip header
-    for (int i = 1; i < aqs_len; i++)
-    {
-        if (size == capacity)
-        {
-            capacity *= 2;
-            char **temp = realloc(param_names, capacity * sizeof(char *));
+// Raw bytes of an input, compressed ones are inflated on their own thread
+typedef struct {
+    FILE *fp;
+    Inflater *inflater;  // NULL for plain files
+} ByteSource;
 
-            if (!temp)
-            {
-                perror("Failed to allocate temp");
+// Buffered record source for the streaming modes, memory stays at one buffer
+typedef struct {
+    ByteSource src;
+    char *buf;
+    size_t cap;
+    size_t start;  // first byte not yet handed out
+    size_t len;    // bytes held in buf
+    bool eof;
+    bool error;    // a read, inflate or allocation failed, the input ended early
+} RecordReader;
 
-                // Free individual strings first 
-                for (int j = 0; j < size; j++)
-                {
-                    free(param_names[j]);
-                }
+// Columns plus the parameter dictionary and a per-parameter row index
+// Rows of parameter id are param_rows[param_starts[id] .. param_starts[id + 1]]
+// Batches of files also record where each row came from
+typedef struct {
+    AQSColumns *cols;
+    ParamTable *params;
+    size_t *param_starts;
+    uint32_t *param_rows;
+    MappedFile cache;      // backing sidecar when the columns were not parsed
+    char **sources;        // input files, in load order
+    size_t source_count;
+    uint16_t *source_ids;  // row -> index into sources, NULL when there is one source
+} Dataset;
 
-                free(param_names);
-                free(data);
+// Fixed header of the sidecar, sections follow in a fixed order, 8-byte aligned
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t rows;
+    uint64_t param_count;
+} CacheHeader;
 
-                return EXIT_FAILURE;
-            }
+#define NGRAM_MAX_QUERY 64
+#define COMPLETER_MATCHES 8
 
-            // if successful, set param_names = temp
-            param_names = temp;
-        }
+// Trigram inverted index over a vocabulary of names, for substring and fuzzy search
+// Names are compared lowercased with quotes dropped, each contributes the trigrams of " name "
+// Names holding trigram keys[k] are ids[starts[k] .. starts[k + 1]), ascending
+typedef struct {
+    const char **names;  // borrowed strings, not necessarily NUL terminated
+    size_t *lens;
+    size_t count;
+    uint32_t *keys;      // sorted distinct trigrams, 3 bytes each
+    size_t *starts;
+    uint32_t *ids;
+    size_t key_count;
+} NgramIndex;
 
-        // Flag for continuing i loop
-        bool match = false;
+// One search hit, ranked by distance, then prefix matches, then shorter names
+typedef struct {
+    uint32_t id;
+    int distance;  // edits from the query to the closest substring of the name, 0 when it contains it
+    bool prefix;   // the name starts with the query
+} NgramMatch;
 
-        for (int j = 0; j < size; j++)
-        {
-            if (!strcmp(param_names[j], data[i].parameter_name))
-            {
-                match = true;
-                break;
-            }
-        }
+// Autocomplete state, typed is what the user entered
+// While cycling, cursor walks the matching range [lo, hi) of the sorted names
+// Without a prefix match it walks the ranked substring / fuzzy matches instead, refreshed on every key
+typedef struct {
+    char **names;
+    int count;
+    const NgramIndex *index;  // over names, NULL for prefix matching only
+    char typed[200];
+    size_t typed_len;
+    int lo;
+    int hi;
+    int cursor;  // -1 when not cycling
+    bool fuzzy;  // cursor indexes matches rather than names
+    NgramMatch matches[COMPLETER_MATCHES];
+    int match_count;
+} Completer;
 
-        // If match true, 
-        if (match) continue;
+// Pipeline stages --stats times, in report order
+typedef enum {
+    STAGE_READ,     // input bytes into line buffers (read_data, --param)
+    STAGE_SPLIT,    // split_csv_line and --where
+    STAGE_CONVERT,  // field conversion into AQSData
+    STAGE_LOAD,     // --mmap indexing or the --columnar loaders, every thread
+    STAGE_UNIQUE,   // parameter interning
+    STAGE_SORT,     // qsort of the names
+    STAGE_INDEX,    // trigram index of the sorted names
+    STAGE_PROMPT,   // waiting on the user
+    STAGE_QUERY,    // spatial / time selection, group-by, export
+    STAGE_COUNT
+} Stage;
 
-        // Allocate memory for string and copy 
-        param_names[size] = malloc(strlen(data[i].parameter_name) + 1);
+static const char *STAGE_NAMES[STAGE_COUNT] = {
+    "read", "split", "convert", "load", "unique", "sort", "index", "prompt", "query"
+};
 
-        // Allocation error 
-        if (!param_names[size])
-        {
-            perror("Failed to allocate param_names[size]");
+// Timers and counters behind --stats, off unless asked for
+// Counters may be bumped from loader threads, timers only from the main one
+typedef struct {
+    bool enabled;
+    bool json;
+    double start;
+    double seconds[STAGE_COUNT];
+    uint64_t calls[STAGE_COUNT];
+    uint64_t bytes;     // input read or mapped, after inflation
+    uint64_t rows;      // records loaded
+    uint64_t reallocs;  // buffer growths
+} Stats;
 
-            // Free individual strings first 
-            for (int j = 0; j < size; j++)
-            {
-                free(param_names[j]);
-            }
+static Stats STATS;
 
-            free(param_names);
-            free(data);
+// Worker threads share the counters, Windows runs its workers one after another
+#if defined(__GNUC__) || defined(__clang__)
+    #define STATS_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#else
+    #define STATS_ADD(counter, n) ((counter) += (n))
+#endif
 
-            return EXIT_FAILURE;
-        }
+#define MAX_GROUP_KEYS 8
+#define MAX_AGGS 16
 
-        strcpy(param_names[size], data[i].parameter_name);
+// Compression of the quantile sketches, a digest keeps about this many centroids
+#define TDIGEST_DELTA 100
+#define TDIGEST_BUFFER (5 * TDIGEST_DELTA)
 
-        size++;
-    }
+typedef enum { AGG_COUNT, AGG_SUM, AGG_MEAN, AGG_MIN, AGG_MAX, AGG_QUANTILE } AggOp;
 
-    // Quick Sort param_names
-    qsort(param_names, size, sizeof(param_names[0]), comp);
+// field is -1 for a bare count of rows and for quantiles, which read the percentile_* columns
+typedef struct {
+    AggOp op;
+    int field;
+    double q;  // AGG_QUANTILE only, in (0, 1]
+} AggSpec;
 
-    // New Array for no_quotes_params
-    char **no_quote_params = malloc(size * sizeof(char *));
+// Parsed --group / --agg, fields index AQS_FIELDS
+typedef struct {
+    int keys[MAX_GROUP_KEYS];
+    int key_count;
+    AggSpec aggs[MAX_AGGS];
+    int agg_count;
+    bool quantiles;  // some agg is a quantile, every group then keeps a digest
+} GroupSpec;
 
-    if (!no_quote_params)
-    {
-        perror("no_quote_params allocation failed");
+typedef struct {
+    double mean;
+    double weight;
+} Centroid;
 
-        // Free individual strings first 
-        for (int j = 0; j < size; j++)
-        {
-            free(param_names[j]);
-        }
+// Merging t-digest: weighted centroids sorted by mean up to sorted, then an unsorted buffer of new ones
+// Mergeable in O(size) by appending the other digest's centroids and compressing
+typedef struct {
+    Centroid *centroids;
+    size_t len;
+    size_t cap;
+    size_t sorted;
+    double total;
+    double min;
+    double max;
+} TDigest;
 
-        free(param_names);
-        free(data);
+// Running aggregate of one column within one group, n counts non missing values
+typedef struct {
+    double sum;
+    double min;
+    double max;
+    size_t n;
+} AggState;
 
-        return EXIT_FAILURE;
-    }
+// Hash aggregation table, a group is identified by its first row (reps)
+// states holds agg_count entries per group
+typedef struct {
+    const AQSColumns *cols;
+    const GroupSpec *spec;
+    uint32_t *reps;
+    uint64_t *hashes;
+    size_t *rows;
+    AggState *states;
+    TDigest *digests;  // one per group when spec->quantiles, NULL otherwise
+    size_t len;
+    size_t cap;
+    uint32_t *slots;  // group + 1, 0 when empty
+    size_t slot_count;
+} GroupTable;
 
-    int copy_size = 0;
-    for (int i = 0; i < size; i++) {
-        int len = strlen(param_names[i]);
+#define MAX_PREDICATES 16
+#define FILTER_REORDER_ROWS 4096
 
-        // Allocate memory for new string (excluding quotes, +1 for null terminator)
-        no_quote_params[i] = malloc(len + 1);  
-        copy_size++;
+typedef enum { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE } CmpOp;
 
-        if (!no_quote_params[i]) {
-            perror("no_quote_params[i] allocation failed");
+// One "field op value" term, numeric fields compare parsed numbers
+// Datetimes compare against the whole period [number, upper] the value names, so =2021-07 is all of July
+// Text compares ignore case, text is stored lowercased
+// tested / rejected drive the evaluation order
+typedef struct {
+    int field;
+    CmpOp op;
+    bool numeric;
+    double number;
+    double upper;
+    char text[MAX_LENGTH];
+    size_t text_len;
+    size_t tested;
+    size_t rejected;
+} Predicate;
 
-            // Free allocated memory before exiting
-            for (int j = 0; j < size; j++) {
-                free(param_names[j]);
-            }
-            for (int j = 0; j < copy_size; j++) {
-                free(no_quote_params[j]);
-            }
+// Conjunction of predicates from --where, evaluated most selective first
+// Every loop works on its own copy since evaluation reorders it
+typedef struct {
+    Predicate preds[MAX_PREDICATES];
+    int order[MAX_PREDICATES];
+    int count;
+    int max_field;  // last field any predicate reads
+    size_t rows;    // rows seen since the last reorder
+} Filter;
 
-            free(param_names);
-            free(data);
-            return EXIT_FAILURE;
-        }
+// Unique monitoring sites (state, county, site number) and a k-d tree over their coordinates
+// rows of site s are rows[row_starts[s] .. row_starts[s + 1]), in file order
+typedef struct {
+    size_t count;
+    double *lat;
+    double *lon;
+    uint32_t *reps;       // first row of each site
+    size_t *row_starts;
+    uint32_t *rows;
+    uint32_t *tree;       // sites with coordinates, node [lo, hi) splits at its middle
+    size_t tree_count;
+} SiteIndex;
 
-        int k = 0;  // Separate index for no_quote_params
-        for (int j = 0; j < len; j++) {
-            if (param_names[i][j] == '"') {
-                continue;
-            } 
-            no_quote_params[i][k++] = param_names[i][j];
-        }
-        no_quote_params[i][k] = '\0';  // Null-terminate the string
-    }
+#define TOP_SITE_KEY 24
 
-    // If all goes well, free the relevant pointers
-    // Print the unique parameters
-    printf("Unique parameters:\n");
-    for (int i = 0; i < size; i++) 
-    {
-        printf("Parameter %i: %s\n", i + 1, no_quote_params[i]);
-    }
-    
-    // Buffer for Autocomplete Function
-    char buffer[200];
-    
-    // Get Parameter for In-Line Autocomplete
-    autocomplete(buffer, size, no_quote_params);
+// One candidate for --top, record holds the original line in streaming mode (NULL for loaded rows)
+typedef struct {
+    double value;
+    char site[TOP_SITE_KEY];  // "state-county-site", ties rank by it ascending
+    uint64_t seq;             // row id or record number, the last tie break
+    char *record;
+    size_t len;
+} TopEntry;
 
-    // Free data once passed down the pipeline
-    for (int i = 0; i < size; i++) 
-    {
-        free(param_names[i]);
-        free(no_quote_params[i]);
-    }
+// Bounded heap of the k best entries so far, the root ranks last
+typedef struct {
+    TopEntry *items;
+    size_t len;
+    size_t k;
+} TopHeap;
 
-    free(param_names);
-    free(no_quote_params);
-    free(data);
+// Rows holding a value in one datetime column, ordered by it (ties in file order)
+typedef struct {
+    int field;
+    size_t count;
+    int64_t *times;   // ascending
+    uint32_t *rows;   // rows[i] holds times[i]
+} TimeIndex;
 
-    return EXIT_SUCCESS;
-}
+// Command line options
+// filename is files[0], directories and glob patterns are expanded into files
+typedef struct {
+    const char *filename;
+    char **files;
+    int file_count;
+    bool use_mmap;
+    bool lazy;  // index offsets only, materialize the selected rows
+    bool prescan;
+    bool columnar;
+    int threads;
+    bool bench;
+    long long generate;  // rows to generate, 0 when not generating
+    uint64_t seed;
+    const char *param;
+    bool cache;
+    const char *group;  // --group key list, NULL when not aggregating
+    const char *agg;
+    const char *where;
+    Filter *filter;     // compiled from where, NULL when every row is kept
+    const char *export_path;  // Arrow IPC file for the selected rows
+    bool near;                // --near lat,lon within radius_km
+    double near_lat;
+    double near_lon;
+    double radius_km;
+    bool bbox;                // --bbox lat_min,lon_min,lat_max,lon_max
+    double box[4];
+    const char *time;         // --time field=from[..to] over a datetime column
+    size_t top;               // --top K rows ranked by top_field, 0 when not ranking
+    int top_field;            // --by column
+    bool serve;               // answer JSON queries instead of prompting
+    const char *socket_path;  // --serve=path listens there, stdin / stdout otherwise
+} Options;
 
-/* takes 2 params, the filename and a pointer
-  to size_t where the number of data points is stored */
+// * Functions * // 
 
-AQSData *read_data(const char *filename, size_t *len) 
-{
-    if (filename == NULL || len == NULL) return NULL;
+// Read data from CSV file
+// prescan counts the rows first so the arena is sized exactly
+// Rows failing filter (may be NULL) are dropped before they are split
+AQSArena *read_data(const char *filename, size_t *len, bool prescan, const Filter *filter);
 
-    // Open File
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) 
-    {
-        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
-        return NULL;
-    }
+// Convert the split fields of one line into rec, numbers flagged in rec->missing when empty
+void record_fill(AQSData *rec, char **tokens);
 
-    // Set arr and tmp for data manip
-    AQSData *arr = NULL, *tmp;
-    *len = 0;
+// Arena holding parsed records, everything is released by arena_free
+AQSArena *arena_create(size_t chunk_records);
+AQSData *arena_push(AQSArena *arena);
+void arena_free(AQSArena *arena);
 
-    // Assuming that no line will be longer than 1023 chars
-    char line[MAX_LENGTH];
+// Count the lines in a file without parsing them
+size_t count_rows(const char *filename);
 
-    // Read one line at a time
-    while (fgets(line, sizeof(line), fp)) 
-    {
-        tmp = realloc(arr, (*len + 1) * sizeof(*arr));
-        if (tmp == NULL) {
-            fprintf(stderr, "could not parse the whole file %s\n", filename);
-            // Free any previously parsed data
-            if (*len == 0) {
-                free(arr);
-                arr = NULL;
-            }
-            return arr;
-        }
+// Function to Parse Each Line
+char *parse_csv_line(char *line, int len);
 
-        arr = tmp;
+// Function for Autocomplete, index (may be NULL) adds live substring and fuzzy matches
+void autocomplete(char *buffer, int param_count, char **param_names, const NgramIndex *index);
 
-        // Parse the CSV line into the structure
-        char *token = parse_csv_line(line, MAX_LENGTH);
-        
-        // Get token with Unit Separator as delimiter
-        token = strtok(token, "\x1F");
-        
-        int field = 0;
+// Range [*lo, *hi) of comp-sorted names starting with prefix, O(log n + prefix)
+void prefix_range(char **names, int count, const char *prefix, size_t len, int *lo, int *hi);
 
-        while (token != NULL && field < MAX_FIELDS) 
-        {
-            // Assign the token to the appropriate field in the struct
-            switch (field)
-            {
-                case 0:
-                    strncpy(arr[*len].state_code, token, sizeof(arr[*len].state_code) - 1);
-                    arr[*len].state_code[sizeof(arr[*len].state_code) - 1] = '\0';
-                    break;
-                case 1:
-                    strncpy(arr[*len].county_code, token, sizeof(arr[*len].county_code) - 1);
-                    arr[*len].county_code[sizeof(arr[*len].county_code) - 1] = '\0';
-                    break;
-                case 2:
-                    strncpy(arr[*len].site_num, token, sizeof(arr[*len].site_num) - 1);
-                    arr[*len].site_num[sizeof(arr[*len].site_num) - 1] = '\0';
-                    break;
-                case 3:
-                    strncpy(arr[*len].parameter_code, token, sizeof(arr[*len].parameter_code) - 1);
-                    arr[*len].parameter_code[sizeof(arr[*len].parameter_code) - 1] = '\0';
-                    break;
-                case 4:
-                    arr[*len].poc = atoi(token);
-                    break;
-                case 5:
-                    arr[*len].latitude = atof(token);
-                    break;
-                case 6:
-                    arr[*len].longitude = atof(token);
-                    break;
-                case 7:
-                    strncpy(arr[*len].datum, token, sizeof(arr[*len].datum) - 1);
-                    arr[*len].datum[sizeof(arr[*len].datum) - 1] = '\0';
-                    break;
-                case 8:
-                    strncpy(arr[*len].parameter_name, token, sizeof(arr[*len].parameter_name) - 1);
-                    arr[*len].parameter_name[sizeof(arr[*len].parameter_name) - 1] = '\0';
-                    break;
-                case 9:
-                    strncpy(arr[*len].sample_duration, token, sizeof(arr[*len].sample_duration) - 1);
-                    arr[*len].sample_duration[sizeof(arr[*len].sample_duration) - 1] = '\0';
-                    break;
-                case 10:
-                    strncpy(arr[*len].pollutant_standard, token, sizeof(arr[*len].pollutant_standard) - 1);
-                    arr[*len].pollutant_standard[sizeof(arr[*len].pollutant_standard) - 1] = '\0';
-                    break;
-                case 11:
-                    strncpy(arr[*len].metric_used, token, sizeof(arr[*len].metric_used) - 1);
-                    arr[*len].metric_used[sizeof(arr[*len].metric_used) - 1] = '\0';
-                    break;
-                case 12:
-                    strncpy(arr[*len].method_name, token, sizeof(arr[*len].method_name) - 1);
-                    arr[*len].method_name[sizeof(arr[*len].method_name) - 1] = '\0';
-                    break;
-                case 13:
-                    arr[*len].year = atoi(token);
-                    break;
-                case 14:
-                    strncpy(arr[*len].units_of_measure, token, sizeof(arr[*len].units_of_measure) - 1);
-                    arr[*len].units_of_measure[sizeof(arr[*len].units_of_measure) - 1] = '\0';
-                    break;
-                case 15:
-                    strncpy(arr[*len].event_type, token, sizeof(arr[*len].event_type) - 1);
-                    arr[*len].event_type[sizeof(arr[*len].event_type) - 1] = '\0';
-                    break;
-                case 16:
-                    arr[*len].observation_count = atoi(token);
-                    break;
-                case 17:
-                    arr[*len].observation_percent = atoi(token);
-                    break;
-                case 18:
-                    arr[*len].completeness_indicator = token[0];
-                    break;
-                case 19:
-                    arr[*len].valid_day_count = atoi(token);
-                    break;
-                case 20:
-                    arr[*len].required_day_count = atoi(token);
-                    break;
-                case 21:
-                    arr[*len].exceptional_data_count = atoi(token);
-                    break;
-                case 22:
-                    arr[*len].null_data_count = atoi(token);
-                    break;
-                case 23:
-                    arr[*len].primary_exceedance_count = atoi(token);
-                    break;
-                case 24:
-                    arr[*len].secondary_exceedance_count = atoi(token);
-                    break;
-                case 25:
-                    strncpy(arr[*len].certification_indicator, token, sizeof(arr[*len].certification_indicator) - 1);
-                    arr[*len].certification_indicator[sizeof(arr[*len].certification_indicator) - 1] = '\0';
-                    break;
-                case 26:
-                    arr[*len].num_obs_below_mdl = atoi(token);
-                    break;
-                case 27:
-                    arr[*len].arithmetic_mean = atof(token);
-                    break;
-                case 28:
-                    arr[*len].arithmetic_std_dev = atof(token);
-                    break;
-                case 29:
-                    arr[*len].first_max_value = atof(token);
-                    break;
-                case 30:
-                    strncpy(arr[*len].first_max_datetime, token, sizeof(arr[*len].first_max_datetime) - 1);
-                    arr[*len].first_max_datetime[sizeof(arr[*len].first_max_datetime) - 1] = '\0';
-                    break;
-                case 31:
-                    arr[*len].second_max_value = atof(token);
-                    break;
-                case 32:
-                    strncpy(arr[*len].second_max_datetime, token, sizeof(arr[*len].second_max_datetime) - 1);
-                    arr[*len].second_max_datetime[sizeof(arr[*len].second_max_datetime) - 1] = '\0';
-                    break;
-                case 33:
-                    arr[*len].third_max_value = atof(token);
-                    break;
-                case 34:
-                    strncpy(arr[*len].third_max_datetime, token, sizeof(arr[*len].third_max_datetime) - 1);
-                    arr[*len].third_max_datetime[sizeof(arr[*len].third_max_datetime) - 1] = '\0';
-                    break;
-                case 35:
-                    arr[*len].fourth_max_value = atof(token);
-                    break;
-                case 36:
-                    strncpy(arr[*len].fourth_max_datetime, token, sizeof(arr[*len].fourth_max_datetime) - 1);
-                    arr[*len].fourth_max_datetime[sizeof(arr[*len].fourth_max_datetime) - 1] = '\0';
-                    break;
-                case 37:
-                    arr[*len].first_no_max_value = atof(token);
-                    break;
-                case 38:
-                    strncpy(arr[*len].first_no_max_datetime, token, sizeof(arr[*len].first_no_max_datetime) - 1);
-                    arr[*len].first_no_max_datetime[sizeof(arr[*len].first_no_max_datetime) - 1] = '\0';
-                    break;
-                case 39:
-                    arr[*len].second_no_max_value = atof(token);
-                    break;
-                case 40:
-                    strncpy(arr[*len].second_no_max_datetime, token, sizeof(arr[*len].second_no_max_datetime) - 1);
-                    arr[*len].second_no_max_datetime[sizeof(arr[*len].second_no_max_datetime) - 1] = '\0';
-                    break;
-                case 41:
-                    arr[*len].percentile_99 = atof(token);
-                    break;
-                case 42:
-                    arr[*len].percentile_98 = atof(token);
-                    break;
-                case 43:
-                    arr[*len].percentile_95 = atof(token);
-                    break;
-                case 44:
-                    arr[*len].percentile_90 = atof(token);
-                    break;
-                case 45:
-                    arr[*len].percentile_75 = atof(token);
-                    break;
-                case 46:
-                    arr[*len].percentile_50 = atof(token);
-                    break;
-                case 47:
-                    arr[*len].percentile_10 = atof(token);
-                    break;
-                case 48:
-                    strncpy(arr[*len].local_site_name, token, sizeof(arr[*len].local_site_name) - 1);
-                    arr[*len].local_site_name[sizeof(arr[*len].local_site_name) - 1] = '\0';
-                    break;
-                case 49:
-                    strncpy(arr[*len].address, token, sizeof(arr[*len].address) - 1);
-                    arr[*len].address[sizeof(arr[*len].address) - 1] = '\0';
-                    break;
-                case 50:
-                    strncpy(arr[*len].state_name, token, sizeof(arr[*len].state_name) - 1);
-                    arr[*len].state_name[sizeof(arr[*len].state_name) - 1] = '\0';
-                    break;
-                case 51:
-                    strncpy(arr[*len].county_name, token, sizeof(arr[*len].county_name) - 1);
-                    arr[*len].county_name[sizeof(arr[*len].county_name) - 1] = '\0';
-                    break;
-                case 52:
-                    strncpy(arr[*len].county_name, token, sizeof(arr[*len].county_name) - 1);
-                    arr[*len].county_name[sizeof(arr[*len].county_name) - 1] = '\0';
-                    break;
-                case 53:
-                    strncpy(arr[*len].city_name, token, sizeof(arr[*len].city_name) - 1);
-                    arr[*len].city_name[sizeof(arr[*len].city_name) - 1] = '\0';
-                    break;
-                case 54:
-                    strncpy(arr[*len].cbsa_name, token, sizeof(arr[*len].cbsa_name) - 1);
-                    arr[*len].cbsa_name[sizeof(arr[*len].cbsa_name) - 1] = '\0';
-                    break;
-                case 55:
-                    strncpy(arr[*len].date_of_last_change, token, sizeof(arr[*len].date_of_last_change) - 1);
-                    arr[*len].date_of_last_change[sizeof(arr[*len].date_of_last_change) - 1] = '\0';
-                    break;
-            }
-            field++;
-            token = strtok(NULL, "\x1F");
-        }
-        (*len)++;
-    }
+// Tab / Shift+Tab cycling over prefix_range, or over the n-gram matches when no name has the prefix
+void completer_init(Completer *state, char **names, int count, const NgramIndex *index);
+void completer_type(Completer *state, char c);
+void completer_backspace(Completer *state);
+void completer_cycle(Completer *state, int step);
+const char *completer_text(const Completer *state);
 
-    fclose(fp);
-    return arr;
-}
+// Function to compare nums and letters for qsort
+int comp(const void *a, const void *b);
 
-// Parse line, replace with more efficient delimiter, make all lowercase
-char* parse_csv_line(char *line, int len) 
-{
-    bool in_quotes = false;
-    char *ptr = line;
+// Index names[0 .. count), lens may be NULL for NUL-terminated names; the strings must outlive the index
+NgramIndex *ngram_index_build(const char *const *names, const size_t *lens, size_t count);
+void ngram_index_free(NgramIndex *index);
 
-    for (int i = 0; i < len; i++)
-    {        
-        // Need lowercase for comprehensive qsort
-        ptr[i] = tolower(ptr[i]);
-        // if double quotes and comma not after, we're in a column
-        if (ptr[i] == '"' && ptr[i + 1] != ',') 
-        {
-            in_quotes = true;
-        // Else if , following ", we're leaving the column
-        } else if (ptr[i] == '"' && ptr[i + 1] == ',')
-        {
-            in_quotes = false;
-        }
+// Up to cap best names containing query, or within about one edit per four characters of it, best first
+// Returns how many were written to out
+size_t ngram_search(const NgramIndex *index, const char *query, size_t len, NgramMatch *out, size_t cap);
 
-        // Change to a nearly impossible single char delimiter for ease because I am so sick of commas, f*** you commas
-        if (!in_quotes && ptr[i] == ',')
-        {
-            // Ascii unit separator
-            ptr[i] = '\x1F';
-        }
+// Parse flags and the input paths, returns 0 on success
+int parse_args(int argc, char *argv[], Options *opts);
+void free_args(Options *opts);
 
-        // End if Null Terminator Encountered
-        if (ptr[i] == '\0') break;
-    }
+// Append path to opts->files, expanding directories (*.csv) and glob patterns
+int add_input(Options *opts, const char *path);
 
-    return ptr;
+// Record i of the arena
+static inline AQSData *arena_at(const AQSArena *arena, size_t i)
+{
+    return &arena->chunks[i / arena->chunk_records][i % arena->chunk_records];
 }
 
-void autocomplete(char *buffer, int param_count, char **param_names) 
+// Map a whole file read-only, returns 0 on success
+// Compressed files are inflated into an owned buffer instead
+int map_file(const char *filename, MappedFile *file);
+void unmap_file(MappedFile *file);
+
+// Classify one 64-byte block (n < 64 bytes are zero padded)
+void scan_block(const char *p, size_t n, BlockMasks *m);
+// Choose the scan_block kernel once, before any worker thread starts
+void scan_block_init(void);
+
+// Bit i of the result is the XOR of bits 0..i, turns quote marks into quoted regions
+static inline uint64_t prefix_xor(uint64_t x)
 {
-    int index = 0;
-    int match_count = 0;
-    int last_match_index = -1;
-    char c;
-    bool tabbed = false;
-    printf("Enter parameter (Tab for autocomplete and Increment, Shift + Tab to Decrement):\n");
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
 
-    while (1) {
-        #ifdef _WIN32
-            c = _getch();
-        #else
-            c = getch();
-        #endif
+// Index of the lowest set bit, x must be non zero
+static inline int lowest_bit(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) { x >>= 1; n++; }
+    return n;
+#endif
+}
 
-        if (c == '\n' || c == '\r') 
-        {
-            buffer[index] = '\0';
-            printf("\n");
-            break;
-        } else if (c == 127 || c == '\b') 
-        {
-            if (index > 0) {
-                index--;
-                printf("\b \b");
-            }
-        } else if (c == '\t') 
-        {  // Tab key → Cycle through suggestions
-            tabbed = true;
-            match_count = 0;
-            int first_match_index = -1;
+// Split a line read by fgets in place, tokens[f] points at field f with quotes removed
+// Lowercases the line like parse_csv_line, returns the number of fields
+int split_csv_line(char *line, size_t len, char **tokens);
 
-            for (int i = 0; i < param_count; i++)
-            {
-                if (strncmp(param_names[i], buffer, index) == 0) 
-                {
-                    if (match_count == 0) 
-                    {
-                        first_match_index = i;
-                    }
-                    match_count++;
+// Strip quotes and lowercase into dst (len + 1 bytes), returns the new length
+size_t normalize_name(const char *name, size_t len, char *dst);
 
-                    if (last_match_index == -1 || last_match_index < i) 
-                    {
-                        last_match_index = i;
-                        strcpy(buffer, param_names[i]);
-                        printf("\r%-50s", buffer);  // Overwrite the input line
-                        index = 0;
-                        break;
-                    }
-                }
-            }
-            
-            if (match_count > 0 && last_match_index == param_count - 1) 
-            {
-                last_match_index = first_match_index - 1; // Restart cycling
+// Parameter interning, raw names may still carry quotes and any case
+ParamTable *param_table_create(void);
+void param_table_free(ParamTable *table);
+
+// Id of name (counted once more), -1 if the table could not grow
+int32_t param_intern(ParamTable *table, const char *name, size_t len);
+
+// Id of name without counting it, -1 if it was never interned
+int32_t param_lookup(const ParamTable *table, const char *name, size_t len);
+
+// Columnar load plus parameter index, served from the sidecar when --cache finds a fresh one
+Dataset *load_dataset(const char *filename, const Options *opts);
+void dataset_free(Dataset *ds);
+
+// One dataset over several files, each file is read by its own worker (and cache)
+Dataset *load_datasets(char **files, int count, const Options *opts);
+
+// Source file of a row
+static inline const char *dataset_source(const Dataset *ds, size_t row)
+{
+    return ds->sources[ds->source_ids ? ds->source_ids[row] : 0];
+}
+
+// Intern parameter_name for every row and build the per-parameter row index
+int dataset_index_params(Dataset *ds);
+
+// Rows carrying parameter id, in file order
+static inline const uint32_t *dataset_param_rows(const Dataset *ds, int32_t id, size_t *n)
+{
+    *n = ds->param_starts[id + 1] - ds->param_starts[id];
+    return ds->param_rows + ds->param_starts[id];
+}
+
+// Sidecar I/O, keyed by the size and mtime of the CSV
+Dataset *cache_load(const char *filename);
+int cache_write(const char *filename, const Dataset *ds);
+
+// Open a plain, .gz or .zip input, returns 0 on success
+int source_open(ByteSource *src, const char *filename);
+void source_close(ByteSource *src);
+
+// Up to cap bytes into dst, *n is 0 at the end of input. Returns -1 on a read or inflate error
+int source_read(ByteSource *src, char *dst, size_t cap, size_t *n);
+
+// Container of a file from its magic bytes
+InputFormat input_format(const char *filename);
+
+// Streaming reader, records may be any length, the buffer grows to fit
+int reader_open(RecordReader *r, const char *filename);
+void reader_close(RecordReader *r);
+
+// fgets over a reader, lines longer than size - 1 come back in pieces
+// NULL at the end of input or on an error, r->error tells them apart
+char *reader_gets(RecordReader *r, char *line, size_t size);
+
+// Next record with its first max_fields fields located, row->offset indexes r->buf
+// *len covers the whole record including its newline. Returns 0 at end of input
+int reader_next(RecordReader *r, int max_fields, AQSRowView *row, size_t *len);
+
+// Copy every row whose parameter_name matches param (and filter) to out, and the header if asked
+int stream_reduce(const char *filename, const char *param, const Filter *filter, FILE *out, bool header);
+
+// Time every loading stage on one file, MB/s and rows/s per stage
+int bench(const char *filename, int threads);
+
+// Write a synthetic AQS annual-concentration CSV with rows rows
+int generate_data(const char *filename, size_t rows, uint64_t seed);
+
+// Column index of a field name or short alias (state, county, site), -1 if unknown
+int field_index(const char *name, size_t len);
+
+// Parse "state,year" and "mean:arithmetic_mean,count", returns 0 on success
+int parse_group_spec(const char *group, const char *agg, GroupSpec *spec);
+
+// Aggregate rows[0 .. n) of cols by spec on up to threads workers
+GroupTable *group_rows(const AQSColumns *cols, const uint32_t *rows, size_t n, const GroupSpec *spec, int threads);
+void group_table_free(GroupTable *table);
+
+// Write the groups as CSV sorted by key
+void group_print(const GroupTable *table, FILE *out);
+
+// Quantile sketches, a zeroed TDigest is empty
+void tdigest_add(TDigest *digest, double mean, double weight);
+void tdigest_merge(TDigest *dst, const TDigest *src);
+void tdigest_free(TDigest *digest);
+
+// Value below which a fraction q of the weight lies, NaN when empty
+double tdigest_quantile(TDigest *digest, double q);
+
+// Seed digest with the distribution one row summarises: its percentile_* columns weighted by observation_count
+// Rows without a count or percentiles add nothing, returns whether the row was used
+bool tdigest_add_row(TDigest *digest, const AQSColumns *cols, uint32_t row);
+
+// Unique sites of cols with their row lists and k-d tree
+SiteIndex *site_index_build(const AQSColumns *cols);
+void site_index_free(SiteIndex *index);
+
+// Sites within radius_km of (lat, lon) nearest first, out needs room for index->count
+size_t site_near(const SiteIndex *index, double lat, double lon, double radius_km, uint32_t *out);
+
+// Sites inside a latitude / longitude box, lon_min > lon_max wraps across the antimeridian
+size_t site_bbox(const SiteIndex *index, double lat_min, double lon_min, double lat_max, double lon_max, uint32_t *out);
+
+// Great circle distance in km
+double haversine_km(double lat1, double lon1, double lat2, double lon2);
+
+// Append the rows of site that are also in the sorted rows[0 .. n) to out, returns how many
+size_t site_keep(const SiteIndex *index, uint32_t site, const uint32_t *rows, size_t n, uint32_t *out);
+
+// Rows of rows[0 .. *n) at the sites --near / --bbox match, in file order, printing the sites
+uint32_t *spatial_select(const Dataset *ds, const Options *opts, const uint32_t *rows, size_t *n);
+
+// Sort the rows of a COL_TIME column by value, missing values are left out
+TimeIndex *time_index_build(const AQSColumns *cols, int field);
+void time_index_free(TimeIndex *index);
+
+// Binary search for the entries with from <= time < to, returns how many and sets *first
+size_t time_range(const TimeIndex *index, int64_t from, int64_t to, size_t *first);
+
+// Parse field=from[..to] into a COL_TIME field and the half-open range [*start, *end), 0 on success
+int time_spec_parse(const char *spec, int *field, int64_t *start, int64_t *end);
+
+// Rows of the sorted rows[0 .. n) with from <= time < to written to out in file order, returns how many
+size_t time_keep(const TimeIndex *index, int64_t from, int64_t to, const uint32_t *rows, size_t n, uint32_t *out);
+
+// Rows of rows[0 .. *n) whose --time column falls in its range, in file order
+uint32_t *time_select(const Dataset *ds, const char *spec, const uint32_t *rows, size_t *n);
+
+// Bounded top-k selection, a pushed entry's record is freed when it is evicted
+int top_heap_init(TopHeap *heap, size_t k);
+void top_heap_free(TopHeap *heap);
+
+// Whether an entry with value could still make the heap, cheap enough to test before building it
+bool top_accepts(const TopHeap *heap, double value);
+
+// Insert entry when it ranks before the current last, returns whether it was kept
+bool top_push(TopHeap *heap, const TopEntry *entry);
+
+// Put the kept entries in rank order, the heap is no longer a heap afterwards
+void top_heap_sort(TopHeap *heap);
+
+// The k rows of rows[0 .. *n) with the highest value in field, best first, ties by site key then row
+// Each worker keeps a heap of k over its slice, O(n log k), *n is set to how many were found
+uint32_t *top_rows(const AQSColumns *cols, const uint32_t *rows, size_t *n, int field, size_t k, int threads);
+
+// Streaming --top: the k matching records of files ranked by field, written as read under the first header
+int stream_top(char **files, int count, const char *param, const Filter *filter, int field, size_t k, FILE *out);
+
+// Write rows[0 .. n) of cols as CSV under a header of field names
+void write_rows_csv(FILE *out, const AQSColumns *cols, const uint32_t *rows, size_t n);
+
+// Write the records of arena as CSV under the same header, text as the records hold it (lowercased)
+void write_records_csv(FILE *out, const AQSArena *arena);
+
+// Write rows[0 .. n) of cols as an Arrow IPC (Feather v2) file, batch by batch
+int export_arrow(const char *path, const AQSColumns *cols, const uint32_t *rows, size_t n);
+
+// Compile "year>=2015 && state_code=06", NULL with a message on a bad expression
+Filter *filter_compile(const char *expr);
+
+// Whether a record located up to filter->max_field passes every predicate
+bool filter_row(Filter *filter, const char *data, const AQSRowView *row);
+
+// Whether the record at start passes, only the fields the filter reads are located
+// *next is set past the record either way
+bool filter_record(Filter *filter, const char *data, size_t start, size_t size, size_t *next);
+
+// Keep the loaded rows of rows[0 .. n) passing every predicate, in place, returns how many (-1 on allocation failure)
+// Dictionary columns are tested once per distinct string, rows then only look up their code
+int64_t filter_columns(const Filter *filter, const AQSColumns *cols, uint32_t *rows, size_t n);
+
+// Monotonic wall clock in seconds
+double now_seconds(void);
+
+// Clock for a stage about to start, the clock is never read without --stats
+static inline double stats_begin(void)
+{
+    return STATS.enabled ? now_seconds() : 0;
+}
+
+// Charge the time since start to stage, returns now so stages can be chained
+static inline double stats_lap(Stage stage, double start)
+{
+    if (!STATS.enabled) return 0;
+
+    double now = now_seconds();
+    STATS.seconds[stage] += now - start;
+    STATS.calls[stage]++;
+    return now;
+}
+
+#define stats_count(counter, n) do { if (STATS.enabled) STATS_ADD(STATS.counter, (n)); } while (0)
+
+// Largest resident set so far in bytes, 0 where unknown
+uint64_t peak_rss_bytes(void);
+
+// Print the --stats report as a table or JSON
+void stats_report(FILE *out);
+
+// Field boundaries of the record at start, only the first max_fields are located
+// Returns the offset of its newline, or size if the data ran out first
+size_t scan_record(const char *data, size_t start, size_t size, int max_fields, AQSRowView *row, int *fields);
+
+// Find the field boundaries of the record at *pos and advance *pos past it
+// Returns the number of fields, 0 for a blank line, -1 for an oversized record
+int tokenize_record(const char *data, size_t *pos, size_t size, AQSRowView *row);
+
+// Map a CSV and tokenize every record in place, the mmap counterpart of read_data
+AQSView *map_data(const char *filename, size_t *len, const Filter *filter);
+void free_view(AQSView *view);
+
+// First pass of --lazy: map the file and locate each record and its parameter_name only
+LazyIndex *lazy_index(const char *filename, size_t *len, const Filter *filter);
+void lazy_free(LazyIndex *index);
+
+// Parse every record of parameter id into a new arena, exactly like read_data would
+AQSArena *lazy_materialize(const LazyIndex *index, int32_t id);
+
+// Locate one field of a tokenized record, no copying
+FieldView row_field(const char *data, const AQSRowView *row, int field);
+FieldView view_field(const AQSView *view, size_t row, int field);
+
+// Copy a field out of the mapping (unescaping ""), returns the copied length
+size_t copy_field(const char *data, FieldView field, char *dst, size_t cap);
+size_t view_copy(const AQSView *view, FieldView field, char *dst, size_t cap);
+
+// Columnar store, every column grows together
+AQSColumns *columns_create(void);
+int columns_reserve(AQSColumns *cols, size_t capacity);
+void columns_free(AQSColumns *cols);
+
+// Convert one tokenized record into the next row of every column
+int columns_append(AQSColumns *cols, const char *data, const AQSRowView *row);
+
+// Append all of src to dst, string offsets are rebased onto dst's blobs
+int columns_concat(AQSColumns *dst, const AQSColumns *src);
+
+// New columns holding rows[0 .. n) of src, dictionary columns keep src's pool
+AQSColumns *columns_gather(const AQSColumns *src, const uint32_t *rows, size_t n);
+
+// Map a CSV and load everything but the header into columns
+// The file is split across up to threads workers, results keep file order
+AQSColumns *load_columns(const char *filename, int threads, const Filter *filter);
+
+// Load a compressed input on this thread while the inflater thread decodes ahead
+AQSColumns *load_stream(const char *filename, const Filter *filter);
+
+// Parse the records in [begin, end) of a mapping into cols, keeping those that pass filter
+int load_range(const char *data, size_t begin, size_t end, AQSColumns *cols, bool skip_header, const Filter *filter);
+
+// Run fn(arg + i * arg_size) for i < count, one thread each where available
+void run_parallel(int count, void *(*fn)(void *), void *args, size_t arg_size);
+
+// Number of online CPUs, 1 if unknown
+int cpu_count(void);
+
+// Whether row i of a numeric column held a value
+static inline bool column_valid(const Column *col, size_t i)
+{
+    return (col->valid[i >> 3] >> (i & 7)) & 1;
+}
+
+// Locale-free numeric parsing straight from a field view, NaN / 0 when not NUM_OK
+NumStatus parse_double(const char *p, size_t len, double *out);
+NumStatus parse_int(const char *p, size_t len, int32_t *out);
+
+// Fixed-format "YYYY[-MM[-DD[ HH[:MM[:SS]]]]]" as seconds since 1970, no time zone applied
+// end (may be NULL) receives the end of the period the text names, e.g. 2021-07 ends at 2021-08-01 00:00
+NumStatus parse_datetime(const char *p, size_t len, int64_t *start, int64_t *end);
+
+// Write t as "YYYY-MM-DD HH:MM" (":SS" only when non-zero) into out[20], returns the length
+size_t format_time(int64_t t, char *out);
+
+// String i of a COL_STR or COL_DICT column
+static inline const char *column_str(const Column *col, size_t i, size_t *len)
+{
+    size_t k = col->type == COL_DICT ? col->codes[i] : i;
+    *len = col->offsets[k + 1] - col->offsets[k];
+    return col->blob + col->offsets[k];
+}
+
+// Whether a column type holds text rather than numbers
+static inline bool column_text(ColumnType type)
+{
+    return type == COL_STR || type == COL_DICT;
+}
+
+// Code of a string in a COL_DICT column, added to its pool when new, -1 when out of memory
+int64_t dict_intern(Column *col, const char *s, size_t len);
+
+// Answer newline-delimited JSON requests on a pool of opts->threads workers, on stdin or opts->socket_path
+// Returns when stdin ends (every request answered), a socket serves until the process is stopped
+int serve(const Dataset *ds, const Options *opts);
+
+// * MAIN * //
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+
+    scan_block_init();
+
+    if (parse_args(argc, argv, &opts) != 0)
+    {
+        free_args(&opts);
+        printf("Error: Not enough arguments\nUsage: ./reduce [--mmap | --lazy | --columnar] [--prescan] [--threads N] [--cache] [--bench] [--generate ROWS [--seed N]] [--param NAME] [--group KEYS [--agg OP:FIELD,...]] [--where EXPR] [--export FILE.arrow] [--near LAT,LON [--radius-km R] | --bbox LAT0,LON0,LAT1,LON1] [--time FIELD=FROM[..TO]] [--top K --by FIELD] [--stats[=json]] [--serve[=SOCKET]] input_file_path... (files, directories or globs)\n");
+        return EXIT_FAILURE;
+    }
+
+    // Compiled once, every loader copies it
+    if (opts.where && (opts.filter = filter_compile(opts.where)) == NULL)
+    {
+        free_args(&opts);
+        return EXIT_FAILURE;
+    }
+
+    // Streaming top-k, one heap across every file, only the kept records are copied
+    if (opts.param && opts.top)
+    {
+        double t = stats_begin();
+        int status = stream_top(opts.files, opts.file_count, opts.param, opts.filter, opts.top_field, opts.top, stdout);
+        stats_lap(STAGE_READ, t);
+        if (STATS.enabled) stats_report(stderr);
+        free_args(&opts);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Streaming reduce, nothing is loaded, files are concatenated under one header
+    if (opts.param)
+    {
+        int status = EXIT_SUCCESS;
+        for (int i = 0; i < opts.file_count && status == EXIT_SUCCESS; i++)
+        {
+            // Reading, matching and writing are one pass here, all charged to read
+            double t = stats_begin();
+            if (stream_reduce(opts.files[i], opts.param, opts.filter, stdout, i == 0) != 0) status = EXIT_FAILURE;
+            stats_lap(STAGE_READ, t);
+        }
+        if (STATS.enabled) stats_report(stderr);
+        free_args(&opts);
+        return status;
+    }
+
+    // Benchmark and generator only, nothing else runs
+    if (opts.bench || opts.generate > 0)
+    {
+        int status = opts.bench
+            ? bench(opts.filename, opts.threads)
+            : generate_data(opts.filename, opts.generate, opts.seed);
+        free_args(&opts);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    size_t aqs_len;
+    AQSArena *data = NULL;
+    AQSView *view = NULL;
+    LazyIndex *lazy = NULL;
+    Dataset *dataset = NULL;
+
+    double t = stats_begin();
+
+    // Populate structs, or just index the mapping when --mmap is given
+    if (opts.use_mmap)
+    {
+        view = map_data(opts.filename, &aqs_len, opts.filter);
+        t = stats_lap(STAGE_LOAD, t);
+    } else if (opts.columnar)
+    {
+        // parse_args sends several inputs, group-by, export, spatial queries and the server here
+        dataset = load_datasets(opts.files, opts.file_count, &opts);
+        aqs_len = dataset ? dataset->cols->len : 0;
+        t = stats_lap(STAGE_LOAD, t);
+    } else if (opts.lazy)
+    {
+        lazy = lazy_index(opts.filename, &aqs_len, opts.filter);
+        t = stats_lap(STAGE_LOAD, t);
+    } else 
+    {
+        // read_data times its own stages line by line
+        data = read_data(opts.filename, &aqs_len, opts.prescan, opts.filter);
+    }
+
+    // The arena, the view and the lazy index count the header as a row
+    stats_count(rows, dataset ? aqs_len : aqs_len > 0 ? aqs_len - 1 : 0);
+
+    // Check for error first
+    if(data == NULL && view == NULL && lazy == NULL && dataset == NULL)
+    {
+        fprintf(stderr, "Failed to read data\n");
+        free_args(&opts);
+        return EXIT_FAILURE;
+    }
+
+    // Loaded once, then every request runs against the same columns
+    if (opts.serve)
+    {
+        int status = serve(dataset, &opts);
+        if (STATS.enabled) stats_report(stderr);
+        dataset_free(dataset);
+        free_args(&opts);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Intern every parameter_name, quotes and case are normalised once per distinct name
+    // The columnar dataset already did this while loading (or read it from its cache)
+    ParamTable *params = dataset ? dataset->params : param_table_create();
+
+    if (!params)
+    {
+        perror("Failed to allocate params");
+        arena_free(data);
+        free_view(view);
+        lazy_free(lazy);
+        dataset_free(dataset);
+        return EXIT_FAILURE;
+    }
+
+    t = stats_begin();
+
+    // i = 1 to skip header
+    for (size_t i = 1; !dataset && i < aqs_len; i++)
+    {
+        const char *name;
+        size_t name_len;
+
+        if (view)
+        {
+            // Straight out of the mapping, nothing is copied
+            FieldView field = view_field(view, i, 8);
+            name = view->file.data + field.offset;
+            name_len = field.length;
+        } else if (lazy)
+        {
+            name = lazy->file.data + lazy->offsets[i] + lazy->name_starts[i];
+            name_len = lazy->name_lens[i];
+        } else 
+        {
+            name = arena_at(data, i)->parameter_name;
+            name_len = strlen(name);
+        }
+
+        int32_t id = param_intern(params, name, name_len);
+        if (id < 0)
+        {
+            perror("Failed to intern parameter_name");
+            param_table_free(params);
+            arena_free(data);
+            free_view(view);
+            lazy_free(lazy);
+            return EXIT_FAILURE;
+        }
+
+        if (lazy) lazy->ids[i] = id;
+    }
+
+    size_t size = params->len;
+
+    // Sort a copy of the names so ids keep pointing at the same strings
+    char **no_quote_params = malloc((size ? size : 1) * sizeof(char *));
+
+    if (!no_quote_params)
+    {
+        perror("no_quote_params allocation failed");
+        if (!dataset) param_table_free(params);
+        arena_free(data);
+        free_view(view);
+        lazy_free(lazy);
+        dataset_free(dataset);
+        return EXIT_FAILURE;
+    }
+
+    if (size > 0) memcpy(no_quote_params, params->names, size * sizeof(char *));
+    t = stats_lap(STAGE_UNIQUE, t);
+
+    // Quick Sort param_names
+    qsort(no_quote_params, size, sizeof(no_quote_params[0]), comp);
+    t = stats_lap(STAGE_SORT, t);
+
+    // Trigrams of the sorted names, so the prompt can match inside names too (NULL just disables it)
+    NgramIndex *ngrams = ngram_index_build((const char *const *)no_quote_params, NULL, size);
+    stats_lap(STAGE_INDEX, t);
+
+    // If all goes well, free the relevant pointers
+    // Print the unique parameters
+    printf("Unique parameters:\n");
+    for (size_t i = 0; i < size; i++) 
+    {
+        int32_t id = param_lookup(params, no_quote_params[i], strlen(no_quote_params[i]));
+        printf("Parameter %zu: %s (%zu rows)\n", i + 1, no_quote_params[i], params->counts[id]);
+    }
+    
+    // Buffer for Autocomplete Function
+    char buffer[200];
+    
+    // Get Parameter for In-Line Autocomplete
+    t = stats_begin();
+    autocomplete(buffer, size, no_quote_params, ngrams);
+    t = stats_lap(STAGE_PROMPT, t);
+
+    int32_t chosen = param_lookup(params, buffer, strlen(buffer));
+    if (chosen >= 0)
+    {
+        printf("Selected %s (%zu rows)\n", params->names[chosen], params->counts[chosen]);
+
+        size_t n = 0;
+        const uint32_t *rows = dataset ? dataset_param_rows(dataset, chosen, &n) : NULL;
+        uint32_t *site_rows = NULL;
+        uint32_t *time_rows = NULL;
+        uint32_t *top_rows_out = NULL;
+
+        // Only now are the chosen rows parsed in full, then written out
+        if (lazy)
+        {
+            AQSArena *picked = lazy_materialize(lazy, chosen);
+            if (picked)
+            {
+                printf("Materialized %zu of %zu rows\n", picked->len, aqs_len > 0 ? aqs_len - 1 : 0);
+                write_records_csv(stdout, picked);
             }
-            
-        } else if (c >= 32 && c <= 126) 
-        {  // Printable ASCII characters
-            buffer[index++] = c;
-            printf("%c", c);
-        } 
+            arena_free(picked);
+        }
 
-        else if (c == 27) 
-        {  // Escape sequence for Shift + Tab key → Cycle backwards through suggestions
-            char next_char = getch();
-            if (next_char == 91) 
-            {  // Check for '[' character
-                next_char = getch();
-                if (next_char == 90) 
-                {  // Check for 'Z' character (Shift + Tab)
-                    tabbed = true;
-                    match_count = 0;
-                    int last_match_index_before = last_match_index;
+        // Narrow the selection to the sites a spatial query matches
+        if (opts.near || opts.bbox)
+        {
+            site_rows = spatial_select(dataset, &opts, rows, &n);
+            rows = site_rows;
+        }
 
-                    for (int i = param_count - 1; i >= 0; i--) 
-                    {
-                        if (strncmp(param_names[i], buffer, index) == 0) 
-                        {
-                            match_count++;
-
-                            if (last_match_index == -1 || last_match_index > i) 
-                            {
-                                last_match_index = i;
-                                strcpy(buffer, param_names[i]);
-                                printf("\r%-50s", buffer);  // Overwrite the input line
-                                index = 0;
-                                break;
-                            }
-                        }
-                    }
+        // Then to a datetime range
+        if (opts.time && rows)
+        {
+            time_rows = time_select(dataset, opts.time, rows, &n);
+            rows = time_rows;
+        }
 
-                    if (match_count > 0 && last_match_index == 0) 
-                    {
-                        last_match_index = last_match_index_before; // Restart cycling
-                    }
-                }
+        // Then to the best K by a column, in rank order from here on
+        if (opts.top && rows)
+        {
+            size_t before = n;
+            top_rows_out = top_rows(dataset->cols, rows, &n, opts.top_field, opts.top, opts.threads);
+            rows = top_rows_out;
+            if (rows) printf("Top %zu of %zu rows by %s\n", n, before, AQS_FIELDS[opts.top_field].name);
+        }
+
+        // Without another consumer the rows themselves are the answer
+        if ((opts.near || opts.bbox || opts.time || opts.top) && rows && !opts.group && !opts.export_path)
+        {
+            write_rows_csv(stdout, dataset->cols, rows, n);
+        }
+
+        // Aggregate the selected parameter's rows
+        if (opts.group && rows)
+        {
+            GroupSpec spec;
+            GroupTable *groups = parse_group_spec(opts.group, opts.agg, &spec) == 0
+                ? group_rows(dataset->cols, rows, n, &spec, opts.threads)
+                : NULL;
+
+            if (groups) group_print(groups, stdout);
+            group_table_free(groups);
+        }
+
+        if (opts.export_path && rows)
+        {
+            if (export_arrow(opts.export_path, dataset->cols, rows, n) == 0)
+            {
+                printf("Wrote %zu rows to %s\n", n, opts.export_path);
             }
         }
+
+        free(site_rows);
+        free(time_rows);
+        free(top_rows_out);
+        stats_lap(STAGE_QUERY, t);
+    } else 
+    {
+        printf("Unknown parameter: %s\n", buffer);
     }
+
+    if (STATS.enabled) stats_report(stderr);
+
+    // Free data once passed down the pipeline
+    ngram_index_free(ngrams);
+    free(no_quote_params);
+    if (!dataset) param_table_free(params);
+    arena_free(data);
+    free_view(view);
+    lazy_free(lazy);
+    dataset_free(dataset);
+    free_args(&opts);
+
+    return EXIT_SUCCESS;
 }
 
-int comp(const void *a, const void *b)
+/* takes 2 params, the filename and a pointer
+  to size_t where the number of data points is stored */
+
+// Numeric fields of a legacy record, empty ones are flagged in rec->missing
+static int to_int(AQSData *rec, int field, const char *token)
 {
-    const char *str1 = *(const char **)a;
-    const char *str2 = *(const char **)b;
+    int32_t value;
+    if (parse_int(token, strlen(token), &value) != NUM_OK) rec->missing |= (uint64_t)1 << field;
+    return value;
+}
 
-    // Check if first characters are digits
-    int is_digit1 = isdigit((unsigned char)str1[0]);
-    int is_digit2 = isdigit((unsigned char)str2[0]);
+static double to_double(AQSData *rec, int field, const char *token)
+{
+    double value;
+    if (parse_double(token, strlen(token), &value) != NUM_OK) rec->missing |= (uint64_t)1 << field;
+    return value;
+}
 
-    // If one is a number and the other is not, prioritize the number
-    if (is_digit1 && !is_digit2) return -1;
-    if (!is_digit1 && is_digit2) return 1;
+static int64_t to_time(AQSData *rec, int field, const char *token)
+{
+    int64_t value;
+    if (parse_datetime(token, strlen(token), &value, NULL) != NUM_OK) rec->missing |= (uint64_t)1 << field;
+    return value;
+}
 
-    // If both are numbers or both are letters, use strcmp for alphanumeric sorting
-    return strcmp(str1, str2);
+AQSArena *read_data(const char *filename, size_t *len, bool prescan, const Filter *filter) 
+{
+    if (filename == NULL || len == NULL) return NULL;
+
+    // Open File
+    // Plain or compressed, lines come out the same
+    RecordReader reader;
+    if (reader_open(&reader, filename) != 0) return NULL;
+
+    // One exactly sized chunk when the row count is known, fixed chunks otherwise
+    size_t rows = prescan ? count_rows(filename) : 0;
+    AQSArena *arena = arena_create(rows ? rows : ARENA_CHUNK_RECORDS);
+    if (arena == NULL)
+    {
+        perror("Failed to allocate arena");
+        reader_close(&reader);
+        return NULL;
+    }
+
+    *len = 0;
+
+    // Assuming that no line will be longer than 1023 chars
+    char line[MAX_LENGTH];
+
+    // Field pointers into line, filled by split_csv_line
+    char *tokens[MAX_FIELDS];
+
+    // Private copy, the predicate order adapts to this file
+    Filter local;
+    if (filter) local = *filter;
+    bool header = true;
+
+    // Read one line at a time, each stage charged as it finishes
+    double t = stats_begin();
+    while (reader_gets(&reader, line, sizeof(line))) 
+    {
+        t = stats_lap(STAGE_READ, t);
+
+        // Only the fields the filter reads are located for rows it rejects
+        if (filter && !header)
+        {
+            size_t next;
+            if (!filter_record(&local, line, 0, strlen(line), &next))
+            {
+                t = stats_lap(STAGE_SPLIT, t);
+                continue;
+            }
+        }
+
+        header = false;
+
+        // Single pass over the line for every field boundary, blank lines hold no record
+        int fields = split_csv_line(line, strlen(line), tokens);
+        t = stats_lap(STAGE_SPLIT, t);
+        if (fields <= 0) continue;
+
+        AQSData *rec = arena_push(arena);
+        if (rec == NULL) {
+            fprintf(stderr, "could not parse the whole file %s\n", filename);
+            reader_close(&reader);
+            // Free any previously parsed data
+            if (*len == 0) {
+                arena_free(arena);
+                arena = NULL;
+            }
+            return arena;
+        }
+
+        record_fill(rec, tokens);
+        (*len)++;
+        t = stats_lap(STAGE_CONVERT, t);
+    }
+
+    // A corrupt or truncated input is an error, not a shorter dataset
+    if (reader.error)
+    {
+        fprintf(stderr, "could not load the whole file %s\n", filename);
+        arena_free(arena);
+        arena = NULL;
+    }
+
+    reader_close(&reader);
+    return arena;
+}
+
+// Where each CSV field lands in AQSData, in column order
+typedef enum { REC_TEXT, REC_CHAR, REC_INT, REC_DOUBLE, REC_TIME } RecordKind;
+
+typedef struct {
+    size_t offset;
+    size_t size;
+    RecordKind kind;
+} RecordField;
+
+#define RECORD_FIELD(name, kind) { offsetof(AQSData, name), sizeof(((AQSData *)0)->name), kind }
+
+static const RecordField RECORD_FIELDS[MAX_FIELDS] = {
+    RECORD_FIELD(state_code, REC_TEXT),
+    RECORD_FIELD(county_code, REC_TEXT),
+    RECORD_FIELD(site_num, REC_TEXT),
+    RECORD_FIELD(parameter_code, REC_TEXT),
+    RECORD_FIELD(poc, REC_INT),
+    RECORD_FIELD(latitude, REC_DOUBLE),
+    RECORD_FIELD(longitude, REC_DOUBLE),
+    RECORD_FIELD(datum, REC_TEXT),
+    RECORD_FIELD(parameter_name, REC_TEXT),
+    RECORD_FIELD(sample_duration, REC_TEXT),
+    RECORD_FIELD(pollutant_standard, REC_TEXT),
+    RECORD_FIELD(metric_used, REC_TEXT),
+    RECORD_FIELD(method_name, REC_TEXT),
+    RECORD_FIELD(year, REC_INT),
+    RECORD_FIELD(units_of_measure, REC_TEXT),
+    RECORD_FIELD(event_type, REC_TEXT),
+    RECORD_FIELD(observation_count, REC_INT),
+    RECORD_FIELD(observation_percent, REC_INT),
+    RECORD_FIELD(completeness_indicator, REC_CHAR),
+    RECORD_FIELD(valid_day_count, REC_INT),
+    RECORD_FIELD(required_day_count, REC_INT),
+    RECORD_FIELD(exceptional_data_count, REC_INT),
+    RECORD_FIELD(null_data_count, REC_INT),
+    RECORD_FIELD(primary_exceedance_count, REC_INT),
+    RECORD_FIELD(secondary_exceedance_count, REC_INT),
+    RECORD_FIELD(certification_indicator, REC_TEXT),
+    RECORD_FIELD(num_obs_below_mdl, REC_INT),
+    RECORD_FIELD(arithmetic_mean, REC_DOUBLE),
+    RECORD_FIELD(arithmetic_std_dev, REC_DOUBLE),
+    RECORD_FIELD(first_max_value, REC_DOUBLE),
+    RECORD_FIELD(first_max_datetime, REC_TIME),
+    RECORD_FIELD(second_max_value, REC_DOUBLE),
+    RECORD_FIELD(second_max_datetime, REC_TIME),
+    RECORD_FIELD(third_max_value, REC_DOUBLE),
+    RECORD_FIELD(third_max_datetime, REC_TIME),
+    RECORD_FIELD(fourth_max_value, REC_DOUBLE),
+    RECORD_FIELD(fourth_max_datetime, REC_TIME),
+    RECORD_FIELD(first_no_max_value, REC_DOUBLE),
+    RECORD_FIELD(first_no_max_datetime, REC_TIME),
+    RECORD_FIELD(second_no_max_value, REC_DOUBLE),
+    RECORD_FIELD(second_no_max_datetime, REC_TIME),
+    RECORD_FIELD(percentile_99, REC_DOUBLE),
+    RECORD_FIELD(percentile_98, REC_DOUBLE),
+    RECORD_FIELD(percentile_95, REC_DOUBLE),
+    RECORD_FIELD(percentile_90, REC_DOUBLE),
+    RECORD_FIELD(percentile_75, REC_DOUBLE),
+    RECORD_FIELD(percentile_50, REC_DOUBLE),
+    RECORD_FIELD(percentile_10, REC_DOUBLE),
+    RECORD_FIELD(local_site_name, REC_TEXT),
+    RECORD_FIELD(address, REC_TEXT),
+    RECORD_FIELD(state_name, REC_TEXT),
+    RECORD_FIELD(county_name, REC_TEXT),
+    RECORD_FIELD(city_name, REC_TEXT),
+    RECORD_FIELD(cbsa_name, REC_TEXT),
+    RECORD_FIELD(date_of_last_change, REC_TEXT),
+};
+
+void record_fill(AQSData *rec, char **tokens)
+{
+    for (int field = 0; field < MAX_FIELDS; field++) 
+    {
+        const RecordField *f = &RECORD_FIELDS[field];
+        char *token = tokens[field];
+        char *dst = (char *)rec + f->offset;
+
+        // Assign the token to the appropriate field in the struct
+        switch (f->kind)
+        {
+            case REC_TEXT:
+                strncpy(dst, token, f->size - 1);
+                dst[f->size - 1] = '\0';
+                break;
+            case REC_CHAR:
+                *dst = token[0];
+                break;
+            case REC_INT:
+                *(int *)dst = to_int(rec, field, token);
+                break;
+            case REC_DOUBLE:
+                *(double *)dst = to_double(rec, field, token);
+                break;
+            case REC_TIME:
+                *(int64_t *)dst = to_time(rec, field, token);
+                break;
+        }
+    }
+}
+
+// Parse line, replace with more efficient delimiter, make all lowercase
+char* parse_csv_line(char *line, int len) 
+{
+    bool in_quotes = false;
+    char *ptr = line;
+
+    for (int i = 0; i < len; i++)
+    {        
+        // Need lowercase for comprehensive qsort
+        ptr[i] = tolower(ptr[i]);
+        // if double quotes and comma not after, we're in a column
+        if (ptr[i] == '"' && ptr[i + 1] != ',') 
+        {
+            in_quotes = true;
+        // Else if , following ", we're leaving the column
+        } else if (ptr[i] == '"' && ptr[i + 1] == ',')
+        {
+            in_quotes = false;
+        }
+
+        // Change to a nearly impossible single char delimiter for ease because I am so sick of commas, f*** you commas
+        if (!in_quotes && ptr[i] == ',')
+        {
+            // Ascii unit separator
+            ptr[i] = '\x1F';
+        }
+
+        // End if Null Terminator Encountered
+        if (ptr[i] == '\0') break;
+    }
+
+    return ptr;
+}
+
+// Show the prompt text and the live matches after it, padding over whatever was there before
+// The cursor is put back right after the text. Without hints only the text is echoed
+static void redraw(const Completer *state, size_t *shown, bool hints)
+{
+    const char *text = completer_text(state);
+    char hint[160] = "";
+    size_t used = 0;
+
+    for (int i = 0; hints && i < state->match_count && state->cursor < 0 && state->typed_len > 0; i++)
+    {
+        const char *name = state->names[state->matches[i].id];
+        int n = snprintf(hint + used, sizeof(hint) - used, "%s%s", i ? " | " : "   [", name);
+        if (n < 0 || used + n + 1 >= sizeof(hint)) break;
+        used += n;
+    }
+
+    if (used > 0) used += snprintf(hint + used, sizeof(hint) - used, "]");
+
+    size_t len = strlen(text) + used;
+    printf("\r%s%s", text, hint);
+
+    if (len < *shown)
+    {
+        printf("%*s", (int)(*shown - len), "");
+    }
+
+    // Back to the end of the text when a hint or padding follows it
+    if (used > 0 || len < *shown) printf("\r%s", text);
+    *shown = len;
+    fflush(stdout);
+}
+
+void autocomplete(char *buffer, int param_count, char **param_names, const NgramIndex *index) 
+{
+    Completer state;
+    completer_init(&state, param_names, param_count, index);
+
+    size_t shown = 0;
+    char c;
+    printf("Enter parameter (Tab for autocomplete and Increment, Shift + Tab to Decrement):\n");
+
+    // Live matches are for a person at a terminal, piped runs get the plain echo
+#ifdef _WIN32
+    bool hints = _isatty(_fileno(stdin)) && _isatty(_fileno(stdout));
+#else
+    bool hints = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+#endif
+
+    while (1) {
+        #ifdef _WIN32
+            c = _getch();
+        #else
+            c = getch();
+        #endif
+
+        // End of input counts as Enter
+        if (c == '\n' || c == '\r' || c == (char)EOF) 
+        {
+            strcpy(buffer, completer_text(&state));
+            printf("\n");
+            break;
+        } else if (c == 127 || c == '\b') 
+        {
+            completer_backspace(&state);
+        } else if (c == '\t') 
+        {  // Tab key → Cycle through suggestions
+            completer_cycle(&state, 1);
+        } else if (c >= 32 && c <= 126) 
+        {  // Printable ASCII characters
+            completer_type(&state, c);
+        } 
+
+        else if (c == 27) 
+        {  // Escape sequence for Shift + Tab key → Cycle backwards through suggestions
+            char next_char = getch();
+            if (next_char == 91) 
+            {  // Check for '[' character
+                next_char = getch();
+                if (next_char == 90) 
+                {  // Check for 'Z' character (Shift + Tab)
+                    completer_cycle(&state, -1);
+                }
+            }
+        }
+
+        redraw(&state, &shown, hints);
+    }
+}
+
+// Sort class of comp: names starting with a digit come first
+static int name_class(const char *name)
+{
+    return isdigit((unsigned char)name[0]) ? 0 : 1;
+}
+
+// comp restricted to the first len bytes of prefix, monotone over a comp-sorted array
+static int comp_prefix(const char *name, const char *prefix, size_t len)
+{
+    int diff = name_class(name) - name_class(prefix);
+    return diff ? diff : strncmp(name, prefix, len);
+}
+
+void prefix_range(char **names, int count, const char *prefix, size_t len, int *lo, int *hi)
+{
+    if (len == 0)
+    {
+        *lo = 0;
+        *hi = count;
+        return;
+    }
+
+    // First name not below the prefix
+    int l = 0, h = count;
+    while (l < h)
+    {
+        int mid = l + (h - l) / 2;
+        if (comp_prefix(names[mid], prefix, len) < 0) l = mid + 1; else h = mid;
+    }
+    *lo = l;
+
+    // First name above it
+    h = count;
+    while (l < h)
+    {
+        int mid = l + (h - l) / 2;
+        if (comp_prefix(names[mid], prefix, len) <= 0) l = mid + 1; else h = mid;
+    }
+    *hi = l;
+}
+
+void completer_init(Completer *state, char **names, int count, const NgramIndex *index)
+{
+    memset(state, 0, sizeof(*state));
+    state->names = names;
+    state->count = count;
+    state->index = index;
+    state->cursor = -1;
+}
+
+const char *completer_text(const Completer *state)
+{
+    if (state->cursor < 0) return state->typed;
+    return state->names[state->fuzzy ? state->matches[state->cursor].id : (uint32_t)state->cursor];
+}
+
+// Rank the names against what was typed, after every edit
+static void completer_refresh(Completer *state)
+{
+    state->match_count = state->index
+        ? (int)ngram_search(state->index, state->typed, state->typed_len, state->matches, COMPLETER_MATCHES)
+        : 0;
+}
+
+// Editing after a Tab continues from the completed name
+static void completer_accept(Completer *state)
+{
+    if (state->cursor < 0) return;
+
+    strncpy(state->typed, completer_text(state), sizeof(state->typed) - 1);
+    state->typed[sizeof(state->typed) - 1] = '\0';
+    state->typed_len = strlen(state->typed);
+    state->cursor = -1;
+    state->fuzzy = false;
+}
+
+void completer_type(Completer *state, char c)
+{
+    completer_accept(state);
+
+    if (state->typed_len < sizeof(state->typed) - 1)
+    {
+        state->typed[state->typed_len++] = c;
+        state->typed[state->typed_len] = '\0';
+    }
+
+    completer_refresh(state);
+}
+
+void completer_backspace(Completer *state)
+{
+    completer_accept(state);
+
+    if (state->typed_len > 0)
+    {
+        state->typed[--state->typed_len] = '\0';
+    }
+
+    completer_refresh(state);
+}
+
+void completer_cycle(Completer *state, int step)
+{
+    // First press looks the range up, later presses just walk it
+    if (state->cursor < 0)
+    {
+        prefix_range(state->names, state->count, state->typed, state->typed_len, &state->lo, &state->hi);
+
+        // No name starts with it, walk the names containing it or close to it instead
+        if (state->lo == state->hi)
+        {
+            state->fuzzy = true;
+            state->lo = 0;
+            state->hi = state->match_count;
+        }
+
+        if (state->lo == state->hi)
+        {
+            state->fuzzy = false;
+            return;
+        }
+
+        state->cursor = step > 0 ? state->lo : state->hi - 1;
+        return;
+    }
+
+    state->cursor += step;
+    if (state->cursor >= state->hi) state->cursor = state->lo;
+    if (state->cursor < state->lo) state->cursor = state->hi - 1;
+}
+
+int comp(const void *a, const void *b)
+{
+    const char *str1 = *(const char **)a;
+    const char *str2 = *(const char **)b;
+
+    // Check if first characters are digits
+    int is_digit1 = isdigit((unsigned char)str1[0]);
+    int is_digit2 = isdigit((unsigned char)str2[0]);
+
+    // If one is a number and the other is not, prioritize the number
+    if (is_digit1 && !is_digit2) return -1;
+    if (!is_digit1 && is_digit2) return 1;
+
+    // If both are numbers or both are letters, use strcmp for alphanumeric sorting
+    return strcmp(str1, str2);
+}
+
+int parse_args(int argc, char *argv[], Options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->threads = cpu_count();
+    opts->radius_km = 25;
+    opts->top_field = -1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--mmap"))
+        {
+            opts->use_mmap = true;
+        } else if (!strcmp(argv[i], "--lazy"))
+        {
+            opts->lazy = true;
+        } else if (!strcmp(argv[i], "--columnar"))
+        {
+            opts->columnar = true;
+        } else if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=json"))
+        {
+            STATS.enabled = true;
+            STATS.json = argv[i][7] == '=';
+            STATS.start = now_seconds();
+        } else if (!strcmp(argv[i], "--serve") || !strncmp(argv[i], "--serve=", 8))
+        {
+            opts->serve = true;
+            opts->socket_path = argv[i][7] == '=' ? argv[i] + 8 : NULL;
+            if (opts->socket_path && !*opts->socket_path) return -1;
+        } else if (!strcmp(argv[i], "--bench"))
+        {
+            opts->bench = true;
+        } else if (!strcmp(argv[i], "--generate") && i + 1 < argc)
+        {
+            opts->generate = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+        {
+            opts->seed = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--cache"))
+        {
+            opts->cache = true;
+        } else if (!strcmp(argv[i], "--param") && i + 1 < argc)
+        {
+            opts->param = argv[++i];
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+        {
+            opts->threads = atoi(argv[++i]);
+            if (opts->threads < 1) opts->threads = 1;
+        } else if (!strcmp(argv[i], "--group") && i + 1 < argc)
+        {
+            opts->group = argv[++i];
+        } else if (!strcmp(argv[i], "--agg") && i + 1 < argc)
+        {
+            opts->agg = argv[++i];
+        } else if (!strcmp(argv[i], "--near") && i + 1 < argc)
+        {
+            int used = 0;
+            const char *arg = argv[++i];
+            if (sscanf(arg, "%lf,%lf%n", &opts->near_lat, &opts->near_lon, &used) != 2 || arg[used]) return -1;
+            opts->near = true;
+        } else if (!strcmp(argv[i], "--radius-km") && i + 1 < argc)
+        {
+            opts->radius_km = atof(argv[++i]);
+            if (!(opts->radius_km >= 0)) return -1;
+        } else if (!strcmp(argv[i], "--bbox") && i + 1 < argc)
+        {
+            int used = 0;
+            double *b = opts->box;
+            const char *arg = argv[++i];
+            if (sscanf(arg, "%lf,%lf,%lf,%lf%n", &b[0], &b[1], &b[2], &b[3], &used) != 4 || arg[used]) return -1;
+            opts->bbox = true;
+        } else if (!strcmp(argv[i], "--top") && i + 1 < argc)
+        {
+            char *end;
+            long long k = strtoll(argv[++i], &end, 10);
+            if (k < 1 || *end) return -1;
+            opts->top = (size_t)k;
+        } else if (!strcmp(argv[i], "--by") && i + 1 < argc)
+        {
+            // Ranking needs numbers, datetimes rank latest first
+            const char *name = argv[++i];
+            opts->top_field = field_index(name, strlen(name));
+            if (opts->top_field < 0 || column_text(AQS_FIELDS[opts->top_field].type)) return -1;
+        } else if (!strcmp(argv[i], "--time") && i + 1 < argc)
+        {
+            opts->time = argv[++i];
+        } else if (!strcmp(argv[i], "--export") && i + 1 < argc)
+        {
+            opts->export_path = argv[++i];
+        } else if (!strcmp(argv[i], "--where") && i + 1 < argc)
+        {
+            opts->where = argv[++i];
+        } else if (!strcmp(argv[i], "--prescan"))
+        {
+            opts->prescan = true;
+        } else if (add_input(opts, argv[i]) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (opts->file_count == 0) return -1;
+
+    // --top and --by go together
+    if ((opts->top > 0) != (opts->top_field >= 0)) return -1;
+
+    // Streaming copies matching records as they are read, there is nothing to group, export or query
+    if (opts->param && (opts->group || opts->agg || opts->export_path || opts->near || opts->bbox || opts->time || opts->serve))
+    {
+        fprintf(stderr, "--param streams records, it cannot be combined with --group, --agg, --export, --near, --bbox, --time or --serve\n");
+        return -1;
+    }
+
+    // Several inputs, the cache, group-by, export, spatial and time queries, top-k and the server
+    // only exist on the columnar store, so they override --mmap and --lazy
+    if (opts->cache || opts->file_count > 1 || opts->group || opts->export_path || opts->near || opts->bbox || opts->time || opts->top || opts->serve)
+    {
+        opts->columnar = true;
+        opts->use_mmap = false;
+        opts->lazy = false;
+    }
+
+    opts->filename = opts->files[0];
+    return 0;
+}
+
+void free_args(Options *opts)
+{
+    for (int i = 0; i < opts->file_count; i++)
+    {
+        free(opts->files[i]);
+    }
+
+    free(opts->files);
+    free(opts->filter);
+    opts->filter = NULL;
+    opts->files = NULL;
+    opts->file_count = 0;
+    opts->filename = NULL;
+}
+
+// Push one plain path onto opts->files
+static int push_input(Options *opts, const char *path)
+{
+    char **tmp = realloc(opts->files, (opts->file_count + 1) * sizeof(*tmp));
+    if (tmp == NULL) return -1;
+    opts->files = tmp;
+
+    size_t len = strlen(path);
+    char *copy = malloc(len + 1);
+    if (copy == NULL) return -1;
+
+    memcpy(copy, path, len + 1);
+    opts->files[opts->file_count++] = copy;
+    return 0;
+}
+
+// Input files ending in one of the names we can ingest
+static bool is_input_name(const char *name)
+{
+    static const char *const suffixes[] = {".csv", ".CSV", ".gz", ".zip", ".ZIP"};
+    size_t len = strlen(name);
+
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        size_t n = strlen(suffixes[i]);
+        if (len > n && !strcmp(name + len - n, suffixes[i])) return true;
+    }
+
+    return false;
+}
+
+static int comp_path(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int add_input(Options *opts, const char *path)
+{
+#ifndef _WIN32
+    struct stat st;
+
+    // A directory contributes its CSVs, sorted so years load in order
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+        {
+            fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+
+        int first = opts->file_count;
+        struct dirent *entry;
+        int status = 0;
+
+        while (status == 0 && (entry = readdir(dir)) != NULL)
+        {
+            if (!is_input_name(entry->d_name)) continue;
+
+            size_t len = strlen(path) + strlen(entry->d_name) + 2;
+            char *full = malloc(len);
+            if (full == NULL)
+            {
+                status = -1;
+                break;
+            }
+
+            snprintf(full, len, "%s/%s", path, entry->d_name);
+            status = push_input(opts, full);
+            free(full);
+        }
+
+        closedir(dir);
+        qsort(opts->files + first, opts->file_count - first, sizeof(*opts->files), comp_path);
+        return status;
+    }
+
+    // Patterns the shell did not expand (quoted, or too many files for argv)
+    if (strpbrk(path, "*?[") != NULL)
+    {
+        glob_t matches;
+        if (glob(path, 0, NULL, &matches) != 0)
+        {
+            fprintf(stderr, "No files match %s\n", path);
+            return -1;
+        }
+
+        int status = 0;
+        for (size_t i = 0; i < matches.gl_pathc && status == 0; i++)
+        {
+            status = push_input(opts, matches.gl_pathv[i]);
+        }
+
+        globfree(&matches);
+        return status;
+    }
+#endif
+
+    return push_input(opts, path);
+}
+
+int map_file(const char *filename, MappedFile *file)
+{
+    memset(file, 0, sizeof(*file));
+
+    // Nothing to map for compressed input, read it through the inflater
+    if (input_format(filename) != INPUT_PLAIN)
+    {
+        ByteSource src;
+        if (source_open(&src, filename) != 0) return -1;
+
+        size_t cap = 1 << 24;
+        char *buf = malloc(cap);
+        size_t n = 0;
+        int status = buf ? 0 : -1;
+
+        while (status == 0)
+        {
+            if (file->size == cap)
+            {
+                char *tmp = realloc(buf, cap * 2);
+                if (tmp == NULL)
+                {
+                    status = -1;
+                    break;
+                }
+                buf = tmp;
+                cap *= 2;
+                stats_count(reallocs, 1);
+            }
+
+            status = source_read(&src, buf + file->size, cap - file->size, &n);
+            if (n == 0) break;
+            file->size += n;
+        }
+
+        source_close(&src);
+
+        if (status != 0)
+        {
+            fprintf(stderr, "Could not read %s\n", filename);
+            free(buf);
+            memset(file, 0, sizeof(*file));
+            return -1;
+        }
+
+        file->data = buf;
+        file->owned = true;
+        return 0;
+    }
+
+#ifdef _WIN32
+    // No mmap here, fall back to one big read
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *buf = malloc(size > 0 ? size : 1);
+    if (buf == NULL || fread(buf, 1, size, fp) != (size_t)size)
+    {
+        fprintf(stderr, "Could not read %s\n", filename);
+        free(buf);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    file->data = buf;
+    file->size = size;
+    file->owned = true;
+    stats_count(bytes, size);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Could not stat %s: %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // mmap refuses zero-length mappings, an empty file is just an empty view
+    if (st.st_size == 0)
+    {
+        close(fd);
+        file->data = "";
+        return 0;
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    // We walk the file front to back, let the kernel read ahead
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    file->data = addr;
+    file->size = st.st_size;
+    stats_count(bytes, st.st_size);
+#endif
+
+    return 0;
+}
+
+void unmap_file(MappedFile *file)
+{
+    if (file->owned)
+    {
+        free((void *)file->data);
+    }
+#ifndef _WIN32
+    else if (file->size > 0)
+    {
+        munmap((void *)file->data, file->size);
+    }
+#endif
+
+    memset(file, 0, sizeof(*file));
+}
+
+size_t scan_record(const char *data, size_t start, size_t size, int max_fields, AQSRowView *row, int *fields)
+{
+    size_t i = start;
+    size_t end = size;
+    uint64_t carry = 0;  // all ones while a quoted region runs into the next block
+    int field = 0;
+
+    // A partial scan still needs the separator after its last field
+    int limit = max_fields < MAX_FIELDS ? max_fields : MAX_FIELDS - 1;
+
+    row->offset = start;
+    row->starts[0] = 0;
+
+    // 64 bytes per step, quoted regions come from the prefix XOR of the quote mask
+    // "" simply toggles twice, so escaped quotes never end a field
+    while (i < size)
+    {
+        size_t n = size - i < 64 ? size - i : 64;
+        BlockMasks m;
+        scan_block(data + i, n, &m);
+
+        uint64_t quoted = prefix_xor(m.quote) ^ carry;
+        uint64_t commas = field < limit ? m.comma & ~quoted : 0;
+        uint64_t newlines = m.newline & ~quoted;
+
+        // Only separators before the end of this record count
+        if (newlines)
+        {
+            commas &= (newlines & -newlines) - 1;
+        }
+
+        while (commas)
+        {
+            size_t at = i + lowest_bit(commas);
+            commas &= commas - 1;
+
+            // Extra trailing columns are folded into the last field
+            if (field < limit && at - start < UINT16_MAX)
+            {
+                row->starts[++field] = at + 1 - start;
+            }
+        }
+
+        if (newlines)
+        {
+            end = i + lowest_bit(newlines);
+            break;
+        }
+
+        carry = (uint64_t)((int64_t)quoted >> 63);
+        i += n;
+    }
+
+    size_t content = end;
+    if (content > start && data[content - 1] == '\r') content--;
+
+    if (content == start)
+    {
+        // Blank line
+        *fields = 0;
+    } else if (content - start >= UINT16_MAX)
+    {
+        // starts[] is 16 bits wide, no real AQS row comes close
+        *fields = -1;
+    } else 
+    {
+        // Missing trailing fields become empty fields
+        for (int f = field + 1; f <= max_fields; f++)
+        {
+            row->starts[f] = content - start + 1;
+        }
+
+        *fields = field + 1 < max_fields ? field + 1 : max_fields;
+    }
+
+    return end;
+}
+
+int tokenize_record(const char *data, size_t *pos, size_t size, AQSRowView *row)
+{
+    int fields;
+    size_t end = scan_record(data, *pos, size, MAX_FIELDS, row, &fields);
+
+    *pos = end < size ? end + 1 : size;
+    return fields;
+}
+
+AQSView *map_data(const char *filename, size_t *len, const Filter *filter)
+{
+    if (filename == NULL || len == NULL) return NULL;
+
+    AQSView *view = calloc(1, sizeof(*view));
+    if (view == NULL)
+    {
+        perror("Failed to allocate view");
+        return NULL;
+    }
+
+    if (map_file(filename, &view->file) != 0)
+    {
+        free(view);
+        return NULL;
+    }
+
+    const char *data = view->file.data;
+    size_t size = view->file.size;
+    size_t capacity = 0;
+    size_t pos = 0;
+
+    Filter local;
+    if (filter) local = *filter;
+
+    while (pos < size)
+    {
+        // The header (first row) is always kept
+        size_t next;
+        if (filter && view->len > 0 && !filter_record(&local, data, pos, size, &next))
+        {
+            pos = next;
+            continue;
+        }
+
+        if (view->len == capacity)
+        {
+            capacity = capacity ? capacity * 2 : MAX_LENGTH;
+            AQSRowView *tmp = realloc(view->rows, capacity * sizeof(*tmp));
+            if (tmp == NULL)
+            {
+                fprintf(stderr, "could not index the whole file %s\n", filename);
+                break;
+            }
+            view->rows = tmp;
+            stats_count(reallocs, 1);
+        }
+
+        int fields = tokenize_record(data, &pos, size, &view->rows[view->len]);
+
+        // Skip blank and oversized lines
+        if (fields <= 0) continue;
+
+        view->len++;
+    }
+
+    *len = view->len;
+    return view;
+}
+
+void free_view(AQSView *view)
+{
+    if (view == NULL) return;
+
+    unmap_file(&view->file);
+    free(view->rows);
+    free(view);
+}
+
+// Grow the per-record arrays of a lazy index to capacity
+static int lazy_reserve(LazyIndex *index, size_t capacity)
+{
+    size_t *offsets = realloc(index->offsets, capacity * sizeof(*offsets));
+    if (offsets == NULL) return -1;
+    index->offsets = offsets;
+
+    uint16_t *starts = realloc(index->name_starts, capacity * sizeof(*starts));
+    if (starts == NULL) return -1;
+    index->name_starts = starts;
+
+    uint16_t *lens = realloc(index->name_lens, capacity * sizeof(*lens));
+    if (lens == NULL) return -1;
+    index->name_lens = lens;
+
+    stats_count(reallocs, 1);
+    return 0;
+}
+
+LazyIndex *lazy_index(const char *filename, size_t *len, const Filter *filter)
+{
+    if (filename == NULL || len == NULL) return NULL;
+
+    LazyIndex *index = calloc(1, sizeof(*index));
+    if (index == NULL)
+    {
+        perror("Failed to allocate lazy index");
+        return NULL;
+    }
+
+    if (map_file(filename, &index->file) != 0)
+    {
+        free(index);
+        return NULL;
+    }
+
+    const char *data = index->file.data;
+    size_t size = index->file.size;
+    size_t capacity = 0;
+    size_t pos = 0;
+
+    Filter local;
+    if (filter) local = *filter;
+
+    while (pos < size)
+    {
+        // The header (first row) is always kept
+        size_t next;
+        if (filter && index->len > 0 && !filter_record(&local, data, pos, size, &next))
+        {
+            pos = next;
+            continue;
+        }
+
+        if (index->len == capacity)
+        {
+            capacity = capacity ? capacity * 2 : MAX_LENGTH;
+            if (lazy_reserve(index, capacity) != 0)
+            {
+                fprintf(stderr, "could not index the whole file %s\n", filename);
+                break;
+            }
+        }
+
+        // The scan stops after parameter_name, later fields are never located
+        AQSRowView row;
+        int fields;
+        size_t start = pos;
+        size_t end = scan_record(data, pos, size, 9, &row, &fields);
+        pos = end < size ? end + 1 : size;
+
+        // Skip blank and oversized lines
+        if (fields <= 0) continue;
+
+        FieldView name = row_field(data, &row, 8);
+        index->offsets[index->len] = start;
+        index->name_starts[index->len] = (uint16_t)(name.offset - start);
+        index->name_lens[index->len] = (uint16_t)name.length;
+        index->len++;
+    }
+
+    index->ids = malloc((index->len ? index->len : 1) * sizeof(*index->ids));
+    if (index->ids == NULL)
+    {
+        perror("Failed to allocate lazy index");
+        lazy_free(index);
+        return NULL;
+    }
+
+    // The header never matches a parameter
+    index->ids[0] = -1;
+
+    *len = index->len;
+    return index;
+}
+
+void lazy_free(LazyIndex *index)
+{
+    if (index == NULL) return;
+
+    unmap_file(&index->file);
+    free(index->offsets);
+    free(index->name_starts);
+    free(index->name_lens);
+    free(index->ids);
+    free(index);
+}
+
+AQSArena *lazy_materialize(const LazyIndex *index, int32_t id)
+{
+    // The row count is known, one exactly sized chunk
+    size_t count = 0;
+    for (size_t i = 1; i < index->len; i++)
+    {
+        count += index->ids[i] == id;
+    }
+
+    AQSArena *arena = arena_create(count ? count : 1);
+    if (arena == NULL)
+    {
+        perror("Failed to allocate arena");
+        return NULL;
+    }
+
+    const char *data = index->file.data;
+    size_t size = index->file.size;
+    char line[MAX_LENGTH];
+    char *tokens[MAX_FIELDS];
+
+    for (size_t i = 1; i < index->len; i++)
+    {
+        if (index->ids[i] != id) continue;
+
+        // Same line buffer read_data fills, so the records come out identical
+        const char *p = data + index->offsets[i];
+        size_t avail = size - index->offsets[i];
+        size_t want = avail < sizeof(line) - 1 ? avail : sizeof(line) - 1;
+        const char *nl = memchr(p, '\n', want);
+        size_t n = nl ? (size_t)(nl - p) + 1 : want;
+
+        memcpy(line, p, n);
+        line[n] = '\0';
+
+        if (split_csv_line(line, n, tokens) <= 0) continue;
+
+        AQSData *rec = arena_push(arena);
+        if (rec == NULL)
+        {
+            perror("Failed to materialize rows");
+            break;
+        }
+
+        record_fill(rec, tokens);
+    }
+
+    return arena;
+}
+
+FieldView row_field(const char *data, const AQSRowView *row, int field)
+{
+    FieldView f = { row->offset + row->starts[field], 0 };
+
+    if (row->starts[field + 1] > row->starts[field])
+    {
+        f.length = row->starts[field + 1] - row->starts[field] - 1;
+    } else 
+    {
+        // Missing trailing field, sits on the end of the record rather than one past it
+        f.offset--;
+    }
+
+    // Trim the enclosing quotes, "" escapes stay as they are in the file
+    const char *p = data + f.offset;
+    if (f.length >= 2 && p[0] == '"' && p[f.length - 1] == '"')
+    {
+        f.offset++;
+        f.length -= 2;
+    }
+
+    return f;
+}
+
+FieldView view_field(const AQSView *view, size_t row, int field)
+{
+    return row_field(view->file.data, &view->rows[row], field);
+}
+
+size_t view_copy(const AQSView *view, FieldView field, char *dst, size_t cap)
+{
+    return copy_field(view->file.data, field, dst, cap);
+}
+
+size_t copy_field(const char *data, FieldView field, char *dst, size_t cap)
+{
+    const char *src = data + field.offset;
+    size_t n = 0;
+
+    if (cap == 0) return 0;
+
+    for (size_t i = 0; i < field.length && n < cap - 1; i++)
+    {
+        dst[n++] = src[i];
+
+        // "" inside a quoted field is a single literal quote
+        if (src[i] == '"' && i + 1 < field.length && src[i + 1] == '"') i++;
+    }
+
+    dst[n] = '\0';
+    return n;
+}
+
+AQSArena *arena_create(size_t chunk_records)
+{
+    AQSArena *arena = calloc(1, sizeof(*arena));
+    if (arena == NULL) return NULL;
+
+    arena->chunk_records = chunk_records > 0 ? chunk_records : ARENA_CHUNK_RECORDS;
+    return arena;
+}
+
+AQSData *arena_push(AQSArena *arena)
+{
+    // Current chunk full (or none yet), start a new one
+    if (arena->len == arena->chunk_count * arena->chunk_records)
+    {
+        if (arena->chunk_count == arena->chunk_slots)
+        {
+            size_t slots = arena->chunk_slots ? arena->chunk_slots * 2 : 16;
+            AQSData **tmp = realloc(arena->chunks, slots * sizeof(*tmp));
+            if (tmp == NULL) return NULL;
+
+            arena->chunks = tmp;
+            arena->chunk_slots = slots;
+            stats_count(reallocs, 1);
+        }
+
+        AQSData *chunk = malloc(arena->chunk_records * sizeof(*chunk));
+        if (chunk == NULL) return NULL;
+
+        arena->chunks[arena->chunk_count++] = chunk;
+    }
+
+    AQSData *rec = arena_at(arena, arena->len++);
+
+    // Fields missing from a short line read as empty / zero
+    memset(rec, 0, sizeof(*rec));
+    return rec;
+}
+
+void arena_free(AQSArena *arena)
+{
+    if (arena == NULL) return;
+
+    for (size_t i = 0; i < arena->chunk_count; i++)
+    {
+        free(arena->chunks[i]);
+    }
+
+    free(arena->chunks);
+    free(arena);
+}
+
+size_t count_rows(const char *filename)
+{
+    ByteSource src;
+    if (source_open(&src, filename) != 0) return 0;
+
+    char buf[1 << 16];
+    size_t rows = 0;
+    size_t n;
+    char last = '\n';
+
+    // memchr is far cheaper than fgets, we only need the newlines
+    while (source_read(&src, buf, sizeof(buf), &n) == 0 && n > 0)
+    {
+        const char *p = buf;
+        const char *end = buf + n;
+
+        while ((p = memchr(p, '\n', end - p)) != NULL)
+        {
+            rows++;
+            p++;
+        }
+
+        last = buf[n - 1];
+    }
+
+    // Final line without a trailing newline
+    if (last != '\n') rows++;
+
+    source_close(&src);
+    return rows;
+}
+
+AQSColumns *columns_create(void)
+{
+    AQSColumns *cols = calloc(1, sizeof(*cols));
+    if (cols == NULL) return NULL;
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        cols->cols[f].type = AQS_FIELDS[f].type;
+    }
+
+    return cols;
+}
+
+int columns_reserve(AQSColumns *cols, size_t capacity)
+{
+    if (capacity <= cols->capacity) return 0;
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        Column *col = &cols->cols[f];
+
+        switch (col->type)
+        {
+            case COL_INT:
+            {
+                int32_t *tmp = realloc(col->i32, capacity * sizeof(*tmp));
+                if (tmp == NULL) return -1;
+                col->i32 = tmp;
+                break;
+            }
+            case COL_DBL:
+            {
+                double *tmp = realloc(col->f64, capacity * sizeof(*tmp));
+                if (tmp == NULL) return -1;
+                col->f64 = tmp;
+                break;
+            }
+            case COL_TIME:
+            {
+                int64_t *tmp = realloc(col->i64, capacity * sizeof(*tmp));
+                if (tmp == NULL) return -1;
+                col->i64 = tmp;
+                break;
+            }
+            case COL_STR:
+            {
+                // One extra slot for the end offset of the last string
+                size_t *tmp = realloc(col->offsets, (capacity + 1) * sizeof(*tmp));
+                if (tmp == NULL) return -1;
+                if (col->offsets == NULL) tmp[0] = 0;
+                col->offsets = tmp;
+                break;
+            }
+            case COL_DICT:
+            {
+                // The pool grows with the distinct strings in dict_intern
+                uint32_t *tmp = realloc(col->codes, capacity * sizeof(*tmp));
+                if (tmp == NULL) return -1;
+                col->codes = tmp;
+                break;
+            }
+        }
+
+        if (!column_text(col->type))
+        {
+            uint8_t *tmp = realloc(col->valid, (capacity + 7) / 8);
+            if (tmp == NULL) return -1;
+            col->valid = tmp;
+        }
+    }
+
+    cols->capacity = capacity;
+    stats_count(reallocs, 1);
+    return 0;
+}
+
+void columns_free(AQSColumns *cols)
+{
+    if (cols == NULL) return;
+
+    for (int f = 0; f < MAX_FIELDS && !cols->borrowed; f++)
+    {
+        free(cols->cols[f].i32);
+        free(cols->cols[f].f64);
+        free(cols->cols[f].i64);
+        free(cols->cols[f].valid);
+        free(cols->cols[f].codes);
+        free(cols->cols[f].offsets);
+        free(cols->cols[f].blob);
+        free(cols->cols[f].slots);
+    }
+
+    free(cols);
+}
+
+// Room for extra more bytes at the end of a string pool
+static int blob_reserve(Column *col, size_t extra)
+{
+    if (col->blob_len + extra <= col->blob_cap) return 0;
+
+    size_t cap = col->blob_cap ? col->blob_cap : MAX_LENGTH;
+    while (col->blob_len + extra > cap) cap *= 2;
+
+    char *tmp = realloc(col->blob, cap);
+    if (tmp == NULL) return -1;
+    col->blob = tmp;
+    col->blob_cap = cap;
+    stats_count(reallocs, 1);
+    return 0;
+}
+
+// Slot of the n pool bytes at s, either holding its code + 1 or empty
+static size_t dict_slot(const Column *col, uint64_t h, const char *s, size_t n)
+{
+    size_t mask = col->slot_count - 1;
+    size_t slot = h & mask;
+
+    while (col->slots[slot] != 0)
+    {
+        size_t k = col->slots[slot] - 1;
+        size_t len = col->offsets[k + 1] - col->offsets[k];
+        if (len == n && memcmp(col->blob + col->offsets[k], s, n) == 0) break;
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static uint64_t dict_hash(const char *s, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// Intern the n bytes just written past blob_len, they stay in the pool only when new
+static int64_t dict_commit(Column *col, size_t n)
+{
+    const char *s = col->blob + col->blob_len;
+    uint64_t h = dict_hash(s, n);
+
+    // Same growth policy as the parameter table, slots are rebuilt from the pool
+    if ((col->dict_len + 1) * 2 > col->slot_count)
+    {
+        size_t slot_count = col->slot_count ? col->slot_count * 2 : 64;
+        uint32_t *slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL) return -1;
+
+        for (size_t k = 0; k < col->dict_len; k++)
+        {
+            size_t at = dict_hash(col->blob + col->offsets[k], col->offsets[k + 1] - col->offsets[k]) & (slot_count - 1);
+            while (slots[at] != 0) at = (at + 1) & (slot_count - 1);
+            slots[at] = k + 1;
+        }
+
+        free(col->slots);
+        col->slots = slots;
+        col->slot_count = slot_count;
+    }
+
+    size_t slot = dict_slot(col, h, s, n);
+    if (col->slots[slot] != 0) return col->slots[slot] - 1;
+
+    // A new string, one more end offset
+    if (col->dict_len + 1 >= col->dict_cap)
+    {
+        size_t cap = col->dict_cap ? col->dict_cap * 2 : 64;
+        size_t *tmp = realloc(col->offsets, cap * sizeof(*tmp));
+        if (tmp == NULL) return -1;
+        if (col->offsets == NULL) tmp[0] = 0;
+        col->offsets = tmp;
+        col->dict_cap = cap;
+        stats_count(reallocs, 1);
+    }
+
+    col->blob_len += n;
+    col->offsets[++col->dict_len] = col->blob_len;
+    col->slots[slot] = col->dict_len;
+    return col->dict_len - 1;
+}
+
+int64_t dict_intern(Column *col, const char *s, size_t len)
+{
+    if (blob_reserve(col, len + 1) != 0) return -1;
+    if (len > 0) memcpy(col->blob + col->blob_len, s, len);
+    return dict_commit(col, len);
+}
+
+int columns_append(AQSColumns *cols, const char *data, const AQSRowView *row)
+{
+    if (cols->len == cols->capacity)
+    {
+        if (columns_reserve(cols, cols->capacity ? cols->capacity * 2 : MAX_LENGTH) != 0) return -1;
+    }
+
+    size_t i = cols->len;
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        Column *col = &cols->cols[f];
+        FieldView view = row_field(data, row, f);
+
+        if (column_text(col->type))
+        {
+            // Unescaping never grows a field, so length is enough room
+            if (blob_reserve(col, view.length + 1) != 0) return -1;
+            size_t n = copy_field(data, view, col->blob + col->blob_len, view.length + 1);
+
+            if (col->type == COL_STR)
+            {
+                col->blob_len += n;
+                col->offsets[i + 1] = col->blob_len;
+                continue;
+            }
+
+            // Interned straight from the pool's tail, kept there only when new
+            int64_t code = dict_commit(col, n);
+            if (code < 0) return -1;
+            col->codes[i] = (uint32_t)code;
+            continue;
+        }
+
+        // Numbers are parsed in place, no terminated copy needed
+        NumStatus status;
+        if (col->type == COL_INT) status = parse_int(data + view.offset, view.length, &col->i32[i]);
+        else if (col->type == COL_DBL) status = parse_double(data + view.offset, view.length, &col->f64[i]);
+        else status = parse_datetime(data + view.offset, view.length, &col->i64[i], NULL);
+
+        uint8_t bit = 1 << (i & 7);
+        if (status == NUM_OK) col->valid[i >> 3] |= bit; else col->valid[i >> 3] &= ~bit;
+    }
+
+    cols->len++;
+    return 0;
+}
+
+int columns_concat(AQSColumns *dst, const AQSColumns *src)
+{
+    // An empty source may never have allocated its columns
+    if (src->len == 0) return 0;
+    if (columns_reserve(dst, dst->len + src->len) != 0) return -1;
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        Column *d = &dst->cols[f];
+        const Column *s = &src->cols[f];
+
+        switch (d->type)
+        {
+            case COL_INT:
+                memcpy(d->i32 + dst->len, s->i32, src->len * sizeof(*s->i32));
+                break;
+            case COL_DBL:
+                memcpy(d->f64 + dst->len, s->f64, src->len * sizeof(*s->f64));
+                break;
+            case COL_TIME:
+                memcpy(d->i64 + dst->len, s->i64, src->len * sizeof(*s->i64));
+                break;
+            case COL_STR:
+            {
+                if (d->blob_len + s->blob_len > d->blob_cap)
+                {
+                    size_t cap = d->blob_len + s->blob_len;
+                    char *tmp = realloc(d->blob, cap > 0 ? cap : 1);
+                    if (tmp == NULL) return -1;
+                    d->blob = tmp;
+                    d->blob_cap = cap;
+                    stats_count(reallocs, 1);
+                }
+
+                if (s->blob_len > 0) memcpy(d->blob + d->blob_len, s->blob, s->blob_len);
+
+                for (size_t i = 1; i <= src->len; i++)
+                {
+                    d->offsets[dst->len + i] = d->blob_len + s->offsets[i];
+                }
+
+                d->blob_len += s->blob_len;
+                break;
+            }
+            case COL_DICT:
+            {
+                // Each source string is interned once, then its rows are recoded
+                uint32_t *map = malloc((s->dict_len ? s->dict_len : 1) * sizeof(*map));
+                if (map == NULL) return -1;
+
+                for (size_t k = 0; k < s->dict_len; k++)
+                {
+                    int64_t code = dict_intern(d, s->blob + s->offsets[k], s->offsets[k + 1] - s->offsets[k]);
+                    if (code < 0)
+                    {
+                        free(map);
+                        return -1;
+                    }
+                    map[k] = (uint32_t)code;
+                }
+
+                for (size_t i = 0; i < src->len; i++)
+                {
+                    d->codes[dst->len + i] = map[s->codes[i]];
+                }
+
+                free(map);
+                break;
+            }
+        }
+
+        // dst rarely ends on a byte boundary, move the validity bits one at a time
+        for (size_t i = 0; !column_text(d->type) && i < src->len; i++)
+        {
+            size_t at = dst->len + i;
+            uint8_t bit = 1 << (at & 7);
+            if (column_valid(s, i)) d->valid[at >> 3] |= bit; else d->valid[at >> 3] &= ~bit;
+        }
+    }
+
+    dst->len += src->len;
+    return 0;
+}
+
+AQSColumns *columns_gather(const AQSColumns *src, const uint32_t *rows, size_t n)
+{
+    AQSColumns *dst = columns_create();
+    if (dst == NULL || columns_reserve(dst, n ? n : 1) != 0)
+    {
+        columns_free(dst);
+        return NULL;
+    }
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        Column *d = &dst->cols[f];
+        const Column *s = &src->cols[f];
+
+        switch (d->type)
+        {
+            case COL_INT:
+                for (size_t i = 0; i < n; i++) d->i32[i] = s->i32[rows[i]];
+                break;
+            case COL_DBL:
+                for (size_t i = 0; i < n; i++) d->f64[i] = s->f64[rows[i]];
+                break;
+            case COL_TIME:
+                for (size_t i = 0; i < n; i++) d->i64[i] = s->i64[rows[i]];
+                break;
+            case COL_STR:
+            {
+                size_t total = 0;
+                for (size_t i = 0; i < n; i++) total += s->offsets[rows[i] + 1] - s->offsets[rows[i]];
+
+                if (blob_reserve(d, total + 1) != 0)
+                {
+                    columns_free(dst);
+                    return NULL;
+                }
+
+                for (size_t i = 0; i < n; i++)
+                {
+                    size_t len;
+                    const char *str = column_str(s, rows[i], &len);
+                    if (len > 0) memcpy(d->blob + d->blob_len, str, len);
+                    d->blob_len += len;
+                    d->offsets[i + 1] = d->blob_len;
+                }
+                break;
+            }
+            case COL_DICT:
+            {
+                // Codes stay valid against a copy of the whole pool, its slots are rebuilt on the next intern
+                size_t entries = s->dict_len + 1;
+                d->offsets = malloc(entries * sizeof(*d->offsets));
+                if (d->offsets == NULL || blob_reserve(d, s->offsets ? s->offsets[s->dict_len] + 1 : 1) != 0)
+                {
+                    columns_free(dst);
+                    return NULL;
+                }
+
+                if (s->offsets)
+                {
+                    memcpy(d->offsets, s->offsets, entries * sizeof(*d->offsets));
+                    memcpy(d->blob, s->blob, s->offsets[s->dict_len]);
+                    d->blob_len = s->offsets[s->dict_len];
+                } else 
+                {
+                    d->offsets[0] = 0;
+                }
+
+                d->dict_len = s->dict_len;
+                d->dict_cap = entries;
+                for (size_t i = 0; i < n; i++) d->codes[i] = s->codes[rows[i]];
+                break;
+            }
+        }
+
+        for (size_t i = 0; !column_text(d->type) && i < n; i++)
+        {
+            uint8_t bit = 1 << (i & 7);
+            if (column_valid(s, rows[i])) d->valid[i >> 3] |= bit; else d->valid[i >> 3] &= ~bit;
+        }
+    }
+
+    dst->len = n;
+    return dst;
+}
+
+int load_range(const char *data, size_t begin, size_t end, AQSColumns *cols, bool skip_header, const Filter *filter)
+{
+    AQSRowView row;
+    size_t pos = begin;
+
+    Filter local;
+    if (filter) local = *filter;
+
+    while (pos < end)
+    {
+        // Rejected rows are never fully tokenized nor converted
+        size_t next;
+        if (filter && !skip_header && !filter_record(&local, data, pos, end, &next))
+        {
+            pos = next;
+            continue;
+        }
+
+        // Skip blank and oversized lines
+        if (tokenize_record(data, &pos, end, &row) <= 0) continue;
+
+        if (skip_header)
+        {
+            skip_header = false;
+            continue;
+        }
+
+        if (columns_append(cols, data, &row) != 0) return -1;
+    }
+
+    return 0;
+}
+
+// Work for one loader thread
+typedef struct {
+    const char *data;
+    size_t begin;
+    size_t end;
+    size_t quotes;
+    const Filter *filter;
+    AQSColumns *cols;
+    int status;
+} LoadTask;
+
+// Pass 1: quote count of a raw byte range, tells the next range its quote state
+static void *count_quotes_task(void *arg)
+{
+    LoadTask *task = arg;
+    size_t quotes = 0;
+
+    for (size_t i = task->begin; i < task->end; i++)
+    {
+        quotes += task->data[i] == '"';
+    }
+
+    task->quotes = quotes;
+    return NULL;
+}
+
+// Pass 2: parse whole records of a resynced range into private columns
+static void *load_range_task(void *arg)
+{
+    LoadTask *task = arg;
+
+    task->cols = columns_create();
+    if (task->cols == NULL)
+    {
+        task->status = -1;
+        return NULL;
+    }
+
+    task->status = load_range(task->data, task->begin, task->end, task->cols, task->begin == 0, task->filter);
+    return NULL;
+}
+
+AQSColumns *load_columns(const char *filename, int threads, const Filter *filter)
+{
+    // Compressed input cannot be split, it is parsed as it is inflated
+    if (input_format(filename) != INPUT_PLAIN) return load_stream(filename, filter);
+
+    MappedFile file;
+    if (map_file(filename, &file) != 0) return NULL;
+
+    // Small files are not worth the thread start up
+    size_t max_threads = file.size / MIN_THREAD_BYTES + 1;
+    int n = threads < 1 ? 1 : threads;
+    if ((size_t)n > max_threads) n = max_threads;
+
+    LoadTask *tasks = calloc(n, sizeof(*tasks));
+    if (tasks == NULL)
+    {
+        perror("Failed to allocate load tasks");
+        unmap_file(&file);
+        return NULL;
+    }
+
+    // Equal raw byte ranges first
+    for (int t = 0; t < n; t++)
+    {
+        tasks[t].data = file.data;
+        tasks[t].filter = filter;
+        tasks[t].begin = file.size / n * t;
+        tasks[t].end = t == n - 1 ? file.size : file.size / n * (t + 1);
+    }
+
+    if (n > 1) run_parallel(n, count_quotes_task, tasks, sizeof(*tasks));
+
+    // Resync each range to the first newline outside quotes
+    // The quote state at a range start is the parity of all quotes before it
+    bool in_quotes = false;
+    for (int t = 1; t < n; t++)
+    {
+        in_quotes ^= tasks[t - 1].quotes & 1;
+
+        size_t pos = tasks[t].begin;
+        bool quoted = in_quotes;
+
+        // The previous record already runs past this whole range
+        if (pos < tasks[t - 1].begin)
+        {
+            pos = tasks[t - 1].begin;
+        } else 
+        {
+            while (pos < file.size && (quoted || file.data[pos] != '\n'))
+            {
+                if (file.data[pos] == '"') quoted = !quoted;
+                pos++;
+            }
+
+            if (pos < file.size) pos++;
+        }
+
+        tasks[t].begin = pos;
+        tasks[t - 1].end = pos;
+    }
+
+    run_parallel(n, load_range_task, tasks, sizeof(*tasks));
+
+    // Stitch the per-thread columns back together in file order
+    AQSColumns *cols = tasks[0].cols;
+    bool failed = tasks[0].status != 0;
+
+    for (int t = 1; t < n; t++)
+    {
+        if (cols != NULL && tasks[t].cols != NULL && columns_concat(cols, tasks[t].cols) != 0) failed = true;
+        failed |= tasks[t].status != 0 || tasks[t].cols == NULL;
+        columns_free(tasks[t].cols);
+    }
+
+    // Partial columns would be cached and served as if they were the whole file
+    if (failed)
+    {
+        fprintf(stderr, "could not load the whole file %s\n", filename);
+        columns_free(cols);
+        cols = NULL;
+    }
+
+    // Strings were copied into the column blobs, the mapping can go
+    free(tasks);
+    unmap_file(&file);
+    return cols;
+}
+
+void run_parallel(int count, void *(*fn)(void *), void *args, size_t arg_size)
+{
+    char *base = args;
+
+#ifdef _WIN32
+    for (int i = 0; i < count; i++)
+    {
+        fn(base + i * arg_size);
+    }
+#else
+    pthread_t *tids = malloc(count * sizeof(*tids));
+    bool *started = calloc(count, sizeof(*started));
+
+    // Whatever could not get a thread runs on this one
+    for (int i = 1; i < count; i++)
+    {
+        if (tids && started && pthread_create(&tids[i], NULL, fn, base + i * arg_size) == 0)
+        {
+            started[i] = true;
+        }
+    }
+
+    if (count > 0) fn(base);
+
+    for (int i = 1; i < count; i++)
+    {
+        if (started && started[i])
+        {
+            pthread_join(tids[i], NULL);
+        } else 
+        {
+            fn(base + i * arg_size);
+        }
+    }
+
+    free(tids);
+    free(started);
+#endif
+}
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+#ifndef HAVE_SIMD_SCAN
+static void scan_block_scalar(const char *p, BlockMasks *m)
+{
+    uint64_t quote = 0, comma = 0, newline = 0;
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint64_t bit = (uint64_t)1 << i;
+        quote |= p[i] == '"' ? bit : 0;
+        comma |= p[i] == ',' ? bit : 0;
+        newline |= p[i] == '\n' ? bit : 0;
+    }
+
+    m->quote = quote;
+    m->comma = comma;
+    m->newline = newline;
+}
+#endif
+
+#ifdef HAVE_SIMD_SCAN
+static void scan_block_sse2(const char *p, BlockMasks *m)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    m->quote = m->comma = m->newline = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 16));
+        m->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << (i * 16);
+        m->comma |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, comma)) << (i * 16);
+        m->newline |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)) << (i * 16);
+    }
+}
+
+__attribute__((target("avx2")))
+static void scan_block_avx2(const char *p, BlockMasks *m)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+    m->quote = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, quote))
+        | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, quote)) << 32;
+    m->comma = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, comma))
+        | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, comma)) << 32;
+    m->newline = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline))
+        | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline)) << 32;
+}
+#endif
+
+// Baseline kernel until scan_block_init picks the widest one the CPU supports
+#ifdef HAVE_SIMD_SCAN
+static void (*scan_block_impl)(const char *p, BlockMasks *m) = scan_block_sse2;
+#else
+static void (*scan_block_impl)(const char *p, BlockMasks *m) = scan_block_scalar;
+#endif
+
+void scan_block_init(void)
+{
+#ifdef HAVE_SIMD_SCAN
+    scan_block_impl = __builtin_cpu_supports("avx2") ? scan_block_avx2 : scan_block_sse2;
+#endif
+}
+
+void scan_block(const char *p, size_t n, BlockMasks *m)
+{
+    if (n >= 64)
+    {
+        scan_block_impl(p, m);
+        return;
+    }
+
+    // Tail of the input, never read past the end of a mapping
+    char pad[64] = {0};
+    memcpy(pad, p, n);
+    scan_block_impl(pad, m);
+}
+
+int split_csv_line(char *line, size_t len, char **tokens)
+{
+    // Need lowercase for comprehensive qsort, branch free so it vectorizes
+    for (size_t i = 0; i < len; i++)
+    {
+        line[i] += ((unsigned char)(line[i] - 'A') < 26) << 5;
+    }
+
+    AQSRowView row;
+    size_t pos = 0;
+    int fields = tokenize_record(line, &pos, len, &row);
+    if (fields <= 0) return fields;
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        FieldView view = row_field(line, &row, f);
+        char *src = line + view.offset;
+        size_t n = 0;
+
+        // Collapse "" in place, the field only ever shrinks
+        for (size_t i = 0; i < view.length; i++)
+        {
+            src[n++] = src[i];
+            if (src[i] == '"' && i + 1 < view.length && src[i + 1] == '"') i++;
+        }
+
+        // Lands on the closing quote or separator, never on the next field.
+        // A field running to the end of the line already has the caller's terminator
+        if (view.offset + n < len) src[n] = '\0';
+        tokens[f] = src;
+    }
+
+    return fields;
+}
+
+double now_seconds(void)
+{
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// One row of the benchmark table
+static void bench_report(const char *stage, double seconds, size_t bytes, size_t rows)
+{
+    printf("%-28s %9.4f s %10.1f MB/s %12.0f rows/s\n", stage, seconds,
+        bytes / 1e6 / seconds, rows / seconds);
+}
+
+// Trigram index over the distinct name values, then one search per name for a typo'd slice of it
+static void bench_ngrams(const AQSColumns *cols)
+{
+    static const int name_fields[] = {8, 48, 51, 52, 53, 12};
+    size_t total = 0, name_bytes = 0;
+
+    for (size_t i = 0; i < sizeof(name_fields) / sizeof(name_fields[0]); i++)
+    {
+        total += cols->cols[name_fields[i]].dict_len;
+    }
+
+    const char **names = malloc((total ? total : 1) * sizeof(*names));
+    size_t *lens = malloc((total ? total : 1) * sizeof(*lens));
+    if (names == NULL || lens == NULL)
+    {
+        free(names);
+        free(lens);
+        return;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < sizeof(name_fields) / sizeof(name_fields[0]); i++)
+    {
+        const Column *col = &cols->cols[name_fields[i]];
+        for (size_t k = 0; k < col->dict_len; k++)
+        {
+            names[n] = col->blob + col->offsets[k];
+            lens[n] = col->offsets[k + 1] - col->offsets[k];
+            name_bytes += lens[n++];
+        }
+    }
+
+    double t0 = now_seconds();
+    NgramIndex *index = ngram_index_build(names, lens, n);
+    double t1 = now_seconds();
+
+    if (index)
+    {
+        bench_report("ngram index", t1 - t0, name_bytes, n);
+
+        // Up to 12 bytes from the middle of each name with one byte dropped
+        NgramMatch matches[COMPLETER_MATCHES];
+        size_t queries = 0, query_bytes = 0, hits = 0;
+
+        t0 = now_seconds();
+        for (size_t i = 0; i < n; i++)
+        {
+            char q[12];
+            size_t at = lens[i] / 3, len = lens[i] - at < sizeof(q) ? lens[i] - at : sizeof(q);
+            if (len < 4) continue;
+
+            memcpy(q, names[i] + at, len);
+            memmove(q + len / 2, q + len / 2 + 1, len - len / 2 - 1);
+            hits += ngram_search(index, q, len - 1, matches, COMPLETER_MATCHES) > 0;
+            queries++;
+            query_bytes += len - 1;
+        }
+        t1 = now_seconds();
+
+        bench_report("ngram search", t1 - t0, query_bytes, queries);
+        printf("%zu names indexed, %zu of %zu searches matched, %.1f us per search\n", n, hits, queries,
+            queries ? (t1 - t0) / queries * 1e6 : 0.0);
+    }
+
+    ngram_index_free(index);
+    free(names);
+    free(lens);
+}
+
+int bench(const char *filename, int threads)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+    {
+        fprintf(stderr, "Could not stat %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    size_t bytes = st.st_size;
+
+    // read_data: fgets, split_csv_line and the field switch
+    size_t rows;
+    double t0 = now_seconds();
+    AQSArena *data = read_data(filename, &rows, false, NULL);
+    double t1 = now_seconds();
+
+    if (data == NULL) return -1;
+    bench_report("read_data", t1 - t0, bytes, rows);
+
+    MappedFile file;
+    if (map_file(filename, &file) != 0)
+    {
+        arena_free(data);
+        return -1;
+    }
+
+    // parse_csv_line + strtok, the original per-line tokenizer
+    char line[MAX_LENGTH];
+    size_t fields = 0;
+    t0 = now_seconds();
+
+    for (size_t pos = 0; pos < file.size; )
+    {
+        const char *nl = memchr(file.data + pos, '\n', file.size - pos);
+        size_t end = nl ? (size_t)(nl - file.data) + 1 : file.size;
+        size_t n = end - pos < sizeof(line) - 1 ? end - pos : sizeof(line) - 1;
+
+        memcpy(line, file.data + pos, n);
+        line[n] = '\0';
+        pos = end;
+
+        for (char *token = strtok(parse_csv_line(line, MAX_LENGTH), "\x1F"); token; token = strtok(NULL, "\x1F"))
+        {
+            fields++;
+        }
+    }
+
+    t1 = now_seconds();
+    bench_report("parse_csv_line + strtok", t1 - t0, bytes, rows);
+
+    // Block scanner straight over the mapping
+    AQSRowView row;
+    size_t scanned = 0;
+    t0 = now_seconds();
+
+    for (size_t pos = 0; pos < file.size; )
+    {
+        if (tokenize_record(file.data, &pos, file.size, &row) > 0) scanned++;
+    }
+
+    t1 = now_seconds();
+    bench_report("block scanner", t1 - t0, bytes, scanned);
+    unmap_file(&file);
+
+    // Columnar load, all threads
+    t0 = now_seconds();
+    AQSColumns *cols = load_columns(filename, threads, NULL);
+    t1 = now_seconds();
+
+    if (cols)
+    {
+        bench_report("load_columns", t1 - t0, bytes, cols->len);
+        bench_ngrams(cols);
+        columns_free(cols);
+    }
+
+    // Unique-parameter discovery over the loaded records, header skipped like main
+    const char **names = malloc((rows ? rows : 1) * sizeof(*names));
+    ParamTable *params = param_table_create();
+    size_t name_bytes = 0;
+
+    if (names == NULL || params == NULL)
+    {
+        perror("Failed to allocate benchmark state");
+        free(names);
+        param_table_free(params);
+        arena_free(data);
+        return -1;
+    }
+
+    t0 = now_seconds();
+
+    for (size_t i = 1; i < rows; i++)
+    {
+        const char *name = arena_at(data, i)->parameter_name;
+        size_t len = strlen(name);
+        param_intern(params, name, len);
+        name_bytes += len;
+    }
+
+    t1 = now_seconds();
+    bench_report("unique discovery", t1 - t0, name_bytes, rows > 0 ? rows - 1 : 0);
+
+    // comp over every row's name, the distinct list alone sorts too fast to time
+    for (size_t i = 1; i < rows; i++)
+    {
+        names[i - 1] = arena_at(data, i)->parameter_name;
+    }
+
+    t0 = now_seconds();
+    qsort(names, rows > 0 ? rows - 1 : 0, sizeof(*names), comp);
+    t1 = now_seconds();
+    bench_report("qsort (comp)", t1 - t0, name_bytes, rows > 0 ? rows - 1 : 0);
+
+    printf("%zu bytes, %zu rows, %zu parameters, %zu legacy tokens\n", bytes, rows, params->len, fields);
+
+    free(names);
+    param_table_free(params);
+    arena_free(data);
+    return 0;
+}
+
+// xorshift64*, deterministic for a given seed on every platform
+static uint64_t gen_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+// Uniform in [0, 1)
+static double gen_unit(uint64_t *state)
+{
+    return (gen_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Parameter mix of a real annual file, roughly in order of how many monitors report it
+static const struct {
+    const char *code;
+    const char *name;
+    const char *units;
+    const char *standard;
+} GEN_PARAMS[] = {
+    {"88101", "PM2.5 - Local Conditions", "Micrograms/cubic meter (LC)", "PM25 24-hour 2012"},
+    {"44201", "Ozone", "Parts per million", "Ozone 8-hour 2015"},
+    {"62101", "Outdoor Temperature", "Degrees Fahrenheit", ""},
+    {"61103", "Wind Speed - Resultant", "Knots", ""},
+    {"61104", "Wind Direction - Resultant", "Degrees Compass", ""},
+    {"42602", "Nitrogen dioxide (NO2)", "Parts per billion", "NO2 1-hour 2010"},
+    {"81102", "PM10 Total 0-10um STP", "Micrograms/cubic meter (25 C)", "PM10 24-hour 2006"},
+    {"42101", "Carbon monoxide", "Parts per million", "CO 8-hour 1971"},
+    {"42401", "Sulfur dioxide", "Parts per billion", "SO2 1-hour 2010"},
+    {"62201", "Relative Humidity ", "Percent relative humidity", ""},
+    {"64101", "Barometric pressure", "Millibars", ""},
+    {"45201", "Benzene", "Parts per billion Carbon", ""},
+    {"45202", "Toluene", "Parts per billion Carbon", ""},
+    {"43817", "Tetrachloroethylene", "Parts per billion Carbon", ""},
+    {"43502", "Formaldehyde", "Parts per billion Carbon", ""},
+    {"42603", "Oxides of nitrogen (NOx)", "Parts per billion", ""},
+    {"14129", "Lead (TSP) LC", "Micrograms/cubic meter (LC)", "Lead 3-Month 2009"},
+    {"88502", "Acceptable PM2.5 AQI & Speciation Mass", "Micrograms/cubic meter (LC)", ""},
+};
+
+static const struct {
+    const char *code;
+    const char *name;
+    double lat;
+    double lon;
+} GEN_STATES[] = {
+    {"06", "California", 36.7, -119.4},
+    {"48", "Texas", 31.0, -99.0},
+    {"36", "New York", 42.9, -75.5},
+    {"17", "Illinois", 40.0, -89.2},
+    {"04", "Arizona", 34.2, -111.7},
+    {"12", "Florida", 28.6, -82.4},
+    {"42", "Pennsylvania", 40.9, -77.8},
+    {"53", "Washington", 47.4, -120.5},
+};
+
+static const char *GEN_METHODS[] = {
+    "INSTRUMENTAL - ULTRA VIOLET, ABSORPTION",
+    "Met One BAM-1020 Mass Monitor w/VSCC - Beta Attenuation",
+    "INSTRUMENTAL - CHEMILUMINESCENCE",
+    "INSTRUMENTAL - VECTOR SUMMATION",
+    "Electronic or Machine Avg.",
+    "SS CANISTER PRESSURIZED - GC/MS",
+};
+
+// Quoted CSV field, doubles any embedded quote
+static void gen_field(FILE *fp, const char *text, bool last)
+{
+    fputc('"', fp);
+    for (; *text; text++)
+    {
+        if (*text == '"') fputc('"', fp);
+        fputc(*text, fp);
+    }
+    fputs(last ? "\"\n" : "\",", fp);
+}
+
+static void gen_number(FILE *fp, double value, int decimals, bool present)
+{
+    char buf[64] = "";
+    if (present) snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+    gen_field(fp, buf, false);
+}
+
+static void gen_datetime(FILE *fp, uint64_t *rng, int year, bool present)
+{
+    char buf[32] = "";
+    if (present)
+    {
+        snprintf(buf, sizeof(buf), "%d-%02d-%02d %02d:00", year,
+            (int)(gen_next(rng) % 12) + 1, (int)(gen_next(rng) % 28) + 1, (int)(gen_next(rng) % 24));
+    }
+    gen_field(fp, buf, false);
+}
+
+int generate_data(const char *filename, size_t rows, uint64_t seed)
+{
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    static const char *header[MAX_FIELDS] = {
+        "State Code", "County Code", "Site Num", "Parameter Code", "POC", "Latitude", "Longitude",
+        "Datum", "Parameter Name", "Sample Duration", "Pollutant Standard", "Metric Used",
+        "Method Name", "Year", "Units of Measure", "Event Type", "Observation Count",
+        "Observation Percent", "Completeness Indicator", "Valid Day Count", "Required Day Count",
+        "Exceptional Data Count", "Null Data Count", "Primary Exceedance Count",
+        "Secondary Exceedance Count", "Certification Indicator", "Num Obs Below MDL",
+        "Arithmetic Mean", "Arithmetic Standard Dev", "1st Max Value", "1st Max DateTime",
+        "2nd Max Value", "2nd Max DateTime", "3rd Max Value", "3rd Max DateTime", "4th Max Value",
+        "4th Max DateTime", "1st Max Non Overlapping Value", "1st NO Max DateTime",
+        "2nd Max Non Overlapping Value", "2nd NO Max DateTime", "99th Percentile",
+        "98th Percentile", "95th Percentile", "90th Percentile", "75th Percentile",
+        "50th Percentile", "10th Percentile", "Local Site Name", "Address", "State Name",
+        "County Name", "City Name", "CBSA Name", "Date of Last Change",
+    };
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        gen_field(fp, header[f], f == MAX_FIELDS - 1);
+    }
+
+    uint64_t rng = seed ? seed : 1;
+    size_t param_count = sizeof(GEN_PARAMS) / sizeof(GEN_PARAMS[0]);
+    size_t state_count = sizeof(GEN_STATES) / sizeof(GEN_STATES[0]);
+    size_t method_count = sizeof(GEN_METHODS) / sizeof(GEN_METHODS[0]);
+
+    // Zipf weights, the first few parameters dominate like they do in real files
+    double total = 0;
+    for (size_t k = 0; k < param_count; k++) total += 1.0 / (k + 1);
+
+    for (size_t r = 0; r < rows; r++)
+    {
+        double pick = gen_unit(&rng) * total;
+        size_t p = 0;
+        while (p < param_count - 1 && (pick -= 1.0 / (p + 1)) > 0) p++;
+
+        size_t s = gen_next(&rng) % state_count;
+        int county = gen_next(&rng) % 120 + 1;
+        int site = gen_next(&rng) % 40 + 1;
+        int year = 1990 + gen_next(&rng) % 34;
+        double scale = p == 0 ? 40 : p == 1 ? 0.1 : 10;
+
+        char buf[128];
+        gen_field(fp, GEN_STATES[s].code, false);
+        snprintf(buf, sizeof(buf), "%03d", county);
+        gen_field(fp, buf, false);
+        snprintf(buf, sizeof(buf), "%04d", site);
+        gen_field(fp, buf, false);
+        gen_field(fp, GEN_PARAMS[p].code, false);
+        gen_number(fp, gen_next(&rng) % 3 + 1, 0, true);
+        gen_number(fp, GEN_STATES[s].lat + gen_unit(&rng) * 2 - 1 + county * 0.01, 6, true);
+        gen_number(fp, GEN_STATES[s].lon + gen_unit(&rng) * 2 - 1 + site * 0.01, 6, true);
+        gen_field(fp, gen_next(&rng) % 4 ? "WGS84" : "NAD83", false);
+        gen_field(fp, GEN_PARAMS[p].name, false);
+        gen_field(fp, gen_next(&rng) % 3 ? "1 HOUR" : "24 HOUR", false);
+        gen_field(fp, GEN_PARAMS[p].standard, false);
+        gen_field(fp, "Daily maximum of 8-hour running average", false);
+        gen_field(fp, GEN_METHODS[gen_next(&rng) % method_count], false);
+        gen_number(fp, year, 0, true);
+        gen_field(fp, GEN_PARAMS[p].units, false);
+        gen_field(fp, gen_next(&rng) % 10 ? "No Events" : "Events Included", false);
+
+        int observations = gen_next(&rng) % 8760 + 1;
+        gen_number(fp, observations, 0, true);
+        gen_number(fp, gen_next(&rng) % 101, 0, true);
+        gen_field(fp, gen_next(&rng) % 5 ? "Y" : "N", false);
+        gen_number(fp, gen_next(&rng) % 366, 0, true);
+        gen_number(fp, 365, 0, true);
+        gen_number(fp, gen_next(&rng) % 3, 0, true);
+        gen_number(fp, gen_next(&rng) % 20, 0, true);
+        gen_number(fp, gen_next(&rng) % 10, 0, gen_next(&rng) % 4 != 0);
+        gen_number(fp, gen_next(&rng) % 10, 0, gen_next(&rng) % 3 != 0);
+        gen_field(fp, gen_next(&rng) % 3 ? "Certified" : "Requested but not yet concurred", false);
+        gen_number(fp, gen_next(&rng) % 50, 0, true);
+
+        double mean = gen_unit(&rng) * scale;
+        gen_number(fp, mean, 6, true);
+        gen_number(fp, mean * gen_unit(&rng), 6, true);
+
+        // Four maxima, then the non-overlapping pair which is often empty
+        for (int m = 0; m < 4; m++)
+        {
+            gen_number(fp, mean * (2 + gen_unit(&rng)), 3, true);
+            gen_datetime(fp, &rng, year, true);
+        }
+        for (int m = 0; m < 2; m++)
+        {
+            bool present = gen_next(&rng) % 5 < 2;
+            gen_number(fp, mean * (1.5 + gen_unit(&rng)), 3, present);
+            gen_datetime(fp, &rng, year, present);
+        }
+
+        // Percentiles 99 down to 10, descending
+        double pct = mean * 2;
+        for (int q = 0; q < 7; q++)
+        {
+            gen_number(fp, pct, 3, true);
+            pct *= 0.6 + gen_unit(&rng) * 0.3;
+        }
+
+        snprintf(buf, sizeof(buf), "Site %d, \"%s\" Station", site, GEN_STATES[s].name);
+        gen_field(fp, buf, false);
+        snprintf(buf, sizeof(buf), "%d Main St, Suite %d", site * 100 + county, site % 9 + 1);
+        gen_field(fp, buf, false);
+        gen_field(fp, GEN_STATES[s].name, false);
+        snprintf(buf, sizeof(buf), "County %d", county);
+        gen_field(fp, buf, false);
+        snprintf(buf, sizeof(buf), "City %d", county * 3 + site % 3);
+        gen_field(fp, buf, false);
+        snprintf(buf, sizeof(buf), "Metro %d, %.2s", county % 17, GEN_STATES[s].name);
+        gen_field(fp, gen_next(&rng) % 6 ? buf : "", false);
+        snprintf(buf, sizeof(buf), "2024-%02d-%02d", (int)(gen_next(&rng) % 12) + 1, (int)(gen_next(&rng) % 28) + 1);
+        gen_field(fp, buf, true);
+    }
+
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "Could not write %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+size_t normalize_name(const char *name, size_t len, char *dst)
+{
+    size_t k = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (name[i] == '"') continue;
+        dst[k++] = tolower((unsigned char)name[i]);
+    }
+
+    dst[k] = '\0';
+    return k;
+}
+
+// FNV-1a over the name as it will be stored: no quotes, lowercase
+static uint64_t hash_name(const char *name, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (name[i] == '"') continue;
+        h ^= (unsigned char)tolower((unsigned char)name[i]);
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// Compare a raw name against a stored one under the same normalisation
+static bool name_equals(const char *stored, const char *name, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (name[i] == '"') continue;
+        if (*stored++ != tolower((unsigned char)name[i])) return false;
+    }
+
+    return *stored == '\0';
+}
+
+ParamTable *param_table_create(void)
+{
+    ParamTable *table = calloc(1, sizeof(*table));
+    if (table == NULL) return NULL;
+
+    table->slot_count = 1024;
+    table->slots = calloc(table->slot_count, sizeof(*table->slots));
+    if (table->slots == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+void param_table_free(ParamTable *table)
+{
+    if (table == NULL) return;
+
+    for (size_t i = 0; i < table->len; i++)
+    {
+        free(table->names[i]);
+    }
+
+    free(table->names);
+    free(table->counts);
+    free(table->hashes);
+    free(table->slots);
+    free(table);
+}
+
+// Slot holding name, or the empty slot where it belongs
+static size_t param_slot(const ParamTable *table, uint64_t h, const char *name, size_t len)
+{
+    size_t mask = table->slot_count - 1;
+    size_t slot = h & mask;
+
+    while (table->slots[slot] != 0)
+    {
+        uint32_t id = table->slots[slot] - 1;
+        if (table->hashes[id] == h && name_equals(table->names[id], name, len)) break;
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+int32_t param_lookup(const ParamTable *table, const char *name, size_t len)
+{
+    size_t slot = param_slot(table, hash_name(name, len), name, len);
+    return (int32_t)table->slots[slot] - 1;
+}
+
+int32_t param_intern(ParamTable *table, const char *name, size_t len)
+{
+    uint64_t h = hash_name(name, len);
+    size_t slot = param_slot(table, h, name, len);
+
+    if (table->slots[slot] != 0)
+    {
+        uint32_t id = table->slots[slot] - 1;
+        table->counts[id]++;
+        return id;
+    }
+
+    // Keep the load factor under one half
+    if ((table->len + 1) * 2 > table->slot_count)
+    {
+        size_t slot_count = table->slot_count * 2;
+        uint32_t *slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL) return -1;
+
+        for (size_t id = 0; id < table->len; id++)
+        {
+            size_t s = table->hashes[id] & (slot_count - 1);
+            while (slots[s] != 0) s = (s + 1) & (slot_count - 1);
+            slots[s] = id + 1;
+        }
+
+        free(table->slots);
+        table->slots = slots;
+        table->slot_count = slot_count;
+        slot = param_slot(table, h, name, len);
+    }
+
+    if (table->len == table->cap)
+    {
+        size_t cap = table->cap ? table->cap * 2 : 64;
+        char **names = realloc(table->names, cap * sizeof(*names));
+        if (names == NULL) return -1;
+        table->names = names;
+
+        size_t *counts = realloc(table->counts, cap * sizeof(*counts));
+        if (counts == NULL) return -1;
+        table->counts = counts;
+
+        uint64_t *hashes = realloc(table->hashes, cap * sizeof(*hashes));
+        if (hashes == NULL) return -1;
+        table->hashes = hashes;
+
+        table->cap = cap;
+        stats_count(reallocs, 1);
+    }
+
+    // Quote stripping happens here, once per distinct name
+    char *copy = malloc(len + 1);
+    if (copy == NULL) return -1;
+
+    normalize_name(name, len, copy);
+
+    uint32_t id = table->len++;
+    table->names[id] = copy;
+    table->counts[id] = 1;
+    table->hashes[id] = h;
+    table->slots[slot] = id + 1;
+
+    return id;
+}
+
+int reader_open(RecordReader *r, const char *filename)
+{
+    memset(r, 0, sizeof(*r));
+
+    if (source_open(&r->src, filename) != 0) return -1;
+
+    r->cap = 1 << 20;
+    r->buf = malloc(r->cap);
+    if (r->buf == NULL)
+    {
+        perror("Failed to allocate reader buffer");
+        source_close(&r->src);
+        return -1;
+    }
+
+    return 0;
+}
+
+void reader_close(RecordReader *r)
+{
+    source_close(&r->src);
+    free(r->buf);
+    memset(r, 0, sizeof(*r));
+}
+
+// Slide the unread tail to the front and read more behind it
+static int reader_fill(RecordReader *r)
+{
+    memmove(r->buf, r->buf + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+
+    // One record fills the whole buffer
+    if (r->len == r->cap)
+    {
+        char *tmp = realloc(r->buf, r->cap * 2);
+        if (tmp == NULL)
+        {
+            r->error = true;
+            return -1;
+        }
+        r->buf = tmp;
+        r->cap *= 2;
+        stats_count(reallocs, 1);
+    }
+
+    size_t n;
+    if (source_read(&r->src, r->buf + r->len, r->cap - r->len, &n) != 0)
+    {
+        r->error = true;
+        return -1;
+    }
+    if (n == 0) r->eof = true;
+
+    r->len += n;
+    return 0;
+}
+
+int reader_next(RecordReader *r, int max_fields, AQSRowView *row, size_t *len)
+{
+    for (;;)
+    {
+        if (r->start == r->len)
+        {
+            if (r->eof) return 0;
+            if (reader_fill(r) != 0) return -1;
+            continue;
+        }
+
+        int fields;
+        size_t end = scan_record(r->buf, r->start, r->len, max_fields, row, &fields);
+
+        // Record runs past the buffer, rescan it once more is read
+        if (end == r->len && !r->eof)
+        {
+            if (reader_fill(r) != 0) return -1;
+            continue;
+        }
+
+        size_t next = end < r->len ? end + 1 : r->len;
+        *len = next - r->start;
+        r->start = next;
+
+        // Skip blank and oversized lines
+        if (fields > 0) return fields;
+    }
+}
+
+char *reader_gets(RecordReader *r, char *line, size_t size)
+{
+    for (;;)
+    {
+        size_t avail = r->len - r->start;
+        size_t want = avail < size - 1 ? avail : size - 1;
+        const char *nl = memchr(r->buf + r->start, '\n', want);
+
+        // A whole line, a full line buffer or the last bytes of the input
+        if (nl || want == size - 1 || (r->eof && avail > 0))
+        {
+            size_t n = nl ? (size_t)(nl - (r->buf + r->start)) + 1 : want;
+            memcpy(line, r->buf + r->start, n);
+            line[n] = '\0';
+            r->start += n;
+            return line;
+        }
+
+        if (r->eof || reader_fill(r) != 0) return NULL;
+    }
+}
+
+AQSColumns *load_stream(const char *filename, const Filter *filter)
+{
+    RecordReader reader;
+    if (reader_open(&reader, filename) != 0) return NULL;
+
+    AQSColumns *cols = columns_create();
+    if (cols == NULL)
+    {
+        reader_close(&reader);
+        return NULL;
+    }
+
+    Filter local;
+    if (filter) local = *filter;
+
+    // Rows are located only as far as the filter reads until they pass it
+    int max_fields = filter ? filter->max_field + 1 : MAX_FIELDS;
+
+    AQSRowView row;
+    size_t len;
+    bool header = true;
+    int fields;
+    int status = 0;
+
+    while (status == 0 && (fields = reader_next(&reader, max_fields, &row, &len)) > 0)
+    {
+        if (header)
+        {
+            header = false;
+            continue;
+        }
+
+        if (filter)
+        {
+            if (!filter_row(&local, reader.buf, &row)) continue;
+            scan_record(reader.buf, row.offset, row.offset + len, MAX_FIELDS, &row, &fields);
+        }
+
+        status = columns_append(cols, reader.buf, &row);
+    }
+
+    // Partial columns would be cached and served as if they were the whole file
+    if (status != 0 || fields < 0)
+    {
+        fprintf(stderr, "could not load the whole file %s\n", filename);
+        columns_free(cols);
+        cols = NULL;
+    }
+
+    reader_close(&reader);
+    return cols;
+}
+
+int stream_reduce(const char *filename, const char *param, const Filter *filter, FILE *out, bool header)
+{
+    RecordReader reader;
+    if (reader_open(&reader, filename) != 0) return -1;
+
+    // Same normalisation as the interned names
+    size_t param_len = strlen(param);
+    char *wanted = malloc(param_len + 1);
+    if (wanted == NULL)
+    {
+        perror("Failed to allocate param");
+        reader_close(&reader);
+        return -1;
+    }
+    normalize_name(param, param_len, wanted);
+
+    AQSRowView row;
+    size_t len;
+    bool first = true;
+    int fields;
+
+    Filter local;
+    if (filter) local = *filter;
+
+    // Only the fields up to parameter_name (8) and the filter's last one are located
+    int max_fields = filter && filter->max_field >= 9 ? filter->max_field + 1 : 9;
+
+    while ((fields = reader_next(&reader, max_fields, &row, &len)) > 0)
+    {
+        const char *rec = reader.buf + row.offset;
+
+        if (first)
+        {
+            first = false;
+            if (!header) continue;
+        } else 
+        {
+            FieldView name = row_field(reader.buf, &row, 8);
+            if (!name_equals(wanted, reader.buf + name.offset, name.length)) continue;
+            if (filter && !filter_row(&local, reader.buf, &row)) continue;
+        }
+
+        // Original bytes, untouched
+        fwrite(rec, 1, len, out);
+        if (rec[len - 1] != '\n') fputc('\n', out);
+    }
+
+    if (fields < 0)
+    {
+        fprintf(stderr, "could not read the whole file %s\n", filename);
+    }
+
+    free(wanted);
+    reader_close(&reader);
+    return fields < 0 ? -1 : 0;
+}
+
+// Rebuild ds over the rows passing filter, the parameter index is rebuilt with them
+static int dataset_filter(Dataset *ds, const Filter *filter)
+{
+    uint32_t *rows = malloc((ds->cols->len ? ds->cols->len : 1) * sizeof(*rows));
+    if (rows == NULL) return -1;
+
+    for (size_t i = 0; i < ds->cols->len; i++) rows[i] = i;
+    int64_t n = filter_columns(filter, ds->cols, rows, ds->cols->len);
+    AQSColumns *cols = n < 0 ? NULL : columns_gather(ds->cols, rows, (size_t)n);
+    free(rows);
+    if (cols == NULL) return -1;
+
+    // The old columns and index may live in the sidecar mapping
+    columns_free(ds->cols);
+    param_table_free(ds->params);
+    if (ds->cache.data == NULL)
+    {
+        free(ds->param_starts);
+        free(ds->param_rows);
+    }
+    unmap_file(&ds->cache);
+
+    ds->cols = cols;
+    ds->params = NULL;
+    ds->param_starts = NULL;
+    ds->param_rows = NULL;
+    return dataset_index_params(ds);
+}
+
+Dataset *load_dataset(const char *filename, const Options *opts)
+{
+    // The sidecar holds every row, a filtered load reads it whole and filters the loaded columns
+    Dataset *ds = opts->cache ? cache_load(filename) : NULL;
+
+    if (ds == NULL)
+    {
+        ds = calloc(1, sizeof(*ds));
+        if (ds == NULL)
+        {
+            perror("Failed to allocate dataset");
+            return NULL;
+        }
+
+        // Without a sidecar to fill, rejected rows are skipped while parsing
+        ds->cols = load_columns(filename, opts->threads, opts->cache ? NULL : opts->filter);
+        if (ds->cols == NULL || dataset_index_params(ds) != 0)
+        {
+            dataset_free(ds);
+            return NULL;
+        }
+
+        // A failed write only costs the next run a parse
+        if (opts->cache && cache_write(filename, ds) != 0)
+        {
+            fprintf(stderr, "Could not write cache for %s\n", filename);
+        }
+    }
+
+    if (opts->cache && opts->filter && dataset_filter(ds, opts->filter) != 0)
+    {
+        fprintf(stderr, "Could not filter %s\n", filename);
+        dataset_free(ds);
+        return NULL;
+    }
+
+    return ds;
+}
+
+// One file of a batch, workers take every stride-th file
+typedef struct {
+    char **files;
+    Dataset **out;
+    int count;
+    int first;
+    int stride;
+    Options opts;
+} BatchTask;
+
+static void *load_batch_task(void *arg)
+{
+    BatchTask *task = arg;
+
+    for (int i = task->first; i < task->count; i += task->stride)
+    {
+        task->out[i] = load_dataset(task->files[i], &task->opts);
+    }
+
+    return NULL;
+}
+
+Dataset *load_datasets(char **files, int count, const Options *opts)
+{
+    if (count == 1)
+    {
+        Dataset *ds = load_dataset(files[0], opts);
+        if (ds && (ds->sources = malloc(sizeof(*ds->sources))) && (ds->sources[0] = malloc(strlen(files[0]) + 1)))
+        {
+            strcpy(ds->sources[0], files[0]);
+            ds->source_count = 1;
+        }
+        return ds;
+    }
+
+    if (count > UINT16_MAX)
+    {
+        fprintf(stderr, "Too many input files (%d)\n", count);
+        return NULL;
+    }
+
+    Dataset **parts = calloc(count, sizeof(*parts));
+    int workers = opts->threads < count ? opts->threads : count;
+    BatchTask *tasks = calloc(workers, sizeof(*tasks));
+    Dataset *ds = calloc(1, sizeof(*ds));
+
+    if (parts == NULL || tasks == NULL || ds == NULL)
+    {
+        perror("Failed to allocate batch");
+        free(parts);
+        free(tasks);
+        free(ds);
+        return NULL;
+    }
+
+    // One reader per file, spare threads go to splitting each file
+    for (int w = 0; w < workers; w++)
+    {
+        tasks[w].files = files;
+        tasks[w].out = parts;
+        tasks[w].count = count;
+        tasks[w].first = w;
+        tasks[w].stride = workers;
+        tasks[w].opts = *opts;
+        tasks[w].opts.threads = opts->threads / workers > 0 ? opts->threads / workers : 1;
+    }
+
+    run_parallel(workers, load_batch_task, tasks, sizeof(*tasks));
+
+    size_t rows = 0;
+    bool ok = true;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (parts[i] == NULL)
+        {
+            fprintf(stderr, "Failed to load %s\n", files[i]);
+            ok = false;
+        } else 
+        {
+            rows += parts[i]->cols->len;
+        }
+    }
+
+    ds->cols = ok ? columns_create() : NULL;
+    ds->sources = ok ? calloc(count, sizeof(*ds->sources)) : NULL;
+    ds->source_ids = ok ? malloc((rows ? rows : 1) * sizeof(*ds->source_ids)) : NULL;
+    ok = ds->cols && ds->sources && ds->source_ids && columns_reserve(ds->cols, rows) == 0;
+
+    // Merge in argument order, every row remembers its file
+    for (int i = 0; i < count && ok; i++)
+    {
+        size_t start = ds->cols->len;
+        ok = columns_concat(ds->cols, parts[i]->cols) == 0;
+
+        for (size_t r = start; ok && r < ds->cols->len; r++)
+        {
+            ds->source_ids[r] = i;
+        }
+
+        ds->sources[i] = malloc(strlen(files[i]) + 1);
+        if (ds->sources[i] == NULL) ok = false; else strcpy(ds->sources[i], files[i]);
+        ds->source_count = i + 1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        dataset_free(parts[i]);
+    }
+
+    free(parts);
+    free(tasks);
+
+    // One dictionary and row index over the merged rows
+    if (!ok || dataset_index_params(ds) != 0)
+    {
+        fprintf(stderr, "Failed to merge input files\n");
+        dataset_free(ds);
+        return NULL;
+    }
+
+    return ds;
+}
+
+void dataset_free(Dataset *ds)
+{
+    if (ds == NULL) return;
+
+    for (size_t i = 0; i < ds->source_count; i++)
+    {
+        free(ds->sources[i]);
+    }
+
+    free(ds->sources);
+    free(ds->source_ids);
+
+    columns_free(ds->cols);
+    param_table_free(ds->params);
+
+    // Index arrays live inside the sidecar mapping when it was loaded
+    if (ds->cache.data == NULL)
+    {
+        free(ds->param_starts);
+        free(ds->param_rows);
+    }
+
+    unmap_file(&ds->cache);
+    free(ds);
+}
+
+int dataset_index_params(Dataset *ds)
+{
+    const AQSColumns *cols = ds->cols;
+
+    ds->params = param_table_create();
+    uint32_t *ids = malloc((cols->len ? cols->len : 1) * sizeof(*ids));
+
+    if (ds->params == NULL || ids == NULL)
+    {
+        perror("Failed to allocate parameter index");
+        free(ids);
+        return -1;
+    }
+
+    // parameter_name is dictionary-encoded: each spelling some row uses is interned once
+    const Column *names = &cols->cols[8];
+    size_t dict_len = names->dict_len ? names->dict_len : 1;
+    size_t *uses = calloc(dict_len, sizeof(*uses));
+    int32_t *by_code = malloc(dict_len * sizeof(*by_code));
+    bool ok = uses && by_code;
+
+    for (size_t i = 0; ok && i < cols->len; i++)
+    {
+        uses[names->codes[i]]++;
+    }
+
+    for (size_t k = 0; ok && k < names->dict_len; k++)
+    {
+        if (uses[k] == 0) continue;
+
+        size_t len = names->offsets[k + 1] - names->offsets[k];
+        by_code[k] = param_intern(ds->params, names->blob + names->offsets[k], len);
+        ok = by_code[k] >= 0;
+    }
+
+    if (!ok)
+    {
+        perror("Failed to intern parameter_name");
+        free(uses);
+        free(by_code);
+        free(ids);
+        return -1;
+    }
+
+    // Interning counted spellings, the index needs rows
+    if (ds->params->len > 0) memset(ds->params->counts, 0, ds->params->len * sizeof(*ds->params->counts));
+
+    for (size_t k = 0; k < names->dict_len; k++)
+    {
+        if (uses[k]) ds->params->counts[by_code[k]] += uses[k];
+    }
+
+    for (size_t i = 0; i < cols->len; i++)
+    {
+        ids[i] = by_code[names->codes[i]];
+    }
+
+    free(uses);
+    free(by_code);
+
+    // Counting sort of row ids by parameter
+    size_t count = ds->params->len;
+    ds->param_starts = calloc(count + 1, sizeof(*ds->param_starts));
+    ds->param_rows = malloc((cols->len ? cols->len : 1) * sizeof(*ds->param_rows));
+
+    if (ds->param_starts == NULL || ds->param_rows == NULL)
+    {
+        perror("Failed to allocate parameter index");
+        free(ids);
+        return -1;
+    }
+
+    for (size_t id = 0; id < count; id++)
+    {
+        ds->param_starts[id + 1] = ds->param_starts[id] + ds->params->counts[id];
+    }
+
+    size_t *fill = malloc((count ? count : 1) * sizeof(*fill));
+    if (fill == NULL)
+    {
+        perror("Failed to allocate parameter index");
+        free(ids);
+        return -1;
+    }
+
+    memcpy(fill, ds->param_starts, count * sizeof(*fill));
+
+    for (size_t i = 0; i < cols->len; i++)
+    {
+        ds->param_rows[fill[ids[i]]++] = i;
+    }
+
+    free(fill);
+    free(ids);
+    return 0;
+}
+
+// Sidecar path for a CSV, caller frees
+static char *cache_path(const char *filename)
+{
+    size_t len = strlen(filename);
+    char *path = malloc(len + sizeof(CACHE_SUFFIX));
+
+    if (path)
+    {
+        memcpy(path, filename, len);
+        memcpy(path + len, CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+    }
+
+    return path;
+}
+
+// Pad a section of n bytes to the next multiple of 8
+static int cache_pad(FILE *fp, size_t n)
+{
+    static const char zeros[8] = {0};
+
+    if (n % 8 && fwrite(zeros, 1, 8 - n % 8, fp) != 8 - n % 8) return -1;
+    return 0;
+}
+
+// Write one padded section
+static int cache_put(FILE *fp, const void *p, size_t n)
+{
+    if (n > 0 && fwrite(p, 1, n, fp) != n) return -1;
+    return cache_pad(fp, n);
+}
+
+// Next section of a mapped sidecar, NULL when the file is too short
+static const void *cache_take(const MappedFile *file, size_t *pos, size_t n)
+{
+    size_t padded = (n + 7) & ~(size_t)7;
+    if (padded < n || *pos > file->size || file->size - *pos < padded) return NULL;
+
+    const void *p = file->data + *pos;
+    *pos += padded;
+    return p;
+}
+
+// Offsets start at 0, never go backwards and end within limit
+static bool cache_offsets_valid(const size_t *offsets, size_t n, size_t limit)
+{
+    if (offsets[0] != 0 || offsets[n] > limit) return false;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (offsets[i + 1] < offsets[i]) return false;
+    }
+
+    return true;
+}
+
+Dataset *cache_load(const char *filename)
+{
+    // Offsets are stored as 64-bit size_t
+    if (sizeof(size_t) != sizeof(uint64_t)) return NULL;
+
+    struct stat st;
+    if (stat(filename, &st) != 0) return NULL;
+
+    char *path = cache_path(filename);
+    if (path == NULL) return NULL;
+
+    // Quietly treat a missing sidecar as a cold cache
+    struct stat cst;
+    if (stat(path, &cst) != 0)
+    {
+        free(path);
+        return NULL;
+    }
+
+    Dataset *ds = calloc(1, sizeof(*ds));
+    AQSColumns *cols = columns_create();
+
+    if (ds == NULL || cols == NULL || map_file(path, &ds->cache) != 0)
+    {
+        free(path);
+        free(ds);
+        free(cols);
+        return NULL;
+    }
+
+    free(path);
+    ds->cols = cols;
+    cols->borrowed = true;
+
+    const MappedFile *file = &ds->cache;
+    size_t pos = 0;
+    const CacheHeader *header = cache_take(file, &pos, sizeof(*header));
+
+    // Stale or foreign sidecars are ignored, the next write replaces them
+    if (header == NULL || memcmp(header->magic, "AQSC", 4) != 0 || header->version != CACHE_VERSION
+        || header->source_size != (uint64_t)st.st_size || header->source_mtime != (int64_t)st.st_mtime)
+    {
+        dataset_free(ds);
+        return NULL;
+    }
+
+    size_t rows = header->rows;
+    size_t count = header->param_count;
+
+    // Every row and every parameter takes bytes in the file, larger counts are garbage
+    bool ok = header->rows <= file->size && header->param_count <= file->size;
+
+    cols->len = cols->capacity = rows;
+
+    for (int f = 0; f < MAX_FIELDS && ok; f++)
+    {
+        Column *col = &cols->cols[f];
+
+        switch (col->type)
+        {
+            case COL_INT:
+                col->i32 = (int32_t *)cache_take(file, &pos, rows * sizeof(*col->i32));
+                col->valid = (uint8_t *)cache_take(file, &pos, (rows + 7) / 8);
+                ok = col->i32 != NULL && col->valid != NULL;
+                break;
+            case COL_DBL:
+                col->f64 = (double *)cache_take(file, &pos, rows * sizeof(*col->f64));
+                col->valid = (uint8_t *)cache_take(file, &pos, (rows + 7) / 8);
+                ok = col->f64 != NULL && col->valid != NULL;
+                break;
+            case COL_TIME:
+                col->i64 = (int64_t *)cache_take(file, &pos, rows * sizeof(*col->i64));
+                col->valid = (uint8_t *)cache_take(file, &pos, (rows + 7) / 8);
+                ok = col->i64 != NULL && col->valid != NULL;
+                break;
+            case COL_STR:
+            {
+                const uint64_t *blob_len = cache_take(file, &pos, sizeof(*blob_len));
+                ok = blob_len != NULL;
+                if (!ok) break;
+
+                col->blob_len = col->blob_cap = *blob_len;
+                col->offsets = (size_t *)cache_take(file, &pos, (rows + 1) * sizeof(*col->offsets));
+                col->blob = (char *)cache_take(file, &pos, col->blob_len);
+                ok = col->offsets != NULL && col->blob != NULL
+                    && cache_offsets_valid(col->offsets, rows, col->blob_len);
+                break;
+            }
+            case COL_DICT:
+            {
+                // Pool size, then offsets by code, the strings and one code per row
+                const uint64_t *sizes = cache_take(file, &pos, 2 * sizeof(*sizes));
+                ok = sizes != NULL;
+                if (!ok) break;
+
+                // Codes are 32 bits wide
+                ok = sizes[0] <= UINT32_MAX;
+                if (!ok) break;
+
+                col->dict_len = col->dict_cap = sizes[0];
+                col->blob_len = col->blob_cap = sizes[1];
+                col->offsets = (size_t *)cache_take(file, &pos, (col->dict_len + 1) * sizeof(*col->offsets));
+                col->blob = (char *)cache_take(file, &pos, col->blob_len);
+                col->codes = (uint32_t *)cache_take(file, &pos, rows * sizeof(*col->codes));
+                ok = col->offsets != NULL && col->blob != NULL && col->codes != NULL
+                    && cache_offsets_valid(col->offsets, col->dict_len, col->blob_len);
+
+                // A code past the pool would read outside the mapping later
+                for (size_t i = 0; ok && i < rows; i++)
+                {
+                    ok = col->codes[i] < col->dict_len;
+                }
+                break;
+            }
+        }
+    }
+
+    // Rebuild the (small) dictionary as a live table so lookups keep working
+    const uint64_t *counts = ok ? cache_take(file, &pos, count * sizeof(*counts)) : NULL;
+    const uint64_t *name_offs = counts ? cache_take(file, &pos, (count + 1) * sizeof(*name_offs)) : NULL;
+    const char *names = name_offs && cache_offsets_valid(name_offs, count, file->size)
+        ? cache_take(file, &pos, name_offs[count]) : NULL;
+
+    ds->params = names ? param_table_create() : NULL;
+
+    for (size_t id = 0; ds->params && id < count; id++)
+    {
+        if (param_intern(ds->params, names + name_offs[id], name_offs[id + 1] - name_offs[id]) != (int32_t)id)
+        {
+            ok = false;
+            break;
+        }
+        ds->params->counts[id] = counts[id];
+    }
+
+    ds->param_starts = ds->params ? (size_t *)cache_take(file, &pos, (count + 1) * sizeof(*ds->param_starts)) : NULL;
+    ds->param_rows = ds->param_starts ? (uint32_t *)cache_take(file, &pos, rows * sizeof(*ds->param_rows)) : NULL;
+
+    // The row lists index straight into the columns
+    ok = ok && ds->param_rows != NULL && cache_offsets_valid(ds->param_starts, count, rows)
+        && ds->param_starts[count] == rows;
+
+    for (size_t i = 0; ok && i < rows; i++)
+    {
+        ok = ds->param_rows[i] < rows;
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "Ignoring damaged cache for %s\n", filename);
+        dataset_free(ds);
+        return NULL;
+    }
+
+    return ds;
+}
+
+int cache_write(const char *filename, const Dataset *ds)
+{
+    if (sizeof(size_t) != sizeof(uint64_t)) return -1;
+
+    struct stat st;
+    if (stat(filename, &st) != 0) return -1;
+
+    char *path = cache_path(filename);
+    if (path == NULL) return -1;
+
+    // Written aside and renamed, a reader never sees half a sidecar
+    size_t len = strlen(path);
+    char *tmp_path = malloc(len + 5);
+    if (tmp_path == NULL)
+    {
+        free(path);
+        return -1;
+    }
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        free(path);
+        free(tmp_path);
+        return -1;
+    }
+
+    const AQSColumns *cols = ds->cols;
+    const ParamTable *params = ds->params;
+
+    CacheHeader header = {
+        .magic = {'A', 'Q', 'S', 'C'},
+        .version = CACHE_VERSION,
+        .source_size = st.st_size,
+        .source_mtime = st.st_mtime,
+        .rows = cols->len,
+        .param_count = params->len,
+    };
+
+    int status = cache_put(fp, &header, sizeof(header));
+
+    // Columns exactly as they sit in memory
+    for (int f = 0; f < MAX_FIELDS && status == 0; f++)
+    {
+        const Column *col = &cols->cols[f];
+
+        switch (col->type)
+        {
+            case COL_INT:
+                status = cache_put(fp, col->i32, cols->len * sizeof(*col->i32));
+                if (status == 0) status = cache_put(fp, col->valid, (cols->len + 7) / 8);
+                break;
+            case COL_DBL:
+                status = cache_put(fp, col->f64, cols->len * sizeof(*col->f64));
+                if (status == 0) status = cache_put(fp, col->valid, (cols->len + 7) / 8);
+                break;
+            case COL_TIME:
+                status = cache_put(fp, col->i64, cols->len * sizeof(*col->i64));
+                if (status == 0) status = cache_put(fp, col->valid, (cols->len + 7) / 8);
+                break;
+            case COL_STR:
+            {
+                uint64_t blob_len = col->blob_len;
+                status = cache_put(fp, &blob_len, sizeof(blob_len));
+                if (status == 0) status = cache_put(fp, col->offsets, (cols->len + 1) * sizeof(*col->offsets));
+                if (status == 0) status = cache_put(fp, col->blob, col->blob_len);
+                break;
+            }
+            case COL_DICT:
+            {
+                uint64_t sizes[2] = {col->dict_len, col->blob_len};
+                status = cache_put(fp, sizes, sizeof(sizes));
+                // An empty column never allocated its pool
+                static const size_t no_offsets[1] = {0};
+                const size_t *offsets = col->offsets ? col->offsets : no_offsets;
+                if (status == 0) status = cache_put(fp, offsets, (col->dict_len + 1) * sizeof(*offsets));
+                if (status == 0) status = cache_put(fp, col->blob, col->blob_len);
+                if (status == 0) status = cache_put(fp, col->codes, cols->len * sizeof(*col->codes));
+                break;
+            }
+        }
+    }
+
+    // Parameter dictionary: counts, name offsets, names
+    uint64_t name_off = 0;
+    for (size_t id = 0; id < params->len && status == 0; id++)
+    {
+        uint64_t count = params->counts[id];
+        status = cache_put(fp, &count, sizeof(count));
+    }
+    for (size_t id = 0; id <= params->len && status == 0; id++)
+    {
+        status = cache_put(fp, &name_off, sizeof(name_off));
+        if (id < params->len) name_off += strlen(params->names[id]);
+    }
+    for (size_t id = 0; id < params->len && status == 0; id++)
+    {
+        size_t n = strlen(params->names[id]);
+        if (n > 0 && fwrite(params->names[id], 1, n, fp) != n) status = -1;
+    }
+    if (status == 0) status = cache_pad(fp, name_off);
+
+    // Per-parameter row index
+    if (status == 0) status = cache_put(fp, ds->param_starts, (params->len + 1) * sizeof(*ds->param_starts));
+    if (status == 0) status = cache_put(fp, ds->param_rows, cols->len * sizeof(*ds->param_rows));
+
+    if (fclose(fp) != 0) status = -1;
+
+    if (status == 0 && rename(tmp_path, path) != 0) status = -1;
+    if (status != 0) remove(tmp_path);
+
+    free(path);
+    free(tmp_path);
+    return status;
+}
+
+// Exact powers of ten, the fast path below never leaves this range
+static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+NumStatus parse_double(const char *p, size_t len, double *out)
+{
+    const char *end = p + len;
+
+    *out = NAN;
+
+    while (p < end && *p == ' ') p++;
+    while (end > p && end[-1] == ' ') end--;
+
+    if (p == end) return NUM_MISSING;
+
+    const char *start = p;
+    bool neg = false;
+    if (*p == '-' || *p == '+') neg = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0;       // significant digits held in mantissa
+    int exponent = 0;
+    bool any = false;
+    bool truncated = false;
+
+    for (; p < end && (unsigned)(*p - '0') < 10; p++)
+    {
+        any = true;
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) digits++;
+        } else 
+        {
+            truncated = true;
+            exponent++;
+        }
+    }
+
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && (unsigned)(*p - '0') < 10; p++)
+        {
+            any = true;
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digits++;
+                exponent--;
+            } else 
+            {
+                truncated = true;
+            }
+        }
+    }
+
+    if (!any) return NUM_INVALID;
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        bool exp_neg = false;
+        int value = 0;
+
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) exp_neg = *p++ == '-';
+        if (p == end || (unsigned)(*p - '0') >= 10) return NUM_INVALID;
+
+        for (; p < end && (unsigned)(*p - '0') < 10; p++)
+        {
+            if (value < 100000) value = value * 10 + (*p - '0');
+        }
+
+        exponent += exp_neg ? -value : value;
+    }
+
+    if (p != end) return NUM_INVALID;
+
+    // Clinger's fast path: both operands exact, so one IEEE operation rounds correctly
+    if (!truncated && mantissa <= ((uint64_t)1 << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double value = (double)mantissa;
+        value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+        *out = neg ? -value : value;
+        return NUM_OK;
+    }
+
+    // Long or extreme inputs, rare in AQS files. setlocale is never called, so "C" rules apply
+    char buf[128];
+    size_t n = end - start;
+    if (n >= sizeof(buf)) return NUM_INVALID;
+
+    memcpy(buf, start, n);
+    buf[n] = '\0';
+    *out = strtod(buf, NULL);
+    return NUM_OK;
+}
+
+NumStatus parse_int(const char *p, size_t len, int32_t *out)
+{
+    const char *end = p + len;
+
+    *out = 0;
+
+    while (p < end && *p == ' ') p++;
+    while (end > p && end[-1] == ' ') end--;
+
+    if (p == end) return NUM_MISSING;
+
+    bool neg = false;
+    if (*p == '-' || *p == '+') neg = *p++ == '-';
+
+    if (p == end || (unsigned)(*p - '0') >= 10) return NUM_INVALID;
+
+    int64_t value = 0;
+    for (; p < end && (unsigned)(*p - '0') < 10; p++)
+    {
+        value = value * 10 + (*p - '0');
+        if (value > INT32_MAX) return NUM_INVALID;
+    }
+
+    // "75.0" style counts truncate like atoi did
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && (unsigned)(*p - '0') < 10; p++);
+    }
+
+    if (p != end) return NUM_INVALID;
+
+    *out = (int32_t)(neg ? -value : value);
+    return NUM_OK;
+}
+
+// Days from 1970-01-01 to a proleptic Gregorian date, month 1 .. 12
+static int64_t days_from_civil(int64_t y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// Inverse of days_from_civil
+static void civil_from_days(int64_t z, int64_t *y, int *m, int *d)
+{
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = yoe + era * 400 + (*m <= 2);
+}
+
+// n decimal digits at p, false on anything else
+static inline bool read_digits(const char *p, int n, int *out)
+{
+    int value = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if ((unsigned)(p[i] - '0') >= 10) return false;
+        value = value * 10 + (p[i] - '0');
+    }
+
+    *out = value;
+    return true;
+}
+
+NumStatus parse_datetime(const char *p, size_t len, int64_t *start, int64_t *end)
+{
+    static const uint8_t MONTH_DAYS[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    const char *stop = p + len;
+
+    *start = 0;
+
+    while (p < stop && *p == ' ') p++;
+    while (stop > p && stop[-1] == ' ') stop--;
+
+    len = stop - p;
+    if (len == 0) return NUM_MISSING;
+
+    // Every part sits at a fixed offset, the length says which are present
+    int year, month = 1, day = 1, hour = 0, minute = 0, second = 0;
+    bool ok = (len == 4 || len == 7 || len == 10 || len == 13 || len == 16 || len == 19)
+        && read_digits(p, 4, &year)
+        && (len < 7 || (p[4] == '-' && read_digits(p + 5, 2, &month)))
+        && (len < 10 || (p[7] == '-' && read_digits(p + 8, 2, &day)))
+        && (len < 13 || ((p[10] == ' ' || p[10] == 'T') && read_digits(p + 11, 2, &hour)))
+        && (len < 16 || (p[13] == ':' && read_digits(p + 14, 2, &minute)))
+        && (len < 19 || (p[16] == ':' && read_digits(p + 17, 2, &second)));
+
+    if (!ok || month < 1 || month > 12 || hour > 23 || minute > 59 || second > 59) return NUM_INVALID;
+
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    if (day < 1 || day > MONTH_DAYS[month - 1] + (month == 2 && leap)) return NUM_INVALID;
+
+    int64_t days = days_from_civil(year, month, day);
+    *start = days * 86400 + hour * 3600 + minute * 60 + second;
+
+    if (end)
+    {
+        switch (len)
+        {
+            case 4: *end = days_from_civil(year + 1, 1, 1) * 86400; break;
+            case 7: *end = (month == 12 ? days_from_civil(year + 1, 1, 1) : days_from_civil(year, month + 1, 1)) * 86400; break;
+            case 10: *end = *start + 86400; break;
+            case 13: *end = *start + 3600; break;
+            case 16: *end = *start + 60; break;
+            default: *end = *start + 1; break;
+        }
+    }
+
+    return NUM_OK;
+}
+
+size_t format_time(int64_t t, char *out)
+{
+    int64_t days = t >= 0 ? t / 86400 : -((-t + 86399) / 86400);
+    int64_t secs = t - days * 86400;
+    int64_t year;
+    int month, day;
+
+    civil_from_days(days, &year, &month, &day);
+
+    int hour = (int)(secs / 3600);
+    int minute = (int)(secs / 60 % 60);
+    int second = (int)(secs % 60);
+
+    // Years outside 0 .. 9999 never come from parse_datetime
+    if (year < 0 || year > 9999) year = 0;
+
+    int n = second
+        ? snprintf(out, 20, "%04d-%02d-%02d %02d:%02d:%02d", (int)year, month, day, hour, minute, second)
+        : snprintf(out, 20, "%04d-%02d-%02d %02d:%02d", (int)year, month, day, hour, minute);
+    return n > 0 ? (size_t)n : 0;
+}
+
+// Short names analysts use for the site key columns
+static const struct { const char *alias; int field; } FIELD_ALIASES[] = {
+    {"state", 0},
+    {"county", 1},
+    {"site", 2},
+    {"parameter", 8},
+    {"method", 12},
+};
+
+int field_index(const char *name, size_t len)
+{
+    for (size_t i = 0; i < sizeof(FIELD_ALIASES) / sizeof(FIELD_ALIASES[0]); i++)
+    {
+        if (strlen(FIELD_ALIASES[i].alias) == len && !strncmp(FIELD_ALIASES[i].alias, name, len)) return FIELD_ALIASES[i].field;
+    }
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        if (strlen(AQS_FIELDS[f].name) == len && !strncmp(AQS_FIELDS[f].name, name, len)) return f;
+    }
+
+    return -1;
+}
+
+static const char *const AGG_NAMES[] = {"count", "sum", "mean", "min", "max"};
+
+int parse_group_spec(const char *group, const char *agg, GroupSpec *spec)
+{
+    memset(spec, 0, sizeof(*spec));
+
+    for (const char *p = group; *p; )
+    {
+        size_t len = strcspn(p, ",");
+        int f = field_index(p, len);
+
+        if (f < 0 || spec->key_count == MAX_GROUP_KEYS)
+        {
+            fprintf(stderr, "Bad group key: %.*s\n", (int)len, p);
+            return -1;
+        }
+
+        spec->keys[spec->key_count++] = f;
+        p += len + (p[len] == ',');
+    }
+
+    // Without --agg every group just reports its row count
+    for (const char *p = agg ? agg : "count"; *p; )
+    {
+        size_t len = strcspn(p, ",");
+        size_t op_len = strcspn(p, ":,");
+        AggSpec *a = &spec->aggs[spec->agg_count];
+        int op = -1;
+
+        for (int i = 0; i < (int)(sizeof(AGG_NAMES) / sizeof(AGG_NAMES[0])); i++)
+        {
+            if (strlen(AGG_NAMES[i]) == op_len && !strncmp(AGG_NAMES[i], p, op_len)) op = i;
+        }
+
+        // p50, p99.9, ... are quantiles of the pooled distribution, they take no column
+        char *end;
+        double percent = op < 0 && op_len > 1 && p[0] == 'p' && isdigit((unsigned char)p[1]) ? strtod(p + 1, &end) : 0;
+        if (percent > 0 && percent <= 100 && end == p + op_len && op_len == len)
+        {
+            op = AGG_QUANTILE;
+            a->q = percent / 100;
+            spec->quantiles = true;
+        }
+
+        a->op = (AggOp)op;
+        a->field = op_len < len ? field_index(p + op_len + 1, len - op_len - 1) : -1;
+
+        // Everything but count needs a numeric column, datetimes only have a min and max
+        ColumnType type = a->field >= 0 ? AQS_FIELDS[a->field].type : COL_STR;
+        bool numeric = !column_text(type) && (type != COL_TIME || op == AGG_COUNT || op == AGG_MIN || op == AGG_MAX);
+        if (op < 0 || spec->agg_count == MAX_AGGS || (op_len < len && !numeric) || (op != AGG_COUNT && op != AGG_QUANTILE && a->field < 0))
+        {
+            fprintf(stderr, "Bad aggregate: %.*s\n", (int)len, p);
+            return -1;
+        }
+
+        spec->agg_count++;
+        p += len + (p[len] == ',');
+    }
+
+    return spec->key_count > 0 ? 0 : -1;
+}
+
+// Numeric cell as a double, false when the row had no value
+// Datetimes are whole seconds, exact in a double
+static inline bool column_number(const Column *col, size_t row, double *out)
+{
+    if (!column_valid(col, row)) return false;
+    if (col->type == COL_INT) *out = col->i32[row];
+    else if (col->type == COL_DBL) *out = col->f64[row];
+    else *out = (double)col->i64[row];
+    return true;
+}
+
+// Numeric cell as CSV, datetimes in their original text form
+static void print_number(FILE *out, ColumnType type, double value, const char *format)
+{
+    if (type == COL_TIME)
+    {
+        char text[20];
+        fwrite(text, 1, format_time((int64_t)value, text), out);
+    } else 
+    {
+        fprintf(out, format, value);
+    }
+}
+
+// FNV-1a over the key cells of row
+static uint64_t group_hash(const GroupTable *table, uint32_t row)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (int k = 0; k < table->spec->key_count; k++)
+    {
+        const Column *col = &table->cols->cols[table->spec->keys[k]];
+        const unsigned char *bytes;
+        size_t len;
+        double value = 0;
+
+        if (col->type == COL_DICT)
+        {
+            // Codes stand for their strings, no need to touch the pool
+            bytes = (const unsigned char *)&col->codes[row];
+            len = sizeof(col->codes[row]);
+        } else if (col->type == COL_STR)
+        {
+            bytes = (const unsigned char *)column_str(col, row, &len);
+        } else 
+        {
+            // Missing cells hash like 0 and are told apart in group_equal
+            column_number(col, row, &value);
+            bytes = (const unsigned char *)&value;
+            len = sizeof(value);
+        }
+
+        for (size_t i = 0; i < len; i++)
+        {
+            h ^= bytes[i];
+            h *= 1099511628211ULL;
+        }
+
+        // Field separator so ("1", "23") and ("12", "3") differ
+        h ^= 0xff;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// Whether two rows share every key cell, dictionary keys compare codes
+static bool group_equal(const GroupTable *table, uint32_t a, uint32_t b)
+{
+    for (int k = 0; k < table->spec->key_count; k++)
+    {
+        const Column *col = &table->cols->cols[table->spec->keys[k]];
+
+        if (col->type == COL_DICT)
+        {
+            if (col->codes[a] != col->codes[b]) return false;
+        } else if (col->type == COL_STR)
+        {
+            size_t la, lb;
+            const char *sa = column_str(col, a, &la);
+            const char *sb = column_str(col, b, &lb);
+            if (la != lb || memcmp(sa, sb, la) != 0) return false;
+        } else 
+        {
+            double va, vb;
+            bool ha = column_number(col, a, &va);
+            bool hb = column_number(col, b, &vb);
+            if (ha != hb || (ha && va != vb)) return false;
+        }
+    }
+
+    return true;
+}
+
+// Order two rows by their key cells, missing numbers first
+static int group_compare(const GroupTable *table, uint32_t a, uint32_t b)
+{
+    for (int k = 0; k < table->spec->key_count; k++)
+    {
+        const Column *col = &table->cols->cols[table->spec->keys[k]];
+
+        if (column_text(col->type))
+        {
+            size_t la, lb;
+            const char *sa = column_str(col, a, &la);
+            const char *sb = column_str(col, b, &lb);
+            int c = memcmp(sa, sb, la < lb ? la : lb);
+
+            if (c != 0) return c;
+            if (la != lb) return la < lb ? -1 : 1;
+        } else 
+        {
+            double va, vb;
+            bool ha = column_number(col, a, &va);
+            bool hb = column_number(col, b, &vb);
+
+            if (ha != hb) return ha ? 1 : -1;
+            if (ha && va != vb) return va < vb ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+static GroupTable *group_table_create(const AQSColumns *cols, const GroupSpec *spec)
+{
+    GroupTable *table = calloc(1, sizeof(*table));
+    if (table == NULL) return NULL;
+
+    table->cols = cols;
+    table->spec = spec;
+    table->slot_count = 256;
+    table->slots = calloc(table->slot_count, sizeof(*table->slots));
+
+    if (table->slots == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+void group_table_free(GroupTable *table)
+{
+    if (table == NULL) return;
+
+    free(table->reps);
+    free(table->hashes);
+    free(table->rows);
+    free(table->states);
+    free(table->slots);
+
+    for (size_t g = 0; table->digests && g < table->len; g++)
+    {
+        tdigest_free(&table->digests[g]);
+    }
+    free(table->digests);
+
+    free(table);
+}
+
+// Slot holding the group of row, or the empty slot where it belongs
+static size_t group_slot(const GroupTable *table, uint64_t h, uint32_t row)
+{
+    size_t mask = table->slot_count - 1;
+    size_t slot = h & mask;
+
+    while (table->slots[slot] != 0)
+    {
+        uint32_t g = table->slots[slot] - 1;
+        if (table->hashes[g] == h && group_equal(table, table->reps[g], row)) break;
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+// Group of row, created empty on first sight, -1 if the table could not grow
+static long group_find(GroupTable *table, uint32_t row, uint64_t h)
+{
+    size_t slot = group_slot(table, h, row);
+    if (table->slots[slot] != 0) return table->slots[slot] - 1;
+
+    // Same growth policy as the parameter table
+    if ((table->len + 1) * 2 > table->slot_count)
+    {
+        size_t slot_count = table->slot_count * 2;
+        uint32_t *slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL) return -1;
+
+        for (size_t g = 0; g < table->len; g++)
+        {
+            size_t s = table->hashes[g] & (slot_count - 1);
+            while (slots[s] != 0) s = (s + 1) & (slot_count - 1);
+            slots[s] = g + 1;
+        }
+
+        free(table->slots);
+        table->slots = slots;
+        table->slot_count = slot_count;
+        slot = group_slot(table, h, row);
+    }
+
+    int aggs = table->spec->agg_count;
+
+    if (table->len == table->cap)
+    {
+        size_t cap = table->cap ? table->cap * 2 : 64;
+
+        uint32_t *reps = realloc(table->reps, cap * sizeof(*reps));
+        if (reps == NULL) return -1;
+        table->reps = reps;
+
+        uint64_t *hashes = realloc(table->hashes, cap * sizeof(*hashes));
+        if (hashes == NULL) return -1;
+        table->hashes = hashes;
+
+        size_t *rows = realloc(table->rows, cap * sizeof(*rows));
+        if (rows == NULL) return -1;
+        table->rows = rows;
+
+        AggState *states = realloc(table->states, cap * (aggs ? aggs : 1) * sizeof(*states));
+        if (states == NULL) return -1;
+        table->states = states;
+
+        if (table->spec->quantiles)
+        {
+            TDigest *digests = realloc(table->digests, cap * sizeof(*digests));
+            if (digests == NULL) return -1;
+            table->digests = digests;
+        }
+
+        table->cap = cap;
+        stats_count(reallocs, 1);
+    }
+
+    size_t g = table->len++;
+    table->reps[g] = row;
+    table->hashes[g] = h;
+    table->rows[g] = 0;
+    table->slots[slot] = g + 1;
+    if (table->digests) memset(&table->digests[g], 0, sizeof(table->digests[g]));
+
+    for (int a = 0; a < aggs; a++)
+    {
+        table->states[g * aggs + a] = (AggState){0, INFINITY, -INFINITY, 0};
+    }
+
+    return g;
+}
+
+// Fold partial state src into dst
+static inline void agg_merge(AggState *dst, const AggState *src)
+{
+    dst->sum += src->sum;
+    dst->n += src->n;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// Per-thread partial aggregation over a slice of the selected rows
+typedef struct {
+    const uint32_t *rows;
+    size_t n;
+    GroupTable *table;
+    int status;
+} GroupTask;
+
+static void *group_task(void *arg)
+{
+    GroupTask *task = arg;
+    GroupTable *table = task->table;
+    const GroupSpec *spec = table->spec;
+
+    for (size_t i = 0; i < task->n; i++)
+    {
+        uint32_t row = task->rows[i];
+        long g = group_find(table, row, group_hash(table, row));
+
+        if (g < 0)
+        {
+            task->status = -1;
+            return NULL;
+        }
+
+        table->rows[g]++;
+        if (spec->quantiles) tdigest_add_row(&table->digests[g], table->cols, row);
+
+        AggState *state = &table->states[g * spec->agg_count];
+        for (int a = 0; a < spec->agg_count; a++)
+        {
+            double value;
+            if (spec->aggs[a].field < 0 || !column_number(&table->cols->cols[spec->aggs[a].field], row, &value)) continue;
+
+            state[a].sum += value;
+            state[a].n++;
+            if (value < state[a].min) state[a].min = value;
+            if (value > state[a].max) state[a].max = value;
+        }
+    }
+
+    return NULL;
+}
+
+GroupTable *group_rows(const AQSColumns *cols, const uint32_t *rows, size_t n, const GroupSpec *spec, int threads)
+{
+    // Small selections are not worth a thread each
+    size_t per_thread = 1 << 14;
+    if (threads < 1) threads = 1;
+    if ((size_t)threads > n / per_thread + 1) threads = n / per_thread + 1;
+
+    GroupTask *tasks = calloc(threads, sizeof(*tasks));
+    if (tasks == NULL) return NULL;
+
+    int status = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        size_t begin = n * t / threads;
+        size_t end = n * (t + 1) / threads;
+
+        tasks[t].rows = rows + begin;
+        tasks[t].n = end - begin;
+        tasks[t].table = group_table_create(cols, spec);
+        if (tasks[t].table == NULL) status = -1;
+    }
+
+    if (status == 0) run_parallel(threads, group_task, tasks, sizeof(*tasks));
+
+    // Fold every partial table into the first, slices are in row order so reps stay first-seen
+    GroupTable *result = tasks[0].table;
+    int aggs = spec->agg_count;
+
+    for (int t = 0; t < threads; t++)
+    {
+        GroupTable *part = tasks[t].table;
+        if (tasks[t].status != 0) status = -1;
+        if (t == 0 || part == NULL) continue;
+
+        for (size_t pg = 0; pg < part->len && status == 0; pg++)
+        {
+            long g = group_find(result, part->reps[pg], part->hashes[pg]);
+            if (g < 0)
+            {
+                status = -1;
+                break;
+            }
+
+            result->rows[g] += part->rows[pg];
+            if (spec->quantiles) tdigest_merge(&result->digests[g], &part->digests[pg]);
+
+            for (int a = 0; a < aggs; a++)
+            {
+                agg_merge(&result->states[g * aggs + a], &part->states[pg * aggs + a]);
+            }
+        }
+
+        group_table_free(part);
+    }
+
+    free(tasks);
+
+    if (status != 0)
+    {
+        fprintf(stderr, "Failed to aggregate groups\n");
+        group_table_free(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+// qsort has no context argument, each entry carries its table so server workers can sort at once
+typedef struct {
+    const GroupTable *table;
+    uint32_t group;
+} GroupOrder;
+
+static int comp_group(const void *a, const void *b)
+{
+    const GroupOrder *ga = a;
+    const GroupOrder *gb = b;
+    return group_compare(ga->table, ga->table->reps[ga->group], ga->table->reps[gb->group]);
+}
+
+// One CSV cell, quoted when it holds a separator or a quote
+static void print_cell(FILE *out, const char *s, size_t len)
+{
+    if (memchr(s, ',', len) == NULL && memchr(s, '"', len) == NULL && memchr(s, '\n', len) == NULL)
+    {
+        fwrite(s, 1, len, out);
+        return;
+    }
+
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++)
+    {
+        if (s[i] == '"') fputc('"', out);
+        fputc(s[i], out);
+    }
+    fputc('"', out);
+}
+
+void group_print(const GroupTable *table, FILE *out)
+{
+    const GroupSpec *spec = table->spec;
+    GroupOrder *order = malloc((table->len ? table->len : 1) * sizeof(*order));
+    if (order == NULL) return;
+
+    for (size_t g = 0; g < table->len; g++)
+    {
+        order[g].table = table;
+        order[g].group = g;
+    }
+
+    qsort(order, table->len, sizeof(*order), comp_group);
+
+    for (int k = 0; k < spec->key_count; k++)
+    {
+        fprintf(out, "%s,", AQS_FIELDS[spec->keys[k]].name);
+    }
+
+    fprintf(out, "rows");
+    for (int a = 0; a < spec->agg_count; a++)
+    {
+        if (spec->aggs[a].op == AGG_QUANTILE) fprintf(out, ",p%g", spec->aggs[a].q * 100);
+        else if (spec->aggs[a].field < 0) fprintf(out, ",count");
+        else fprintf(out, ",%s_%s", AGG_NAMES[spec->aggs[a].op], AQS_FIELDS[spec->aggs[a].field].name);
+    }
+    fputc('\n', out);
+
+    for (size_t i = 0; i < table->len; i++)
+    {
+        size_t g = order[i].group;
+        uint32_t rep = table->reps[g];
+
+        for (int k = 0; k < spec->key_count; k++)
+        {
+            const Column *col = &table->cols->cols[spec->keys[k]];
+            size_t len;
+            double value;
+
+            if (column_text(col->type))
+            {
+                const char *s = column_str(col, rep, &len);
+                print_cell(out, s, len);
+            } else if (column_number(col, rep, &value)) print_number(out, col->type, value, "%.10g");
+            fputc(',', out);
+        }
+
+        fprintf(out, "%zu", table->rows[g]);
+
+        // Groups with no values for a column leave its cell empty
+        for (int a = 0; a < spec->agg_count; a++)
+        {
+            const AggState *state = &table->states[g * spec->agg_count + a];
+            fputc(',', out);
+
+            switch (spec->aggs[a].op)
+            {
+                case AGG_COUNT:
+                    fprintf(out, "%zu", spec->aggs[a].field < 0 ? table->rows[g] : state->n);
+                    break;
+                case AGG_SUM:
+                    if (state->n) fprintf(out, "%.10g", state->sum);
+                    break;
+                case AGG_MEAN:
+                    if (state->n) fprintf(out, "%.10g", state->sum / state->n);
+                    break;
+                case AGG_MIN:
+                    if (state->n) print_number(out, AQS_FIELDS[spec->aggs[a].field].type, state->min, "%.10g");
+                    break;
+                case AGG_MAX:
+                    if (state->n) print_number(out, AQS_FIELDS[spec->aggs[a].field].type, state->max, "%.10g");
+                    break;
+                case AGG_QUANTILE:
+                {
+                    // Reading compresses the digest, the pooled distribution itself is unchanged
+                    double value = tdigest_quantile(&table->digests[g], spec->aggs[a].q);
+                    if (!isnan(value)) fprintf(out, "%.6g", value);
+                    break;
+                }
+            }
+        }
+
+        fputc('\n', out);
+    }
+
+    free(order);
+}
+
+static const char *const CMP_NAMES[] = {"=", "!=", "<", "<=", ">", ">="};
+
+Filter *filter_compile(const char *expr)
+{
+    Filter *filter = calloc(1, sizeof(*filter));
+    if (filter == NULL)
+    {
+        perror("Failed to allocate filter");
+        return NULL;
+    }
+
+    filter->max_field = -1;
+
+    for (const char *p = expr; *p; )
+    {
+        const char *and = strstr(p, "&&");
+        size_t len = and ? (size_t)(and - p) : strlen(p);
+        const char *end = p + len;
+        Predicate *pred = &filter->preds[filter->count];
+
+        while (p < end && isspace((unsigned char)*p)) p++;
+
+        // Field name, then the longest operator that matches
+        const char *name = p;
+        while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+        int field = field_index(name, p - name);
+        while (p < end && isspace((unsigned char)*p)) p++;
+
+        int op = -1;
+        size_t op_len = 0;
+        for (int i = 0; i < (int)(sizeof(CMP_NAMES) / sizeof(CMP_NAMES[0])); i++)
+        {
+            size_t n = strlen(CMP_NAMES[i]);
+            if (n > op_len && (size_t)(end - p) >= n && !strncmp(p, CMP_NAMES[i], n))
+            {
+                op = i;
+                op_len = n;
+            }
+        }
+
+        // "==" reads as "="
+        if (op == CMP_EQ && p + 1 < end && p[1] == '=') op_len = 2;
+        p += op_len;
+
+        // Value, optionally quoted
+        while (p < end && isspace((unsigned char)*p)) p++;
+        const char *value_end = end;
+        while (value_end > p && isspace((unsigned char)value_end[-1])) value_end--;
+        if (value_end - p >= 2 && (*p == '"' || *p == '\'') && value_end[-1] == *p)
+        {
+            p++;
+            value_end--;
+        }
+
+        bool ok = field >= 0 && op >= 0 && filter->count < MAX_PREDICATES && (size_t)(value_end - p) < MAX_LENGTH;
+
+        if (ok)
+        {
+            pred->field = field;
+            pred->op = (CmpOp)op;
+            pred->numeric = !column_text(AQS_FIELDS[field].type);
+            pred->text_len = normalize_name(p, value_end - p, pred->text);
+
+            if (AQS_FIELDS[field].type == COL_TIME)
+            {
+                int64_t start, next;
+                ok = parse_datetime(p, value_end - p, &start, &next) == NUM_OK;
+                pred->number = start;
+                pred->upper = next - 1;
+            } else if (pred->numeric)
+            {
+                ok = parse_double(p, value_end - p, &pred->number) == NUM_OK;
+                pred->upper = pred->number;
+            }
+        }
+
+        if (!ok)
+        {
+            fprintf(stderr, "Bad filter term: %.*s\n", (int)len, end - len);
+            free(filter);
+            return NULL;
+        }
+
+        filter->order[filter->count] = filter->count;
+        if (field > filter->max_field) filter->max_field = field;
+        filter->count++;
+
+        p = and ? and + 2 : end;
+    }
+
+    if (filter->count == 0)
+    {
+        fprintf(stderr, "Empty filter\n");
+        free(filter);
+        return NULL;
+    }
+
+    return filter;
+}
+
+// Case-insensitive three-way compare of a raw field against lowercased text
+static int compare_text(const char *field, size_t len, const char *text, size_t text_len)
+{
+    size_t n = len < text_len ? len : text_len;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        int c = tolower((unsigned char)field[i]) - (unsigned char)text[i];
+        if (c != 0) return c;
+    }
+
+    return len < text_len ? -1 : len > text_len;
+}
+
+// Whether a three-way compare result satisfies op
+static bool cmp_holds(CmpOp op, int c)
+{
+    switch (op)
+    {
+        case CMP_EQ: return c == 0;
+        case CMP_NE: return c != 0;
+        case CMP_LT: return c < 0;
+        case CMP_LE: return c <= 0;
+        case CMP_GT: return c > 0;
+        case CMP_GE: return c >= 0;
+    }
+
+    return false;
+}
+
+static bool predicate_test(const Predicate *pred, const char *data, const AQSRowView *row)
+{
+    FieldView view = row_field(data, row, pred->field);
+    int c;
+
+    if (pred->numeric)
+    {
+        // An empty or unparsable number fails every comparison
+        double value;
+        if (AQS_FIELDS[pred->field].type == COL_TIME)
+        {
+            int64_t t;
+            if (parse_datetime(data + view.offset, view.length, &t, NULL) != NUM_OK) return false;
+            value = (double)t;
+        } else if (parse_double(data + view.offset, view.length, &value) != NUM_OK)
+        {
+            return false;
+        }
+        c = value < pred->number ? -1 : value > pred->upper;
+    } else 
+    {
+        c = compare_text(data + view.offset, view.length, pred->text, pred->text_len);
+    }
+
+    return cmp_holds(pred->op, c);
+}
+
+// Highest rejection rate first, counts are halved so the order keeps adapting
+static void filter_reorder(Filter *filter)
+{
+    for (int i = 1; i < filter->count; i++)
+    {
+        int id = filter->order[i];
+        const Predicate *p = &filter->preds[id];
+        int j = i;
+
+        // (rejected + 1) / (tested + 2), so untried predicates sit in the middle
+        while (j > 0)
+        {
+            const Predicate *q = &filter->preds[filter->order[j - 1]];
+            if ((p->rejected + 1) * (q->tested + 2) <= (q->rejected + 1) * (p->tested + 2)) break;
+            filter->order[j] = filter->order[j - 1];
+            j--;
+        }
+
+        filter->order[j] = id;
+    }
+
+    for (int i = 0; i < filter->count; i++)
+    {
+        filter->preds[i].tested /= 2;
+        filter->preds[i].rejected /= 2;
+    }
+
+    filter->rows = 0;
+}
+
+bool filter_row(Filter *filter, const char *data, const AQSRowView *row)
+{
+    bool pass = true;
+
+    for (int i = 0; i < filter->count && pass; i++)
+    {
+        Predicate *pred = &filter->preds[filter->order[i]];
+
+        pred->tested++;
+        if (!predicate_test(pred, data, row))
+        {
+            pred->rejected++;
+            pass = false;
+        }
+    }
+
+    if (++filter->rows == FILTER_REORDER_ROWS) filter_reorder(filter);
+
+    return pass;
+}
+
+bool filter_record(Filter *filter, const char *data, size_t start, size_t size, size_t *next)
+{
+    AQSRowView row;
+    int fields;
+    size_t end = scan_record(data, start, size, filter->max_field + 1, &row, &fields);
+
+    *next = end < size ? end + 1 : size;
+
+    // Blank and oversized lines are dropped by every loader anyway
+    return fields > 0 && filter_row(filter, data, &row);
+}
+
+int64_t filter_columns(const Filter *filter, const AQSColumns *cols, uint32_t *rows, size_t n)
+{
+    // Each predicate narrows the surviving rows in place, so later ones see fewer
+    for (int p = 0; p < filter->count && n > 0; p++)
+    {
+        const Predicate *pred = &filter->preds[filter->order[p]];
+        const Column *col = &cols->cols[pred->field];
+        size_t kept = 0;
+
+        if (col->type == COL_DICT)
+        {
+            // One string compare per distinct value, rows compare codes through the table
+            uint8_t *pass = malloc(col->dict_len ? col->dict_len : 1);
+            if (pass == NULL) return -1;
+
+            for (size_t k = 0; k < col->dict_len; k++)
+            {
+                size_t start = col->offsets[k];
+                pass[k] = cmp_holds(pred->op, compare_text(col->blob + start, col->offsets[k + 1] - start, pred->text, pred->text_len));
+            }
+
+            for (size_t i = 0; i < n; i++)
+            {
+                if (pass[col->codes[rows[i]]]) rows[kept++] = rows[i];
+            }
+
+            free(pass);
+        } else if (col->type == COL_STR)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                size_t len;
+                const char *s = column_str(col, rows[i], &len);
+                if (cmp_holds(pred->op, compare_text(s, len, pred->text, pred->text_len))) rows[kept++] = rows[i];
+            }
+        } else 
+        {
+            // Missing numbers fail every comparison
+            for (size_t i = 0; i < n; i++)
+            {
+                uint32_t r = rows[i];
+                if (!column_valid(col, r)) continue;
+
+                double value = col->type == COL_INT ? col->i32[r] : col->type == COL_DBL ? col->f64[r] : (double)col->i64[r];
+                int c = value < pred->number ? -1 : value > pred->upper;
+                if (cmp_holds(pred->op, c)) rows[kept++] = r;
+            }
+        }
+
+        n = kept;
+    }
+
+    return (int64_t)n;
+}
+
+// * Compressed input * //
+
+// zlib inflates, a decoder thread keeps a bounded ring of chunks ahead of the reader
+#define INFLATE_CHUNK (1 << 20)
+#define INFLATE_SLOTS 4
+
+#ifdef _WIN32
+    #define file_seek _fseeki64
+    #define file_tell _ftelli64
+#else
+    #define file_seek fseeko
+    #define file_tell ftello
+#endif
+
+// Decoder state plus a bounded ring of inflated chunks
+// The decoder thread fills slots at head, the reader drains them from tail
+struct Inflater {
+    FILE *fp;
+    InputFormat format;
+    z_stream zs;
+    bool zs_live;        // zs holds an initialised inflater
+    unsigned char in[1 << 16];
+    uint64_t file_pos;   // bytes read from fp, the input sits at file_pos - zs.avail_in
+    unsigned char scratch[1 << 16];  // zip names and extra fields
+    unsigned char *out;  // output not yet handed to the ring
+    size_t out_len;
+    uint32_t crc;        // of the output since the entry started
+    uint64_t total;
+    char *slots[INFLATE_SLOTS];
+    size_t slot_len[INFLATE_SLOTS];
+    int head;
+    int tail;
+    int count;
+    size_t read_pos;     // reader offset into the tail slot
+    int status;          // final decoder result, valid once done
+    bool done;
+    bool cancel;
+#ifdef _WIN32
+    // No threads, the whole input is inflated up front
+    char *whole;
+    size_t whole_len;
+    size_t whole_cap;
+#else
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+#endif
+};
+
+static InputFormat peek_format(FILE *fp)
+{
+    unsigned char magic[4] = {0};
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    rewind(fp);
+
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return INPUT_GZIP;
+    if (n == 4 && !memcmp(magic, "PK\3\4", 4)) return INPUT_ZIP;
+    return INPUT_PLAIN;
+}
+
+InputFormat input_format(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) return INPUT_PLAIN;
+
+    InputFormat format = peek_format(fp);
+    fclose(fp);
+    return format;
+}
+
+static uint64_t le_get(const unsigned char *p, int n)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < n; i++)
+    {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+// At least n unread input bytes when the file still has them, returns how many there are
+static size_t inf_peek(Inflater *z, size_t n)
+{
+    if (z->zs.avail_in < n)
+    {
+        memmove(z->in, z->zs.next_in, z->zs.avail_in);
+        size_t got = fread(z->in + z->zs.avail_in, 1, sizeof(z->in) - z->zs.avail_in, z->fp);
+        z->file_pos += got;
+        z->zs.next_in = z->in;
+        z->zs.avail_in += got;
+    }
+
+    return z->zs.avail_in;
+}
+
+// Next n raw input bytes into dst, or skipped when dst is NULL. -1 if the input ends first
+static int inf_take(Inflater *z, unsigned char *dst, uint64_t n)
+{
+    while (n > 0)
+    {
+        if (inf_peek(z, 1) == 0) return -1;
+
+        size_t part = z->zs.avail_in < n ? z->zs.avail_in : n;
+        if (dst)
+        {
+            memcpy(dst, z->zs.next_in, part);
+            dst += part;
+        }
+
+        z->zs.next_in += part;
+        z->zs.avail_in -= part;
+        n -= part;
+    }
+
+    return 0;
+}
+
+// Hand one chunk of output to the reader
+static int inflate_emit(Inflater *z, const unsigned char *p, size_t n)
+{
+#ifdef _WIN32
+    if (z->whole_len + n > z->whole_cap)
+    {
+        size_t cap = z->whole_cap ? z->whole_cap * 2 : INFLATE_CHUNK;
+        while (z->whole_len + n > cap) cap *= 2;
+
+        char *tmp = realloc(z->whole, cap);
+        if (tmp == NULL) return -1;
+        z->whole = tmp;
+        z->whole_cap = cap;
+    }
+
+    memcpy(z->whole + z->whole_len, p, n);
+    z->whole_len += n;
+#else
+    pthread_mutex_lock(&z->lock);
+    while (z->count == INFLATE_SLOTS && !z->cancel)
+    {
+        pthread_cond_wait(&z->not_full, &z->lock);
+    }
+    bool cancel = z->cancel;
+    int slot = z->head;
+    pthread_mutex_unlock(&z->lock);
+
+    if (cancel) return -1;
+
+    // The slot belongs to this thread until it is published
+    memcpy(z->slots[slot], p, n);
+    z->slot_len[slot] = n;
+
+    pthread_mutex_lock(&z->lock);
+    z->head = (z->head + 1) % INFLATE_SLOTS;
+    z->count++;
+    pthread_cond_signal(&z->not_empty);
+    pthread_mutex_unlock(&z->lock);
+#endif
+    return 0;
+}
+
+static int inflate_flush(Inflater *z)
+{
+    if (z->out_len == 0) return 0;
+
+    z->crc = crc32(z->crc, z->out, z->out_len);
+    z->total += z->out_len;
+
+    int status = inflate_emit(z, z->out, z->out_len);
+    z->out_len = 0;
+    return status;
+}
+
+// Run zlib to the end of the current stream, -1 on corrupt data or an input that ends first
+static int inflate_stream(Inflater *z)
+{
+    for (;;)
+    {
+        bool eof = inf_peek(z, 1) == 0;
+
+        z->zs.next_out = z->out + z->out_len;
+        z->zs.avail_out = INFLATE_CHUNK - z->out_len;
+        int ret = inflate(&z->zs, Z_NO_FLUSH);
+        z->out_len = INFLATE_CHUNK - z->zs.avail_out;
+
+        if (ret == Z_STREAM_END) return inflate_flush(z);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) return -1;
+
+        if (z->out_len == INFLATE_CHUNK)
+        {
+            if (inflate_flush(z) != 0) return -1;
+            continue;
+        }
+
+        // Room for output was left, so zlib stopped for want of input
+        if (eof) return -1;
+    }
+}
+
+// Every member of a .gz, zlib checks each header, CRC and length
+static int inflate_gzip(Inflater *z)
+{
+    if (inflateInit2(&z->zs, 15 + 32) != Z_OK) return -1;
+    z->zs_live = true;
+
+    for (;;)
+    {
+        if (inflate_stream(z) != 0)
+        {
+            fprintf(stderr, "Corrupt or truncated gzip data%s%s\n", z->zs.msg ? ": " : "", z->zs.msg ? z->zs.msg : "");
+            return -1;
+        }
+
+        // Trailing junk after a complete member is ignored like gzip does
+        if (inf_peek(z, 2) < 2 || z->zs.next_in[0] != 0x1f || z->zs.next_in[1] != 0x8b) return 0;
+        inflateReset(&z->zs);
+    }
+}
+
+// Zip64 extended information (extra field 1) holds the values that are all ones, in the order given
+// Returns whether the field was there
+static bool zip64_extra(const unsigned char *extra, size_t len, uint64_t **values, int count)
+{
+    for (size_t p = 0; p + 4 <= len; )
+    {
+        size_t id = le_get(extra + p, 2);
+        size_t size = le_get(extra + p + 2, 2);
+        if (p + 4 + size > len) return false;
+
+        if (id == 1)
+        {
+            size_t at = p + 4;
+            for (int i = 0; i < count; i++)
+            {
+                if (*values[i] != 0xFFFFFFFF) continue;
+                if (at + 8 > p + 4 + size) break;
+                *values[i] = le_get(extra + at, 8);
+                at += 8;
+            }
+            return true;
+        }
+
+        p += 4 + size;
+    }
+
+    return false;
+}
+
+// CRC and sizes of the entry whose local header is at offset, from the central directory
+// Used when the local header defers them to a data descriptor; fp is put back where it was
+static int zip_central(FILE *fp, uint64_t offset, uint32_t *crc, uint64_t *csize, uint64_t *usize)
+{
+    int64_t saved = file_tell(fp);
+    unsigned char *tail = NULL;
+    unsigned char *dir = NULL;
+    int status = -1;
+
+    if (saved < 0 || file_seek(fp, 0, SEEK_END) != 0) return -1;
+    int64_t size = file_tell(fp);
+
+    // The end of central directory record sits in the last 22 + 65535 bytes
+    size_t tail_len = size < 22 + 65535 ? (size_t)size : 22 + 65535;
+    tail = malloc(tail_len ? tail_len : 1);
+    if (tail == NULL || file_seek(fp, size - tail_len, SEEK_SET) != 0 || fread(tail, 1, tail_len, fp) != tail_len) goto done;
+
+    const unsigned char *end = NULL;
+    for (size_t i = tail_len >= 22 ? tail_len - 22 + 1 : 0; i-- > 0; )
+    {
+        if (le_get(tail + i, 4) == 0x06054b50)
+        {
+            end = tail + i;
+            break;
+        }
+    }
+    if (end == NULL) goto done;
+
+    uint64_t entries = le_get(end + 10, 2);
+    uint64_t dir_len = le_get(end + 12, 4);
+    uint64_t dir_at = le_get(end + 16, 4);
+
+    // Zip64 end of central directory, found through its locator just before the classic record
+    if (entries == 0xFFFF || dir_len == 0xFFFFFFFF || dir_at == 0xFFFFFFFF)
+    {
+        unsigned char record[56];
+        if (end - tail < 20 || le_get(end - 20, 4) != 0x07064b50) goto done;
+        if (file_seek(fp, (int64_t)le_get(end - 20 + 8, 8), SEEK_SET) != 0 || fread(record, 1, sizeof(record), fp) != sizeof(record)) goto done;
+        if (le_get(record, 4) != 0x06064b50) goto done;
+
+        dir_len = le_get(record + 40, 8);
+        dir_at = le_get(record + 48, 8);
+    }
+
+    if (dir_at > (uint64_t)size || dir_len > (uint64_t)size - dir_at) goto done;
+
+    dir = malloc(dir_len ? dir_len : 1);
+    if (dir == NULL || file_seek(fp, (int64_t)dir_at, SEEK_SET) != 0 || fread(dir, 1, dir_len, fp) != dir_len) goto done;
+
+    for (size_t p = 0; p + 46 <= dir_len && le_get(dir + p, 4) == 0x02014b50; )
+    {
+        size_t name_len = le_get(dir + p + 28, 2);
+        size_t extra_len = le_get(dir + p + 30, 2);
+        size_t comment_len = le_get(dir + p + 32, 2);
+        if (p + 46 + name_len + extra_len > dir_len) break;
+
+        uint64_t c = le_get(dir + p + 20, 4);
+        uint64_t u = le_get(dir + p + 24, 4);
+        uint64_t local = le_get(dir + p + 42, 4);
+        uint64_t *values[] = {&u, &c, &local};
+        zip64_extra(dir + p + 46 + name_len, extra_len, values, 3);
+
+        if (local == offset)
+        {
+            *crc = (uint32_t)le_get(dir + p + 16, 4);
+            *csize = c;
+            *usize = u;
+            status = 0;
+            break;
+        }
+
+        p += 46 + name_len + extra_len + comment_len;
+    }
+
+done:
+    free(tail);
+    free(dir);
+    if (file_seek(fp, saved, SEEK_SET) != 0) status = -1;
+    return status;
+}
+
+// First CSV entry of a .zip, read from its local header so the archive streams
+// Entries whose sizes follow the data take them from the central directory instead
+static int inflate_zip(Inflater *z)
+{
+    for (;;)
+    {
+        unsigned char header[30];
+        if (inf_take(z, header, sizeof(header)) != 0 || le_get(header, 4) != 0x04034b50)
+        {
+            fprintf(stderr, "No CSV entry in zip archive\n");
+            return -1;
+        }
+
+        uint64_t offset = z->file_pos - z->zs.avail_in - sizeof(header);
+        int flags = (int)le_get(header + 6, 2);
+        int method = (int)le_get(header + 8, 2);
+        uint32_t crc = (uint32_t)le_get(header + 14, 4);
+        uint64_t csize = le_get(header + 18, 4);
+        uint64_t usize = le_get(header + 22, 4);
+        size_t name_len = le_get(header + 26, 2);
+        size_t extra_len = le_get(header + 28, 2);
+
+        char name[MAX_LENGTH];
+        if (inf_take(z, z->scratch, name_len) != 0) return -1;
+        size_t len = name_len < sizeof(name) - 1 ? name_len : sizeof(name) - 1;
+        memcpy(name, z->scratch, len);
+        name[len] = '\0';
+
+        if (inf_take(z, z->scratch, extra_len) != 0) return -1;
+        uint64_t *values[] = {&usize, &csize};
+        bool zip64 = zip64_extra(z->scratch, extra_len, values, 2);
+
+        bool csv = len > 4 && (!strcmp(name + len - 4, ".csv") || !strcmp(name + len - 4, ".CSV"));
+
+        if (flags & 1)
+        {
+            fprintf(stderr, "Encrypted zip entry %s\n", name);
+            return -1;
+        }
+
+        if ((flags & 8) && zip_central(z->fp, offset, &crc, &csize, &usize) != 0)
+        {
+            fprintf(stderr, "No central directory entry for zip entry %s\n", name);
+            return -1;
+        }
+
+        if (!csv)
+        {
+            // The data, then the descriptor: optional signature, CRC and two sizes (8 bytes each for zip64)
+            if (inf_take(z, NULL, csize) != 0) return -1;
+            if (flags & 8)
+            {
+                bool signed_desc = inf_peek(z, 4) >= 4 && le_get(z->zs.next_in, 4) == 0x08074b50;
+                if (inf_take(z, NULL, (signed_desc ? 4 : 0) + 4 + (zip64 ? 16 : 8)) != 0) return -1;
+            }
+            continue;
+        }
+
+        z->crc = 0;
+        z->total = 0;
+        int status = 0;
+
+        if (method == 8)
+        {
+            if (inflateInit2(&z->zs, -15) != Z_OK) return -1;
+            z->zs_live = true;
+            status = inflate_stream(z);
+        } else if (method == 0)
+        {
+            for (uint64_t left = csize; left > 0 && status == 0; )
+            {
+                size_t part = left < INFLATE_CHUNK - z->out_len ? left : INFLATE_CHUNK - z->out_len;
+                if (inf_take(z, z->out + z->out_len, part) != 0) status = -1;
+                z->out_len += part;
+                left -= part;
+                if (status == 0 && z->out_len == INFLATE_CHUNK) status = inflate_flush(z);
+            }
+
+            if (status == 0) status = inflate_flush(z);
+        } else 
+        {
+            fprintf(stderr, "Unsupported zip method %d for %s\n", method, name);
+            return -1;
+        }
+
+        if (status != 0)
+        {
+            fprintf(stderr, "Corrupt or truncated zip entry %s\n", name);
+            return -1;
+        }
+
+        if (z->crc != crc || z->total != usize)
+        {
+            fprintf(stderr, "zip checksum or size mismatch in %s\n", name);
+            return -1;
+        }
+
+        return 0;
+    }
+}
+
+static void *inflate_task(void *arg)
+{
+    Inflater *z = arg;
+    int status = z->format == INPUT_GZIP ? inflate_gzip(z) : inflate_zip(z);
+
+    // A read error looks like an early end to the parsers, report it as such
+    if (ferror(z->fp)) status = -1;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&z->lock);
+#endif
+    z->status = status;
+    z->done = true;
+#ifndef _WIN32
+    pthread_cond_broadcast(&z->not_empty);
+    pthread_mutex_unlock(&z->lock);
+#endif
+    return NULL;
+}
+
+static void inflate_close(Inflater *z)
+{
+    if (z == NULL) return;
+
+#ifdef _WIN32
+    free(z->whole);
+#else
+    // Wake a decoder blocked on a full ring so it can see the cancel
+    pthread_mutex_lock(&z->lock);
+    z->cancel = true;
+    pthread_cond_broadcast(&z->not_full);
+    pthread_mutex_unlock(&z->lock);
+
+    pthread_join(z->thread, NULL);
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->not_empty);
+    pthread_cond_destroy(&z->not_full);
+#endif
+
+    if (z->zs_live) inflateEnd(&z->zs);
+
+    for (int i = 0; i < INFLATE_SLOTS; i++)
+    {
+        free(z->slots[i]);
+    }
+
+    free(z->out);
+    free(z);
+}
+
+static Inflater *inflate_open(FILE *fp, InputFormat format)
+{
+    Inflater *z = calloc(1, sizeof(*z));
+    if (z == NULL) return NULL;
+
+    z->fp = fp;
+    z->format = format;
+    z->zs.next_in = z->in;
+    z->out = malloc(INFLATE_CHUNK);
+    bool ok = z->out != NULL;
+
+    for (int i = 0; i < INFLATE_SLOTS; i++)
+    {
+        z->slots[i] = malloc(INFLATE_CHUNK);
+        ok &= z->slots[i] != NULL;
+    }
+
+#ifdef _WIN32
+    if (ok) inflate_task(z);
+#else
+    if (ok)
+    {
+        pthread_mutex_init(&z->lock, NULL);
+        pthread_cond_init(&z->not_empty, NULL);
+        pthread_cond_init(&z->not_full, NULL);
+
+        if (pthread_create(&z->thread, NULL, inflate_task, z) != 0)
+        {
+            pthread_mutex_destroy(&z->lock);
+            pthread_cond_destroy(&z->not_empty);
+            pthread_cond_destroy(&z->not_full);
+            ok = false;
+        }
+    }
+#endif
+
+    if (!ok)
+    {
+        for (int i = 0; i < INFLATE_SLOTS; i++) free(z->slots[i]);
+        free(z->out);
+        free(z);
+        return NULL;
+    }
+
+    return z;
+}
+
+static int inflate_read(Inflater *z, char *dst, size_t cap, size_t *n)
+{
+#ifdef _WIN32
+    size_t take = z->whole_len - z->read_pos < cap ? z->whole_len - z->read_pos : cap;
+    memcpy(dst, z->whole + z->read_pos, take);
+    z->read_pos += take;
+    *n = take;
+    return take == 0 ? z->status : 0;
+#else
+    pthread_mutex_lock(&z->lock);
+    while (z->count == 0 && !z->done)
+    {
+        pthread_cond_wait(&z->not_empty, &z->lock);
+    }
+
+    if (z->count == 0)
+    {
+        int status = z->status;
+        pthread_mutex_unlock(&z->lock);
+        *n = 0;
+        return status;
+    }
+
+    int slot = z->tail;
+    pthread_mutex_unlock(&z->lock);
+
+    // The tail slot belongs to the reader until it is released
+    size_t take = z->slot_len[slot] - z->read_pos < cap ? z->slot_len[slot] - z->read_pos : cap;
+    memcpy(dst, z->slots[slot] + z->read_pos, take);
+    z->read_pos += take;
+    *n = take;
+
+    if (z->read_pos == z->slot_len[slot])
+    {
+        pthread_mutex_lock(&z->lock);
+        z->tail = (z->tail + 1) % INFLATE_SLOTS;
+        z->count--;
+        z->read_pos = 0;
+        pthread_cond_signal(&z->not_full);
+        pthread_mutex_unlock(&z->lock);
+    }
+
+    return 0;
+#endif
+}
+
+int source_open(ByteSource *src, const char *filename)
+{
+    memset(src, 0, sizeof(*src));
+
+    src->fp = fopen(filename, "rb");
+    if (src->fp == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    InputFormat format = peek_format(src->fp);
+    if (format == INPUT_PLAIN) return 0;
+
+    src->inflater = inflate_open(src->fp, format);
+    if (src->inflater == NULL)
+    {
+        fprintf(stderr, "Could not start inflating %s\n", filename);
+        fclose(src->fp);
+        src->fp = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void source_close(ByteSource *src)
+{
+    // The decoder thread reads fp, it has to stop first
+    inflate_close(src->inflater);
+    if (src->fp) fclose(src->fp);
+    memset(src, 0, sizeof(*src));
+}
+
+int source_read(ByteSource *src, char *dst, size_t cap, size_t *n)
+{
+    int status;
+
+    if (src->inflater)
+    {
+        status = inflate_read(src->inflater, dst, cap, n);
+    } else 
+    {
+        *n = fread(dst, 1, cap, src->fp);
+        status = *n == 0 && ferror(src->fp) ? -1 : 0;
+    }
+
+    stats_count(bytes, *n);
+    return status;
+}
+
+// * Arrow IPC export * //
+
+#define ARROW_BATCH_ROWS 65536
+#define ARROW_METADATA_V5 4
+
+// Back to front flatbuffer builder, the bytes in use sit at buf[cap - size .. cap)
+// Offsets are measured from the end, like the reference builder
+typedef struct {
+    uint8_t *buf;
+    size_t cap;
+    size_t size;
+    size_t minalign;
+    uint32_t fields[8];  // end offset of each field of the open table, 0 when unset
+    int field_count;
+    size_t table_start;
+    bool failed;
+} FlatBuilder;
+
+// Growable byte buffer for message bodies
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} ByteBuf;
+
+// IPC structs, laid out as in Message.fbs / File.fbs (little endian)
+typedef struct {
+    int64_t length;
+    int64_t null_count;
+} ArrowNode;
+
+typedef struct {
+    int64_t offset;
+    int64_t length;
+} ArrowBuffer;
+
+typedef struct {
+    int64_t offset;
+    int32_t meta_len;
+    int32_t pad;
+    int64_t body_len;
+} ArrowBlock;
+
+typedef struct {
+    FILE *fp;
+    size_t pos;
+    FlatBuilder fb;
+    ByteBuf body;
+    ArrowNode nodes[MAX_FIELDS];
+    ArrowBuffer buffers[3 * MAX_FIELDS];
+    int node_count;
+    int buffer_count;
+    ArrowBlock *blocks;   // dictionaries first, then record batches
+    size_t block_count;
+    size_t block_cap;
+    size_t dict_count;
+    bool failed;
+} ArrowWriter;
+
+// Repeated strings, written once per file as dictionary batches
+static bool arrow_dictionary(int field)
+{
+    return AQS_FIELDS[field].type == COL_DICT;
+}
+
+// Empty text cells are exported as nulls
+static inline bool arrow_empty(const Column *col, uint32_t row)
+{
+    size_t len;
+    column_str(col, row, &len);
+    return len == 0;
+}
+
+static bool fb_reserve(FlatBuilder *b, size_t n)
+{
+    if (b->failed) return false;
+    if (b->size + n <= b->cap) return true;
+
+    size_t cap = b->cap ? b->cap * 2 : 4096;
+    while (b->size + n > cap) cap *= 2;
+
+    uint8_t *buf = malloc(cap);
+    if (buf == NULL)
+    {
+        b->failed = true;
+        return false;
+    }
+
+    if (b->size) memcpy(buf + cap - b->size, b->buf + b->cap - b->size, b->size);
+    free(b->buf);
+    b->buf = buf;
+    b->cap = cap;
+    return true;
+}
+
+static void fb_push(FlatBuilder *b, const void *p, size_t n)
+{
+    if (!fb_reserve(b, n)) return;
+    b->size += n;
+    if (n) memcpy(b->buf + b->cap - b->size, p, n);
+}
+
+// Pad so that once len more bytes are pushed the size is a multiple of align
+static void fb_prealign(FlatBuilder *b, size_t len, size_t align)
+{
+    static const uint8_t zeros[8] = {0};
+
+    if (align > b->minalign) b->minalign = align;
+    fb_push(b, zeros, (align - (b->size + len) % align) % align);
+}
+
+static void fb_reset(FlatBuilder *b)
+{
+    b->size = 0;
+    b->minalign = 1;
+}
+
+static void fb_start_table(FlatBuilder *b)
+{
+    memset(b->fields, 0, sizeof(b->fields));
+    b->field_count = 0;
+    b->table_start = b->size;
+}
+
+// Scalar field of the open table
+static void fb_add(FlatBuilder *b, int field, const void *value, size_t n)
+{
+    fb_prealign(b, n, n);
+    fb_push(b, value, n);
+    b->fields[field] = b->size;
+    if (field >= b->field_count) b->field_count = field + 1;
+}
+
+static void fb_bool(FlatBuilder *b, int field, bool value)
+{
+    uint8_t v = value;
+    fb_add(b, field, &v, 1);
+}
+
+static void fb_short(FlatBuilder *b, int field, int16_t value)
+{
+    fb_add(b, field, &value, 2);
+}
+
+static void fb_int(FlatBuilder *b, int field, int32_t value)
+{
+    fb_add(b, field, &value, 4);
+}
+
+static void fb_long(FlatBuilder *b, int field, int64_t value)
+{
+    fb_add(b, field, &value, 8);
+}
+
+// Reference to an object already in the buffer
+static void fb_offset(FlatBuilder *b, int field, uint32_t target)
+{
+    fb_prealign(b, 4, 4);
+    uint32_t rel = b->size + 4 - target;
+    fb_push(b, &rel, 4);
+    b->fields[field] = b->size;
+    if (field >= b->field_count) b->field_count = field + 1;
+}
+
+static uint32_t fb_end_table(FlatBuilder *b)
+{
+    int32_t soffset = 0;
+    fb_prealign(b, 4, 4);
+    fb_push(b, &soffset, 4);
+    size_t table = b->size;
+
+    // vtable: its own size, the object size, then each field's offset inside the object
+    uint16_t vtable[2 + 8];
+    vtable[0] = (2 + b->field_count) * sizeof(uint16_t);
+    vtable[1] = table - b->table_start;
+    for (int i = 0; i < b->field_count; i++)
+    {
+        vtable[2 + i] = b->fields[i] ? table - b->fields[i] : 0;
+    }
+    fb_push(b, vtable, vtable[0]);
+
+    // The table points back at its vtable, which sits just before it
+    soffset = b->size - table;
+    if (!b->failed) memcpy(b->buf + b->cap - table, &soffset, 4);
+    return table;
+}
+
+static uint32_t fb_string(FlatBuilder *b, const char *s)
+{
+    uint32_t len = strlen(s);
+    uint8_t nul = 0;
+
+    fb_prealign(b, len + 1, 4);
+    fb_push(b, &nul, 1);
+    fb_push(b, s, len);
+    fb_push(b, &len, 4);
+    return b->size;
+}
+
+static uint32_t fb_struct_vector(FlatBuilder *b, const void *items, uint32_t count, size_t elem)
+{
+    fb_prealign(b, count * elem, elem % 8 == 0 ? 8 : 4);
+    fb_push(b, items, count * elem);
+    fb_push(b, &count, 4);
+    return b->size;
+}
+
+static uint32_t fb_offset_vector(FlatBuilder *b, const uint32_t *targets, uint32_t count)
+{
+    fb_prealign(b, count * 4, 4);
+    for (uint32_t i = count; i-- > 0; )
+    {
+        uint32_t rel = b->size + 4 - targets[i];
+        fb_push(b, &rel, 4);
+    }
+    fb_push(b, &count, 4);
+    return b->size;
+}
+
+static void fb_finish(FlatBuilder *b, uint32_t root)
+{
+    fb_prealign(b, 4, b->minalign);
+    uint32_t rel = b->size + 4 - root;
+    fb_push(b, &rel, 4);
+}
+
+static bool bb_reserve(ByteBuf *bb, size_t n)
+{
+    if (bb->len + n <= bb->cap) return true;
+
+    size_t cap = bb->cap ? bb->cap * 2 : 1 << 16;
+    while (bb->len + n > cap) cap *= 2;
+
+    uint8_t *tmp = realloc(bb->data, cap);
+    if (tmp == NULL) return false;
+    bb->data = tmp;
+    bb->cap = cap;
+    return true;
+}
+
+// Write out, tracking the file position for the footer blocks
+static void arrow_write(ArrowWriter *w, const void *p, size_t n)
+{
+    if (n && fwrite(p, 1, n, w->fp) != n) w->failed = true;
+    w->pos += n;
+}
+
+// Close the body buffer that started at start, bodies keep every buffer 8 byte aligned
+static void arrow_buffer(ArrowWriter *w, size_t start)
+{
+    ArrowBuffer *buf = &w->buffers[w->buffer_count++];
+    buf->offset = start;
+    buf->length = w->body.len - start;
+
+    size_t pad = (8 - w->body.len % 8) % 8;
+    if (pad == 0) return;
+
+    if (!bb_reserve(&w->body, pad))
+    {
+        w->failed = true;
+        return;
+    }
+    memset(w->body.data + w->body.len, 0, pad);
+    w->body.len += pad;
+}
+
+// Append n bytes to the body, NULL when out of memory
+static void *arrow_body(ArrowWriter *w, size_t n)
+{
+    if (!bb_reserve(&w->body, n))
+    {
+        w->failed = true;
+        return NULL;
+    }
+
+    void *p = w->body.data + w->body.len;
+    w->body.len += n;
+    return p;
+}
+
+static uint32_t arrow_int_type(FlatBuilder *b)
+{
+    fb_start_table(b);
+    fb_int(b, 0, 32);
+    fb_bool(b, 1, true);
+    return fb_end_table(b);
+}
+
+// Schema of every AQS column, dictionary ids are field indexes
+static uint32_t arrow_schema(FlatBuilder *b)
+{
+    uint32_t fields[MAX_FIELDS];
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        // Type union: Int = 2, FloatingPoint = 3, Utf8 = 5, Timestamp = 10
+        uint8_t type_type;
+        uint32_t type;
+
+        if (AQS_FIELDS[f].type == COL_INT)
+        {
+            type_type = 2;
+            type = arrow_int_type(b);
+        } else if (AQS_FIELDS[f].type == COL_TIME)
+        {
+            // Seconds with no time zone, AQS times are local standard time
+            fb_start_table(b);
+            fb_short(b, 0, 0);  // SECOND
+            type_type = 10;
+            type = fb_end_table(b);
+        } else 
+        {
+            fb_start_table(b);
+            if (AQS_FIELDS[f].type == COL_DBL) fb_short(b, 0, 2);  // DOUBLE
+            type_type = AQS_FIELDS[f].type == COL_DBL ? 3 : 5;
+            type = fb_end_table(b);
+        }
+
+        uint32_t encoding = 0;
+        if (arrow_dictionary(f))
+        {
+            uint32_t index = arrow_int_type(b);
+            fb_start_table(b);
+            fb_long(b, 0, f);
+            fb_offset(b, 1, index);
+            encoding = fb_end_table(b);
+        }
+
+        uint32_t name = fb_string(b, AQS_FIELDS[f].name);
+        uint32_t children = fb_offset_vector(b, NULL, 0);
+
+        fb_start_table(b);
+        fb_offset(b, 0, name);
+        fb_bool(b, 1, true);
+        fb_add(b, 2, &type_type, 1);
+        fb_offset(b, 3, type);
+        if (encoding) fb_offset(b, 4, encoding);
+        fb_offset(b, 5, children);
+        fields[f] = fb_end_table(b);
+    }
+
+    uint32_t vector = fb_offset_vector(b, fields, MAX_FIELDS);
+
+    fb_start_table(b);
+    fb_short(b, 0, 0);  // little endian
+    fb_offset(b, 1, vector);
+    return fb_end_table(b);
+}
+
+// RecordBatch table over the nodes and buffers gathered so far
+static uint32_t arrow_record_batch(ArrowWriter *w, int64_t length)
+{
+    FlatBuilder *b = &w->fb;
+    uint32_t buffers = fb_struct_vector(b, w->buffers, w->buffer_count, sizeof(ArrowBuffer));
+    uint32_t nodes = fb_struct_vector(b, w->nodes, w->node_count, sizeof(ArrowNode));
+
+    fb_start_table(b);
+    fb_long(b, 0, length);
+    fb_offset(b, 1, nodes);
+    fb_offset(b, 2, buffers);
+    return fb_end_table(b);
+}
+
+// Wrap the header built in w->fb into a Message, write it and the body
+// Encapsulation: 0xFFFFFFFF, metadata length, metadata padded to 8, body
+static void arrow_message(ArrowWriter *w, uint8_t header_type, uint32_t header, bool record)
+{
+    FlatBuilder *b = &w->fb;
+
+    fb_start_table(b);
+    fb_short(b, 0, ARROW_METADATA_V5);
+    fb_add(b, 1, &header_type, 1);
+    fb_offset(b, 2, header);
+    fb_long(b, 3, w->body.len);
+    fb_finish(b, fb_end_table(b));
+
+    if (b->failed)
+    {
+        w->failed = true;
+        return;
+    }
+
+    int32_t meta_len = (b->size + 7) & ~(size_t)7;
+    int32_t prefix[2] = {-1, meta_len};
+    static const uint8_t zeros[8] = {0};
+
+    ArrowBlock block = {(int64_t)w->pos, meta_len + 8, 0, (int64_t)w->body.len};
+
+    arrow_write(w, prefix, sizeof(prefix));
+    arrow_write(w, b->buf + b->cap - b->size, b->size);
+    arrow_write(w, zeros, meta_len - b->size);
+    arrow_write(w, w->body.data, w->body.len);
+
+    fb_reset(b);
+    w->body.len = 0;
+    w->node_count = 0;
+    w->buffer_count = 0;
+
+    // Schema messages are not listed in the footer
+    if (!record) return;
+
+    if (w->block_count == w->block_cap)
+    {
+        size_t cap = w->block_cap ? w->block_cap * 2 : 64;
+        ArrowBlock *tmp = realloc(w->blocks, cap * sizeof(*tmp));
+        if (tmp == NULL)
+        {
+            w->failed = true;
+            return;
+        }
+        w->blocks = tmp;
+        w->block_cap = cap;
+    }
+
+    w->blocks[w->block_count++] = block;
+}
+
+// Validity bitmap of one column over rows, returns the null count
+// Empty strings count as missing like empty numbers do
+static size_t arrow_validity(ArrowWriter *w, const Column *col, const uint32_t *rows, size_t n)
+{
+    size_t start = w->body.len;
+    uint8_t *bits = arrow_body(w, (n + 7) / 8);
+    size_t nulls = 0;
+
+    if (bits == NULL) return 0;
+    memset(bits, 0, (n + 7) / 8);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        bool valid = column_text(col->type) ? !arrow_empty(col, rows[i]) : column_valid(col, rows[i]);
+
+        if (valid) bits[i >> 3] |= 1 << (i & 7);
+        else nulls++;
+    }
+
+    // An all valid column needs no bitmap
+    if (nulls == 0) w->body.len = start;
+    arrow_buffer(w, start);
+    return nulls;
+}
+
+// Offsets and bytes of a Utf8 array, string i is the cell of rows[i]
+static void arrow_strings(ArrowWriter *w, const Column *col, const uint32_t *rows, size_t n)
+{
+    size_t start = w->body.len;
+    int32_t *offsets = arrow_body(w, (n + 1) * sizeof(int32_t));
+    if (offsets == NULL) return;
+
+    int32_t at = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t len;
+        column_str(col, rows[i], &len);
+        offsets[i] = at;
+        at += len;
+    }
+    offsets[n] = at;
+    arrow_buffer(w, start);
+
+    start = w->body.len;
+    char *bytes = arrow_body(w, at);
+    if (bytes == NULL) return;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t len;
+        const char *s = column_str(col, rows[i], &len);
+        memcpy(bytes, s, len);
+        bytes += len;
+    }
+    arrow_buffer(w, start);
+}
+
+int export_arrow(const char *path, const AQSColumns *cols, const uint32_t *rows, size_t n)
+{
+    ArrowWriter w;
+    memset(&w, 0, sizeof(w));
+    fb_reset(&w.fb);
+
+    // One single-key group table per dictionary column maps its codes to the export's, in first seen order
+    GroupSpec specs[MAX_FIELDS];
+    GroupTable *dicts[MAX_FIELDS] = {0};
+    int status = 0;
+
+    for (int f = 0; f < MAX_FIELDS && status == 0; f++)
+    {
+        if (!arrow_dictionary(f)) continue;
+
+        memset(&specs[f], 0, sizeof(specs[f]));
+        specs[f].keys[0] = f;
+        specs[f].key_count = 1;
+        dicts[f] = group_table_create(cols, &specs[f]);
+        if (dicts[f] == NULL) status = -1;
+    }
+
+    // Dictionaries must precede the first batch, so their values are gathered up front
+    for (size_t i = 0; i < n && status == 0; i++)
+    {
+        for (int f = 0; f < MAX_FIELDS; f++)
+        {
+            const Column *col = &cols->cols[f];
+            if (dicts[f] == NULL || arrow_empty(col, rows[i])) continue;
+            if (group_find(dicts[f], rows[i], group_hash(dicts[f], rows[i])) < 0) status = -1;
+        }
+    }
+
+    w.fp = status == 0 ? fopen(path, "wb") : NULL;
+    if (w.fp == NULL)
+    {
+        fprintf(stderr, "Could not write %s: %s\n", path, status ? "out of memory" : strerror(errno));
+        for (int f = 0; f < MAX_FIELDS; f++) group_table_free(dicts[f]);
+        return -1;
+    }
+
+    static const uint8_t magic[8] = {'A', 'R', 'R', 'O', 'W', '1', 0, 0};
+    arrow_write(&w, magic, sizeof(magic));
+
+    // MessageHeader union: Schema = 1, DictionaryBatch = 2, RecordBatch = 3
+    arrow_message(&w, 1, arrow_schema(&w.fb), false);
+
+    for (int f = 0; f < MAX_FIELDS && !w.failed; f++)
+    {
+        if (dicts[f] == NULL) continue;
+
+        // One Utf8 array of the distinct values, in first seen order
+        const GroupTable *dict = dicts[f];
+        w.nodes[w.node_count++] = (ArrowNode){(int64_t)dict->len, 0};
+        arrow_buffer(&w, w.body.len);
+        arrow_strings(&w, &cols->cols[f], dict->reps, dict->len);
+
+        uint32_t data = arrow_record_batch(&w, dict->len);
+        fb_start_table(&w.fb);
+        fb_long(&w.fb, 0, f);
+        fb_offset(&w.fb, 1, data);
+        arrow_message(&w, 2, fb_end_table(&w.fb), true);
+    }
+
+    w.dict_count = w.block_count;
+
+    // Record batches, only one batch worth of body is ever held
+    for (size_t lo = 0; lo < n && !w.failed; lo += ARROW_BATCH_ROWS)
+    {
+        size_t count = n - lo < ARROW_BATCH_ROWS ? n - lo : ARROW_BATCH_ROWS;
+        const uint32_t *batch = rows + lo;
+
+        for (int f = 0; f < MAX_FIELDS && !w.failed; f++)
+        {
+            const Column *col = &cols->cols[f];
+            size_t nulls = arrow_validity(&w, col, batch, count);
+            w.nodes[w.node_count++] = (ArrowNode){(int64_t)count, (int64_t)nulls};
+
+            size_t start = w.body.len;
+
+            if (dicts[f])
+            {
+                int32_t *codes = arrow_body(&w, count * sizeof(int32_t));
+                for (size_t i = 0; codes && i < count; i++)
+                {
+                    codes[i] = arrow_empty(col, batch[i]) ? 0 : group_find(dicts[f], batch[i], group_hash(dicts[f], batch[i]));
+                }
+                arrow_buffer(&w, start);
+            } else if (col->type == COL_STR)
+            {
+                arrow_strings(&w, col, batch, count);
+            } else 
+            {
+                // Missing numbers are 0 / NaN underneath their null bit
+                size_t width = col->type == COL_INT ? sizeof(int32_t) : sizeof(double);
+                char *values = arrow_body(&w, count * width);
+
+                for (size_t i = 0; values && i < count; i++)
+                {
+                    if (col->type == COL_INT) memcpy(values + i * width, &col->i32[batch[i]], width);
+                    else if (col->type == COL_DBL) memcpy(values + i * width, &col->f64[batch[i]], width);
+                    else memcpy(values + i * width, &col->i64[batch[i]], width);
+                }
+                arrow_buffer(&w, start);
+            }
+        }
+
+        arrow_message(&w, 3, arrow_record_batch(&w, count), true);
+    }
+
+    // End of stream marker, then the footer repeating the schema and every block
+    int32_t eos[2] = {-1, 0};
+    arrow_write(&w, eos, sizeof(eos));
+
+    FlatBuilder *b = &w.fb;
+    uint32_t schema = arrow_schema(b);
+    uint32_t dict_blocks = fb_struct_vector(b, w.blocks, w.dict_count, sizeof(ArrowBlock));
+    uint32_t batch_blocks = fb_struct_vector(b, w.blocks + w.dict_count, w.block_count - w.dict_count, sizeof(ArrowBlock));
+
+    fb_start_table(b);
+    fb_short(b, 0, ARROW_METADATA_V5);
+    fb_offset(b, 1, schema);
+    fb_offset(b, 2, dict_blocks);
+    fb_offset(b, 3, batch_blocks);
+    fb_finish(b, fb_end_table(b));
+
+    int32_t footer_len = b->size;
+    arrow_write(&w, b->buf + b->cap - b->size, b->size);
+    arrow_write(&w, &footer_len, sizeof(footer_len));
+    arrow_write(&w, magic, 6);
+
+    if (b->failed || fclose(w.fp) != 0) w.failed = true;
+
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        group_table_free(dicts[f]);
+    }
+
+    free(w.fb.buf);
+    free(w.body.data);
+    free(w.blocks);
+
+    if (w.failed)
+    {
+        fprintf(stderr, "Could not write %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// * Spatial index * //
+
+#define EARTH_RADIUS_KM 6371.0088
+#define DEG_TO_RAD (3.14159265358979323846 / 180.0)
+
+void site_index_free(SiteIndex *index)
+{
+    if (index == NULL) return;
+
+    free(index->lat);
+    free(index->lon);
+    free(index->reps);
+    free(index->row_starts);
+    free(index->rows);
+    free(index->tree);
+    free(index);
+}
+
+// qsort has no context argument, each entry carries the coordinate of the axis being split
+typedef struct {
+    double coord;
+    uint32_t site;
+} SiteOrder;
+
+static int comp_site(const void *a, const void *b)
+{
+    const SiteOrder *sa = a;
+    const SiteOrder *sb = b;
+    return (sa->coord > sb->coord) - (sa->coord < sb->coord);
+}
+
+// Median split on latitude, then longitude, alternating by depth, order is scratch for tree[lo, hi)
+static void site_tree_build(SiteIndex *index, SiteOrder *order, size_t lo, size_t hi, int depth)
+{
+    if (hi - lo < 2) return;
+
+    const double *coord = depth & 1 ? index->lon : index->lat;
+    for (size_t i = lo; i < hi; i++)
+    {
+        order[i].coord = coord[index->tree[i]];
+        order[i].site = index->tree[i];
+    }
+
+    qsort(order + lo, hi - lo, sizeof(*order), comp_site);
+
+    for (size_t i = lo; i < hi; i++)
+    {
+        index->tree[i] = order[i].site;
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    site_tree_build(index, order, lo, mid, depth + 1);
+    site_tree_build(index, order, mid + 1, hi, depth + 1);
+}
+
+SiteIndex *site_index_build(const AQSColumns *cols)
+{
+    SiteIndex *index = calloc(1, sizeof(*index));
+    GroupSpec spec = {.keys = {0, 1, 2}, .key_count = 3};
+    GroupTable *sites = group_table_create(cols, &spec);
+    uint32_t *row_sites = malloc((cols->len ? cols->len : 1) * sizeof(*row_sites));
+    SiteOrder *order = NULL;
+    bool ok = index && sites && row_sites;
+
+    // A site is its state, county and site number, grouped exactly like --group
+    for (size_t i = 0; ok && i < cols->len; i++)
+    {
+        long g = group_find(sites, i, group_hash(sites, i));
+        ok = g >= 0;
+        row_sites[i] = g;
+    }
+
+    size_t count = ok ? sites->len : 0;
+
+    if (ok)
+    {
+        index->count = count;
+        index->lat = malloc((count ? count : 1) * sizeof(*index->lat));
+        index->lon = malloc((count ? count : 1) * sizeof(*index->lon));
+        index->reps = malloc((count ? count : 1) * sizeof(*index->reps));
+        index->tree = malloc((count ? count : 1) * sizeof(*index->tree));
+        index->row_starts = calloc(count + 1, sizeof(*index->row_starts));
+        index->rows = malloc((cols->len ? cols->len : 1) * sizeof(*index->rows));
+        order = malloc((count ? count : 1) * sizeof(*order));
+        ok = index->lat && index->lon && index->reps && index->tree && index->row_starts && index->rows && order;
+    }
+
+    if (!ok)
+    {
+        perror("Failed to build site index");
+        group_table_free(sites);
+        free(row_sites);
+        free(order);
+        site_index_free(index);
+        return NULL;
+    }
+
+    // Counting sort of rows by site: ends first, then filled back to front down to the starts
+    for (size_t i = 0; i < cols->len; i++)
+    {
+        index->row_starts[row_sites[i]]++;
+    }
+
+    for (size_t s = 1; s < count; s++)
+    {
+        index->row_starts[s] += index->row_starts[s - 1];
+    }
+
+    index->row_starts[count] = cols->len;
+    for (size_t i = cols->len; i-- > 0; )
+    {
+        index->rows[--index->row_starts[row_sites[i]]] = i;
+    }
+
+    // Coordinates of the first row, sites without any stay out of the tree
+    const Column *lat = &cols->cols[5];
+    const Column *lon = &cols->cols[6];
+
+    for (size_t s = 0; s < count; s++)
+    {
+        uint32_t rep = sites->reps[s];
+        index->reps[s] = rep;
+        index->lat[s] = lat->f64[rep];
+        index->lon[s] = lon->f64[rep];
+
+        if (column_valid(lat, rep) && column_valid(lon, rep)) index->tree[index->tree_count++] = s;
+    }
+
+    site_tree_build(index, order, 0, index->tree_count, 0);
+
+    group_table_free(sites);
+    free(row_sites);
+    free(order);
+    return index;
+}
+
+double haversine_km(double lat1, double lon1, double lat2, double lon2)
+{
+    double dlat = (lat2 - lat1) * DEG_TO_RAD;
+    double dlon = (lon2 - lon1) * DEG_TO_RAD;
+    double a = sin(dlat / 2) * sin(dlat / 2)
+        + cos(lat1 * DEG_TO_RAD) * cos(lat2 * DEG_TO_RAD) * sin(dlon / 2) * sin(dlon / 2);
+
+    return 2 * EARTH_RADIUS_KM * asin(sqrt(a < 1 ? a : 1));
+}
+
+// Every site of tree[lo, hi) inside the box, the box never wraps here
+static size_t site_range(const SiteIndex *index, size_t lo, size_t hi, int depth, const double *box, uint32_t *out)
+{
+    size_t found = 0;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        uint32_t s = index->tree[mid];
+        double lat = index->lat[s];
+        double lon = index->lon[s];
+
+        if (lat >= box[0] && lat <= box[2] && lon >= box[1] && lon <= box[3]) out[found++] = s;
+
+        // Recurse into one side, loop on the other
+        double split = depth & 1 ? lon : lat;
+        double min = depth & 1 ? box[1] : box[0];
+        double max = depth & 1 ? box[3] : box[2];
+
+        if (min <= split && max >= split)
+        {
+            found += site_range(index, lo, mid, depth + 1, box, out + found);
+            lo = mid + 1;
+        } else if (max < split)
+        {
+            hi = mid;
+        } else 
+        {
+            lo = mid + 1;
+        }
+
+        depth++;
+    }
+
+    return found;
+}
+
+size_t site_bbox(const SiteIndex *index, double lat_min, double lon_min, double lat_max, double lon_max, uint32_t *out)
+{
+    if (lon_min <= lon_max)
+    {
+        double box[4] = {lat_min, lon_min, lat_max, lon_max};
+        return site_range(index, 0, index->tree_count, 0, box, out);
+    }
+
+    // Across the antimeridian: two boxes that never overlap
+    double east[4] = {lat_min, lon_min, lat_max, 180};
+    double west[4] = {lat_min, -180, lat_max, lon_max};
+    size_t found = site_range(index, 0, index->tree_count, 0, east, out);
+    return found + site_range(index, 0, index->tree_count, 0, west, out + found);
+}
+
+// A --near hit and its distance, sorted nearest first
+typedef struct {
+    double km;
+    uint32_t site;
+} SiteHit;
+
+static int comp_hit(const void *a, const void *b)
+{
+    const SiteHit *ha = a;
+    const SiteHit *hb = b;
+    return (ha->km > hb->km) - (ha->km < hb->km);
+}
+
+size_t site_near(const SiteIndex *index, double lat, double lon, double radius_km, uint32_t *out)
+{
+    // Exact bounding box of the circle, then the true distance
+    double dlat = radius_km / EARTH_RADIUS_KM / DEG_TO_RAD;
+    double lat_min = lat - dlat;
+    double lat_max = lat + dlat;
+    size_t found;
+
+    if (lat_min <= -90 || lat_max >= 90 || radius_km >= EARTH_RADIUS_KM * 3.14159265358979323846)
+    {
+        // A pole inside the circle, every longitude qualifies
+        found = site_bbox(index, lat_min, -180, lat_max, 180, out);
+    } else 
+    {
+        double dlon = asin(sin(radius_km / EARTH_RADIUS_KM) / cos(lat * DEG_TO_RAD)) / DEG_TO_RAD;
+        double lon_min = lon - dlon;
+        double lon_max = lon + dlon;
+
+        if (lon_min < -180) lon_min += 360;
+        if (lon_max > 180) lon_max -= 360;
+
+        found = site_bbox(index, lat_min, lon_min, lat_max, lon_max, out);
+    }
+
+    SiteHit *hits = malloc((found ? found : 1) * sizeof(*hits));
+    if (hits == NULL) return 0;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < found; i++)
+    {
+        double km = haversine_km(lat, lon, index->lat[out[i]], index->lon[out[i]]);
+        if (km <= radius_km) hits[kept++] = (SiteHit){km, out[i]};
+    }
+
+    qsort(hits, kept, sizeof(*hits), comp_hit);
+    for (size_t i = 0; i < kept; i++)
+    {
+        out[i] = hits[i].site;
+    }
+
+    free(hits);
+    return kept;
+}
+
+static int comp_row(const void *a, const void *b)
+{
+    uint32_t ra = *(const uint32_t *)a;
+    uint32_t rb = *(const uint32_t *)b;
+    return (ra > rb) - (ra < rb);
+}
+
+size_t site_keep(const SiteIndex *index, uint32_t site, const uint32_t *rows, size_t n, uint32_t *out)
+{
+    size_t kept = 0;
+
+    for (size_t r = index->row_starts[site]; r < index->row_starts[site + 1]; r++)
+    {
+        uint32_t row = index->rows[r];
+        if (bsearch(&row, rows, n, sizeof(*rows), comp_row)) out[kept++] = row;
+    }
+
+    return kept;
+}
+
+uint32_t *spatial_select(const Dataset *ds, const Options *opts, const uint32_t *rows, size_t *n)
+{
+    double start = now_seconds();
+    SiteIndex *index = site_index_build(ds->cols);
+    if (index == NULL) return NULL;
+
+    double built = now_seconds();
+    uint32_t *sites = malloc((index->count ? index->count : 1) * sizeof(*sites));
+    uint32_t *out = malloc((*n ? *n : 1) * sizeof(*out));
+
+    if (sites == NULL || out == NULL)
+    {
+        perror("Failed to allocate spatial query");
+        free(sites);
+        free(out);
+        site_index_free(index);
+        return NULL;
+    }
+
+    const double *b = opts->box;
+    size_t found = opts->near
+        ? site_near(index, opts->near_lat, opts->near_lon, opts->radius_km, sites)
+        : site_bbox(index, b[0], b[1], b[2], b[3], sites);
+    double queried = now_seconds();
+
+    printf("%zu of %zu sites matched (index %.1f ms, query %.1f us)\n", found, index->count,
+        (built - start) * 1e3, (queried - built) * 1e6);
+
+    // Site rows are every parameter, keep those in the (sorted) selection
+    size_t kept = 0;
+    for (size_t i = 0; i < found; i++)
+    {
+        uint32_t s = sites[i];
+        uint32_t rep = index->reps[s];
+        size_t len[3];
+        const char *key[3];
+
+        for (int k = 0; k < 3; k++)
+        {
+            key[k] = column_str(&ds->cols->cols[k], rep, &len[k]);
+        }
+
+        size_t site_kept = kept;
+        kept += site_keep(index, s, rows, *n, out + kept);
+
+        if (opts->near)
+        {
+            printf("Site %.*s-%.*s-%.*s (%.6f, %.6f) %.2f km, %zu rows\n", (int)len[0], key[0], (int)len[1], key[1],
+                (int)len[2], key[2], index->lat[s], index->lon[s],
+                haversine_km(opts->near_lat, opts->near_lon, index->lat[s], index->lon[s]), kept - site_kept);
+        } else 
+        {
+            printf("Site %.*s-%.*s-%.*s (%.6f, %.6f), %zu rows\n", (int)len[0], key[0], (int)len[1], key[1],
+                (int)len[2], key[2], index->lat[s], index->lon[s], kept - site_kept);
+        }
+    }
+
+    qsort(out, kept, sizeof(*out), comp_row);
+    *n = kept;
+
+    free(sites);
+    site_index_free(index);
+    return out;
+}
+
+void write_rows_csv(FILE *out, const AQSColumns *cols, const uint32_t *rows, size_t n)
+{
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        fprintf(out, "%s%c", AQS_FIELDS[f].name, f + 1 < MAX_FIELDS ? ',' : '\n');
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        for (int f = 0; f < MAX_FIELDS; f++)
+        {
+            const Column *col = &cols->cols[f];
+            double value;
+
+            if (column_text(col->type))
+            {
+                size_t len;
+                const char *s = column_str(col, rows[i], &len);
+                print_cell(out, s, len);
+            } else if (column_number(col, rows[i], &value))
+            {
+                // 15 digits round trip every value the CSVs carry
+                print_number(out, col->type, value, "%.15g");
+            }
+
+            fputc(f + 1 < MAX_FIELDS ? ',' : '\n', out);
+        }
+    }
+}
+
+void write_records_csv(FILE *out, const AQSArena *arena)
+{
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        fprintf(out, "%s%c", AQS_FIELDS[f].name, f + 1 < MAX_FIELDS ? ',' : '\n');
+    }
+
+    for (size_t i = 0; i < arena->len; i++)
+    {
+        const AQSData *rec = arena_at(arena, i);
+
+        for (int f = 0; f < MAX_FIELDS; f++)
+        {
+            const RecordField *field = &RECORD_FIELDS[f];
+            const char *src = (const char *)rec + field->offset;
+            bool missing = rec->missing >> f & 1;
+
+            switch (field->kind)
+            {
+                case REC_TEXT:
+                    print_cell(out, src, strlen(src));
+                    break;
+                case REC_CHAR:
+                    if (*src) print_cell(out, src, 1);
+                    break;
+                case REC_INT:
+                    if (!missing) fprintf(out, "%d", *(const int *)src);
+                    break;
+                case REC_DOUBLE:
+                    if (!missing) print_number(out, COL_DBL, *(const double *)src, "%.15g");
+                    break;
+                case REC_TIME:
+                    if (!missing) print_number(out, COL_TIME, (double)*(const int64_t *)src, "%.15g");
+                    break;
+            }
+
+            fputc(f + 1 < MAX_FIELDS ? ',' : '\n', out);
+        }
+    }
+}
+
+// * Datetime index * //
+
+void time_index_free(TimeIndex *index)
+{
+    if (index == NULL) return;
+
+    free(index->times);
+    free(index->rows);
+    free(index);
+}
+
+// Time then row, so equal times keep file order
+typedef struct {
+    int64_t time;
+    uint32_t row;
+} TimeEntry;
+
+static int comp_time(const void *a, const void *b)
+{
+    const TimeEntry *ta = a;
+    const TimeEntry *tb = b;
+
+    if (ta->time != tb->time) return ta->time < tb->time ? -1 : 1;
+    return (ta->row > tb->row) - (ta->row < tb->row);
+}
+
+TimeIndex *time_index_build(const AQSColumns *cols, int field)
+{
+    const Column *col = &cols->cols[field];
+    TimeIndex *index = calloc(1, sizeof(*index));
+    TimeEntry *entries = malloc((cols->len ? cols->len : 1) * sizeof(*entries));
+
+    if (index == NULL || entries == NULL || col->type != COL_TIME)
+    {
+        free(index);
+        free(entries);
+        return NULL;
+    }
+
+    index->field = field;
+
+    for (size_t i = 0; i < cols->len; i++)
+    {
+        if (column_valid(col, i)) entries[index->count++] = (TimeEntry){col->i64[i], (uint32_t)i};
+    }
+
+    qsort(entries, index->count, sizeof(*entries), comp_time);
+
+    size_t count = index->count ? index->count : 1;
+    index->times = malloc(count * sizeof(*index->times));
+    index->rows = malloc(count * sizeof(*index->rows));
+
+    if (index->times == NULL || index->rows == NULL)
+    {
+        free(entries);
+        time_index_free(index);
+        return NULL;
+    }
+
+    // Split apart so searches only touch the times
+    for (size_t i = 0; i < index->count; i++)
+    {
+        index->times[i] = entries[i].time;
+        index->rows[i] = entries[i].row;
+    }
+
+    free(entries);
+    return index;
+}
+
+// First entry with time >= t
+static size_t time_lower_bound(const TimeIndex *index, int64_t t)
+{
+    size_t lo = 0;
+    size_t hi = index->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->times[mid] < t) lo = mid + 1; else hi = mid;
+    }
+
+    return lo;
+}
+
+size_t time_range(const TimeIndex *index, int64_t from, int64_t to, size_t *first)
+{
+    size_t lo = time_lower_bound(index, from);
+    size_t hi = to > from ? time_lower_bound(index, to) : lo;
+
+    *first = lo;
+    return hi - lo;
+}
+
+int time_spec_parse(const char *spec, int *field, int64_t *start, int64_t *end)
+{
+    // field=from[..to], each end names a whole period: 2021-07..2021-09 is July through September
+    const char *eq = strchr(spec, '=');
+    const char *from = eq ? eq + 1 : NULL;
+    const char *dots = from ? strstr(from, "..") : NULL;
+    int64_t last_start;
+
+    *field = eq ? field_index(spec, eq - spec) : -1;
+
+    bool ok = *field >= 0 && AQS_FIELDS[*field].type == COL_TIME
+        && parse_datetime(from, dots ? (size_t)(dots - from) : strlen(from), start, end) == NUM_OK
+        && (!dots || parse_datetime(dots + 2, strlen(dots + 2), &last_start, end) == NUM_OK);
+
+    return ok ? 0 : -1;
+}
+
+size_t time_keep(const TimeIndex *index, int64_t from, int64_t to, const uint32_t *rows, size_t n, uint32_t *out)
+{
+    size_t first;
+    size_t count = time_range(index, from, to, &first);
+
+    // The index covers every parameter, keep the rows of the (sorted) selection
+    size_t kept = 0;
+    for (size_t i = first; i < first + count; i++)
+    {
+        if (bsearch(&index->rows[i], rows, n, sizeof(*rows), comp_row)) out[kept++] = index->rows[i];
+    }
+
+    qsort(out, kept, sizeof(*out), comp_row);
+    return kept;
+}
+
+uint32_t *time_select(const Dataset *ds, const char *spec, const uint32_t *rows, size_t *n)
+{
+    int field;
+    int64_t start, end;
+
+    if (time_spec_parse(spec, &field, &start, &end) != 0)
+    {
+        fprintf(stderr, "Bad time range: %s (expected e.g. first_max_datetime=2021-07 or =2021-07-01..2021-07-15)\n", spec);
+        return NULL;
+    }
+
+    double begin = now_seconds();
+    TimeIndex *index = time_index_build(ds->cols, field);
+    uint32_t *out = malloc((*n ? *n : 1) * sizeof(*out));
+
+    if (index == NULL || out == NULL)
+    {
+        perror("Failed to build time index");
+        time_index_free(index);
+        free(out);
+        return NULL;
+    }
+
+    double built = now_seconds();
+    size_t kept = time_keep(index, start, end, rows, *n, out);
+    double queried = now_seconds();
+
+    char a[20], b[20];
+    format_time(start, a);
+    format_time(end, b);
+    printf("%zu of %zu rows with %s in [%s, %s) (index %.1f ms, query %.1f us)\n", kept, *n,
+        AQS_FIELDS[field].name, a, b, (built - begin) * 1e3, (queried - built) * 1e6);
+
+    *n = kept;
+    time_index_free(index);
+    return out;
+}
+
+// * Stats * //
+
+uint64_t peak_rss_bytes(void)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+
+    // Linux reports kilobytes, macOS bytes
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+void stats_report(FILE *out)
+{
+    double total = now_seconds() - STATS.start;
+    uint64_t rss = peak_rss_bytes();
+
+    if (STATS.json)
+    {
+        fprintf(out, "{\"stages\": {");
+        for (int i = 0; i < STAGE_COUNT; i++)
+        {
+            fprintf(out, "%s\"%s\": {\"seconds\": %.6f, \"calls\": %llu}", i ? ", " : "", STAGE_NAMES[i],
+                STATS.seconds[i], (unsigned long long)STATS.calls[i]);
+        }
+        fprintf(out, "}, \"total_seconds\": %.6f, \"bytes\": %llu, \"rows\": %llu, \"reallocs\": %llu, \"peak_rss_bytes\": %llu}\n",
+            total, (unsigned long long)STATS.bytes, (unsigned long long)STATS.rows,
+            (unsigned long long)STATS.reallocs, (unsigned long long)rss);
+        return;
+    }
+
+    fprintf(out, "%-10s %12s %7s %12s\n", "stage", "seconds", "share", "calls");
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        // Stages this run never entered are left out
+        if (STATS.calls[i] == 0) continue;
+
+        fprintf(out, "%-10s %12.6f %6.1f%% %12llu\n", STAGE_NAMES[i], STATS.seconds[i],
+            total > 0 ? STATS.seconds[i] / total * 100 : 0, (unsigned long long)STATS.calls[i]);
+    }
+
+    fprintf(out, "%-10s %12.6f\n", "total", total);
+    fprintf(out, "bytes      %12llu (%.1f MB/s over read + split + convert + load)\n", (unsigned long long)STATS.bytes,
+        STATS.bytes / 1e6 / (STATS.seconds[STAGE_READ] + STATS.seconds[STAGE_SPLIT]
+            + STATS.seconds[STAGE_CONVERT] + STATS.seconds[STAGE_LOAD] + 1e-9));
+    fprintf(out, "rows       %12llu\n", (unsigned long long)STATS.rows);
+    fprintf(out, "reallocs   %12llu\n", (unsigned long long)STATS.reallocs);
+
+    if (rss) fprintf(out, "peak rss   %12.1f MB\n", rss / 1e6);
+    else fprintf(out, "peak rss   %12s\n", "n/a");
+}
+
+// * Query server * //
+
+#ifndef _WIN32
+
+// Open connections, each holds a reader thread; the next accept waits for one to close
+#define SERVE_MAX_CLIENTS 64
+
+// Requests of one client queued or running; its reader stops reading until one is answered
+#define SERVE_CLIENT_JOBS 64
+
+// One client of --serve, stdin / stdout or an accepted socket connection
+// Replies are written whole under lock, refs counts its reader plus its requests in flight
+typedef struct {
+    FILE *in;
+    int out;
+    pthread_mutex_t lock;
+    pthread_cond_t drained;  // one of its requests was answered
+    int refs;
+} ServeClient;
+
+typedef struct ServeJob {
+    ServeClient *client;
+    char *line;
+    struct ServeJob *next;
+} ServeJob;
+
+// The loaded dataset is shared read-only, the indexes are built by the first query needing them
+typedef struct {
+    const Dataset *ds;
+    char **names;  // parameter names, sorted
+    NgramIndex *vocab;  // parameter names then the distinct site, city, county, CBSA and method names
+    int *vocab_fields;  // field of each vocab entry
+    SiteIndex *sites;
+    TimeIndex *times[MAX_FIELDS];
+    pthread_mutex_t index_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;  // a job was queued or the server is stopping
+    pthread_cond_t idle;   // nothing queued or running
+    pthread_cond_t slot;   // a connection closed
+    ServeJob *head;
+    ServeJob *tail;
+    size_t pending;
+    int clients;           // open socket connections
+    bool stopping;
+} Server;
+
+typedef struct {
+    Server *server;
+    ServeClient *client;
+} ServeConnection;
+
+// One member of a flat JSON request, strings are decoded, arrays keep their raw text without blanks
+typedef enum { JSON_STRING, JSON_NUMBER, JSON_ARRAY, JSON_LITERAL } JsonKind;
+
+typedef struct {
+    char key[32];
+    JsonKind kind;
+    char value[MAX_LENGTH];
+} JsonField;
+
+#define MAX_JSON_FIELDS 24
+
+static const char *skip_blanks(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+// Decode the string starting after its opening quote into out, NULL when malformed or too long
+static const char *json_decode(const char *p, char *out, size_t cap)
+{
+    size_t n = 0;
+
+    while (*p != '"')
+    {
+        unsigned code = (unsigned char)*p++;
+        bool escaped = code == '\\';
+
+        if (code < 0x20) return NULL;
+        if (escaped)
+        {
+            char c = *p++;
+            switch (c)
+            {
+                case '"': case '\\': case '/': code = c; break;
+                case 'b': code = '\b'; break;
+                case 'f': code = '\f'; break;
+                case 'n': code = '\n'; break;
+                case 'r': code = '\r'; break;
+                case 't': code = '\t'; break;
+                case 'u':
+                {
+                    // Basic multilingual plane only, written back as UTF-8
+                    int used = 0;
+                    if (sscanf(p, "%4x%n", &code, &used) != 1 || used != 4) return NULL;
+                    p += 4;
+                    break;
+                }
+                default: return NULL;
+            }
+        }
+
+        char bytes[3];
+        int len = 1;
+        // Raw bytes are copied as they are, UTF-8 included
+        if (code < 0x80 || !escaped)
+        {
+            bytes[0] = (char)code;
+        } else if (code < 0x800)
+        {
+            bytes[0] = (char)(0xC0 | code >> 6);
+            bytes[1] = (char)(0x80 | (code & 0x3F));
+            len = 2;
+        } else 
+        {
+            bytes[0] = (char)(0xE0 | code >> 12);
+            bytes[1] = (char)(0x80 | (code >> 6 & 0x3F));
+            bytes[2] = (char)(0x80 | (code & 0x3F));
+            len = 3;
+        }
+
+        if (n + len >= cap) return NULL;
+        memcpy(out + n, bytes, len);
+        n += len;
+    }
+
+    out[n] = '\0';
+    return p + 1;
+}
+
+// -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)? up to end, returns where it stopped or NULL
+static const char *json_number(const char *p, char end)
+{
+    if (*p == '-') p++;
+    if (*p == '0') p++;
+    else if (*p >= '1' && *p <= '9') while (isdigit((unsigned char)*p)) p++;
+    else return NULL;
+
+    if (*p == '.')
+    {
+        if (!isdigit((unsigned char)*++p)) return NULL;
+        while (isdigit((unsigned char)*p)) p++;
+    }
+
+    if (*p == 'e' || *p == 'E')
+    {
+        p++;
+        if (*p == '+' || *p == '-') p++;
+        if (!isdigit((unsigned char)*p)) return NULL;
+        while (isdigit((unsigned char)*p)) p++;
+    }
+
+    return *p == end ? p : NULL;
+}
+
+// Bare values as JSON spells them: a number, true, false, null, or an array of numbers
+static bool json_token_valid(JsonKind kind, const char *value)
+{
+    switch (kind)
+    {
+        case JSON_NUMBER:
+            return json_number(value, '\0') != NULL;
+        case JSON_LITERAL:
+            return !strcmp(value, "true") || !strcmp(value, "false") || !strcmp(value, "null");
+        case JSON_ARRAY:
+        {
+            // Empty, or numbers separated by single commas
+            const char *p = value;
+            if (*p == '\0') return true;
+            while ((p = json_number(p, strchr(p, ',') ? ',' : '\0')) != NULL && *p == ',') p++;
+            return p != NULL;
+        }
+        default:
+            return true;
+    }
+}
+
+// Split {"key": value, ...} into fields, -1 on anything but a flat object
+static int json_parse(const char *line, JsonField *fields, int cap)
+{
+    const char *p = skip_blanks(line);
+    int count = 0;
+
+    if (*p++ != '{') return -1;
+    p = skip_blanks(p);
+    if (*p == '}') return *skip_blanks(p + 1) ? -1 : 0;
+
+    while (true)
+    {
+        if (count == cap || *p != '"') return -1;
+
+        JsonField *f = &fields[count++];
+        if ((p = json_decode(p + 1, f->key, sizeof(f->key))) == NULL) return -1;
+
+        p = skip_blanks(p);
+        if (*p++ != ':') return -1;
+        p = skip_blanks(p);
+
+        if (*p == '"')
+        {
+            f->kind = JSON_STRING;
+            if ((p = json_decode(p + 1, f->value, sizeof(f->value))) == NULL) return -1;
+        } else 
+        {
+            // Numbers, literals and arrays of numbers are kept as written
+            f->kind = *p == '[' ? JSON_ARRAY : (*p == '-' || isdigit((unsigned char)*p)) ? JSON_NUMBER : JSON_LITERAL;
+            if (f->kind == JSON_ARRAY) p++;
+
+            size_t n = 0;
+            bool gap = false;
+            while (*p && (f->kind == JSON_ARRAY ? *p != ']' : *p != ',' && *p != '}'))
+            {
+                if (*p == '"' || *p == '[' || *p == '{') return -1;
+                if (isspace((unsigned char)*p))
+                {
+                    gap = n > 0 && f->value[n - 1] != ',';
+                } else 
+                {
+                    // Blanks only around the commas of an array, never inside a token
+                    if (gap && *p != ',') return -1;
+                    gap = false;
+                    if (n + 1 == sizeof(f->value)) return -1;
+                    f->value[n++] = *p;
+                }
+                p++;
+            }
+
+            f->value[n] = '\0';
+            if (f->kind == JSON_ARRAY && *p++ != ']') return -1;
+            if (!json_token_valid(f->kind, f->value)) return -1;
+        }
+
+        p = skip_blanks(p);
+        if (*p == '}') break;
+        if (*p++ != ',') return -1;
+        p = skip_blanks(p);
+    }
+
+    return *skip_blanks(p + 1) ? -1 : count;
+}
+
+static const JsonField *json_field(const JsonField *fields, int count, const char *key)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!strcmp(fields[i].key, key)) return &fields[i];
+    }
+
+    return NULL;
+}
+
+// String member, NULL when absent or not a string
+static const char *json_text(const JsonField *fields, int count, const char *key)
+{
+    const JsonField *f = json_field(fields, count, key);
+    return f && f->kind == JSON_STRING ? f->value : NULL;
+}
+
+static void json_string(FILE *out, const char *s, size_t len)
+{
+    fputc('"', out);
+
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c == '\n') fputs("\\n", out);
+        else if (c == '\t') fputs("\\t", out);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+
+    fputc('"', out);
+}
+
+// Everything fprintf'd to a memory stream, handed back as one JSON string
+static void json_stream(FILE *out, char *buf, size_t len)
+{
+    json_string(out, buf ? buf : "", buf ? len : 0);
+    free(buf);
+}
+
+// {"op": "params"}, every parameter with its row count, sorted like the prompt
+static const char *serve_params(Server *srv, FILE *body)
+{
+    const ParamTable *params = srv->ds->params;
+
+    fputs("\"params\":[", body);
+    for (size_t i = 0; i < params->len; i++)
+    {
+        const char *name = srv->names[i];
+        int32_t id = param_lookup(params, name, strlen(name));
+
+        fputs(i ? ",{\"name\":" : "{\"name\":", body);
+        json_string(body, name, strlen(name));
+        fprintf(body, ",\"rows\":%zu}", params->counts[id]);
+    }
+    fputc(']', body);
+
+    return NULL;
+}
+
+// {"op": "search", "text": "pm25", "limit": 10}, names containing the text or close to it, best first
+static const char *serve_search(Server *srv, const JsonField *fields, int count, FILE *body)
+{
+    const char *text = json_text(fields, count, "text");
+    const JsonField *limit = json_field(fields, count, "limit");
+    long long cap = limit ? atoll(limit->value) : 10;
+
+    if (text == NULL) return "text is required";
+    if (srv->vocab == NULL) return "no search index";
+    if (cap < 1) cap = 1;
+    if (cap > 1000) cap = 1000;
+
+    NgramMatch *matches = malloc(cap * sizeof(*matches));
+    if (matches == NULL) return "out of memory";
+
+    size_t found = ngram_search(srv->vocab, text, strlen(text), matches, (size_t)cap);
+
+    fputs("\"matches\":[", body);
+    for (size_t i = 0; i < found; i++)
+    {
+        uint32_t id = matches[i].id;
+        fprintf(body, "%s{\"field\":\"%s\",\"name\":", i ? "," : "", AQS_FIELDS[srv->vocab_fields[id]].name);
+        json_string(body, srv->vocab->names[id], srv->vocab->lens[id]);
+        fprintf(body, ",\"distance\":%d}", matches[i].distance);
+    }
+    fputc(']', body);
+
+    free(matches);
+    return NULL;
+}
+
+// Site and time indexes cover every row, the first query needing one builds it for all
+static SiteIndex *serve_sites(Server *srv)
+{
+    pthread_mutex_lock(&srv->index_lock);
+    if (srv->sites == NULL) srv->sites = site_index_build(srv->ds->cols);
+    pthread_mutex_unlock(&srv->index_lock);
+    return srv->sites;
+}
+
+static TimeIndex *serve_times(Server *srv, int field)
+{
+    pthread_mutex_lock(&srv->index_lock);
+    if (srv->times[field] == NULL) srv->times[field] = time_index_build(srv->ds->cols, field);
+    pthread_mutex_unlock(&srv->index_lock);
+    return srv->times[field];
+}
+
+// Narrow the sorted rows[0 .. *n) to the sites of near / bbox, in place
+static const char *serve_spatial(Server *srv, const JsonField *fields, int count, uint32_t *rows, size_t *n, FILE *body)
+{
+    const JsonField *near = json_field(fields, count, "near");
+    const JsonField *bbox = json_field(fields, count, "bbox");
+    const JsonField *radius = json_field(fields, count, "radius_km");
+    double lat, lon, km = radius ? atof(radius->value) : 25, b[4];
+    int used = 0;
+
+    if (near && (near->kind != JSON_ARRAY || sscanf(near->value, "%lf,%lf%n", &lat, &lon, &used) != 2 || near->value[used]))
+    {
+        return "near must be [lat, lon]";
+    }
+
+    if (bbox && (bbox->kind != JSON_ARRAY || sscanf(bbox->value, "%lf,%lf,%lf,%lf%n", &b[0], &b[1], &b[2], &b[3], &used) != 4 || bbox->value[used]))
+    {
+        return "bbox must be [lat_min, lon_min, lat_max, lon_max]";
+    }
+
+    if (!(km >= 0)) return "radius_km must be a number >= 0";
+
+    SiteIndex *index = serve_sites(srv);
+    if (index == NULL) return "could not build the site index";
+
+    uint32_t *sites = malloc((index->count ? index->count : 1) * sizeof(*sites));
+    uint32_t *out = malloc((*n ? *n : 1) * sizeof(*out));
+    if (sites == NULL || out == NULL)
+    {
+        free(sites);
+        free(out);
+        return "out of memory";
+    }
+
+    size_t found = near ? site_near(index, lat, lon, km, sites) : site_bbox(index, b[0], b[1], b[2], b[3], sites);
+    size_t kept = 0;
+
+    for (size_t i = 0; i < found; i++)
+    {
+        kept += site_keep(index, sites[i], rows, *n, out + kept);
+    }
+
+    qsort(out, kept, sizeof(*out), comp_row);
+    memcpy(rows, out, kept * sizeof(*out));
+    *n = kept;
+    fprintf(body, "\"sites\":%zu,", found);
+
+    free(sites);
+    free(out);
+    return NULL;
+}
+
+// {"op": "query", "param": ..., "where": ..., "near": [lat, lon], "radius_km": .., "bbox": [..], "time": ..,
+//  "top": K, "by": .., "group": .., "agg": .., "limit": N}, the same steps as the command line in the same order
+// There is no "export", a client must not be able to write files with the server's privileges
+static const char *serve_query(Server *srv, const JsonField *fields, int count, FILE *body)
+{
+    const Dataset *ds = srv->ds;
+    const char *param = json_text(fields, count, "param");
+    const char *where = json_text(fields, count, "where");
+    const char *time = json_text(fields, count, "time");
+    const char *group = json_text(fields, count, "group");
+    const char *agg = json_text(fields, count, "agg");
+    const JsonField *limit = json_field(fields, count, "limit");
+    const JsonField *top = json_field(fields, count, "top");
+    const char *by = json_text(fields, count, "by");
+
+    if (param == NULL) return "param is required";
+    if (json_field(fields, count, "export")) return "export is not available over --serve";
+
+    int32_t id = param_lookup(ds->params, param, strlen(param));
+    if (id < 0) return "unknown parameter";
+
+    // A private copy of the parameter's rows, every step narrows it in place
+    size_t n;
+    const uint32_t *param_rows = dataset_param_rows(ds, id, &n);
+    uint32_t *rows = malloc((n ? n : 1) * sizeof(*rows));
+    if (rows == NULL) return "out of memory";
+    memcpy(rows, param_rows, n * sizeof(*rows));
+
+    const char *error = NULL;
+
+    if (where)
+    {
+        Filter *filter = filter_compile(where);
+        int64_t kept = filter ? filter_columns(filter, ds->cols, rows, n) : -1;
+        if (filter == NULL) error = "bad where expression";
+        else if (kept < 0) error = "out of memory";
+        else n = (size_t)kept;
+        free(filter);
+    }
+
+    if (error == NULL && (json_field(fields, count, "near") || json_field(fields, count, "bbox")))
+    {
+        error = serve_spatial(srv, fields, count, rows, &n, body);
+    }
+
+    if (error == NULL && time)
+    {
+        int field;
+        int64_t start, end;
+        TimeIndex *index = NULL;
+        uint32_t *out = NULL;
+
+        if (time_spec_parse(time, &field, &start, &end) != 0) error = "bad time range";
+        else if ((index = serve_times(srv, field)) == NULL) error = "could not build the time index";
+        else if ((out = malloc((n ? n : 1) * sizeof(*out))) == NULL) error = "out of memory";
+        else
+        {
+            n = time_keep(index, start, end, rows, n, out);
+            memcpy(rows, out, n * sizeof(*out));
+        }
+
+        free(out);
+    }
+
+    // Rank order from here on, the workers' own thread is the only one used
+    if (error == NULL && (top || by))
+    {
+        long long k = top ? atoll(top->value) : 0;
+        int field = by ? field_index(by, strlen(by)) : -1;
+        uint32_t *ranked = NULL;
+
+        if (k < 1 || field < 0 || column_text(AQS_FIELDS[field].type)) error = "top needs a count and by a numeric column";
+        else if ((ranked = top_rows(ds->cols, rows, &n, field, (size_t)k, 1)) == NULL) error = "out of memory";
+        else memcpy(rows, ranked, n * sizeof(*rows));
+
+        free(ranked);
+    }
+
+    if (error == NULL) fprintf(body, "\"rows\":%zu", n);
+
+    // Groups and rows travel as CSV text, the same bytes the command line prints
+    if (error == NULL && group)
+    {
+        GroupSpec spec;
+        GroupTable *groups = NULL;
+        char *csv = NULL;
+        size_t csv_len = 0;
+        FILE *out = NULL;
+
+        if (parse_group_spec(group, agg, &spec) != 0) error = "bad group or agg";
+        else if ((groups = group_rows(ds->cols, rows, n, &spec, 1)) == NULL) error = "group-by failed";
+        else if ((out = open_memstream(&csv, &csv_len)) == NULL) error = "out of memory";
+        else
+        {
+            fprintf(body, ",\"groups\":%zu,\"csv\":", groups->len);
+            group_print(groups, out);
+            fclose(out);
+            json_stream(body, csv, csv_len);
+        }
+
+        group_table_free(groups);
+    } else if (error == NULL && limit)
+    {
+        long long want = atoll(limit->value);
+        char *csv = NULL;
+        size_t csv_len = 0;
+        FILE *out = open_memstream(&csv, &csv_len);
+
+        if (out == NULL) error = "out of memory";
+        else
+        {
+            write_rows_csv(out, ds->cols, rows, want < 0 ? 0 : (size_t)want < n ? (size_t)want : n);
+            fclose(out);
+            fputs(",\"csv\":", body);
+            json_stream(body, csv, csv_len);
+        }
+    }
+
+    free(rows);
+    return error;
+}
+
+// Answer one request line as one JSON line, {"id": .., "ok": true, ...} or {"id": .., "ok": false, "error": ..}
+static void serve_request(Server *srv, const char *line, FILE *out)
+{
+    double start = now_seconds();
+    JsonField *fields = malloc(MAX_JSON_FIELDS * sizeof(*fields));
+    int count = fields ? json_parse(line, fields, MAX_JSON_FIELDS) : -1;
+    const JsonField *id = count > 0 ? json_field(fields, count, "id") : NULL;
+    const char *op = count > 0 ? json_text(fields, count, "op") : NULL;
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *body = open_memstream(&buf, &len);
+    const char *error = NULL;
+
+    if (body == NULL) error = "out of memory";
+    else if (count < 0) error = "expected one JSON object per line";
+    else if (id && id->kind != JSON_STRING && id->kind != JSON_NUMBER) error = "id must be a string or a number";
+    else if (op == NULL) error = "op is required";
+    else if (!strcmp(op, "params")) error = serve_params(srv, body);
+    else if (!strcmp(op, "query")) error = serve_query(srv, fields, count, body);
+    else if (!strcmp(op, "search")) error = serve_search(srv, fields, count, body);
+    else error = "unknown op (params, query or search)";
+
+    if (body) fclose(body);
+
+    // The id is echoed so clients can match replies to requests answered out of order
+    // Only strings and numbers are echoed, anything else comes back as null
+    fputs("{\"id\":", out);
+    if (id && id->kind == JSON_STRING) json_string(out, id->value, strlen(id->value));
+    else if (id && id->kind == JSON_NUMBER) fputs(id->value, out);
+    else fputs("null", out);
+
+    if (error)
+    {
+        fputs(",\"ok\":false,\"error\":", out);
+        json_string(out, error, strlen(error));
+    } else 
+    {
+        fputs(",\"ok\":true", out);
+        if (len > 0) fprintf(out, ",%.*s", (int)len, buf);
+    }
+
+    fprintf(out, ",\"ms\":%.3f}\n", (now_seconds() - start) * 1e3);
+    free(buf);
+    free(fields);
+}
+
+static void client_release(ServeClient *client)
+{
+    pthread_mutex_lock(&client->lock);
+    bool last = --client->refs == 0;
+    pthread_cond_signal(&client->drained);
+    pthread_mutex_unlock(&client->lock);
+
+    if (!last) return;
+
+    // stdin / stdout belong to the process, a socket closes with its last reply
+    if (client->in != stdin)
+    {
+        fclose(client->in);
+        close(client->out);
+    }
+    pthread_mutex_destroy(&client->lock);
+    pthread_cond_destroy(&client->drained);
+    free(client);
+}
+
+static void *serve_worker(void *arg)
+{
+    Server *srv = arg;
+
+    while (true)
+    {
+        pthread_mutex_lock(&srv->lock);
+        while (srv->head == NULL && !srv->stopping) pthread_cond_wait(&srv->ready, &srv->lock);
+
+        ServeJob *job = srv->head;
+        if (job == NULL)
+        {
+            pthread_mutex_unlock(&srv->lock);
+            return NULL;
+        }
+
+        srv->head = job->next;
+        if (srv->head == NULL) srv->tail = NULL;
+        pthread_mutex_unlock(&srv->lock);
+
+        char *reply = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&reply, &len);
+
+        if (out)
+        {
+            serve_request(srv, job->line, out);
+            fclose(out);
+
+            // A client that went away just loses its reply
+            pthread_mutex_lock(&job->client->lock);
+            for (size_t done = 0; done < len; )
+            {
+                ssize_t w = write(job->client->out, reply + done, len - done);
+                if (w <= 0 && errno != EINTR) break;
+                if (w > 0) done += w;
+            }
+            pthread_mutex_unlock(&job->client->lock);
+        }
+
+        free(reply);
+        free(job->line);
+        client_release(job->client);
+        free(job);
+
+        pthread_mutex_lock(&srv->lock);
+        if (--srv->pending == 0) pthread_cond_broadcast(&srv->idle);
+        pthread_mutex_unlock(&srv->lock);
+    }
+}
+
+// Queue every non-blank line of the client until it closes, the client is released at the end
+static void serve_read(Server *srv, ServeClient *client)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &cap, client->in)) > 0)
+    {
+        if (*skip_blanks(line) == '\0') continue;
+
+        ServeJob *job = malloc(sizeof(*job));
+        if (job == NULL || (job->line = malloc(len + 1)) == NULL)
+        {
+            perror("Failed to queue request");
+            free(job);
+            continue;
+        }
+
+        memcpy(job->line, line, len + 1);
+        job->client = client;
+        job->next = NULL;
+
+        // A client sending faster than it is answered waits here, the queue stays bounded
+        pthread_mutex_lock(&client->lock);
+        while (client->refs > SERVE_CLIENT_JOBS) pthread_cond_wait(&client->drained, &client->lock);
+        client->refs++;
+        pthread_mutex_unlock(&client->lock);
+
+        pthread_mutex_lock(&srv->lock);
+        if (srv->tail) srv->tail->next = job; else srv->head = job;
+        srv->tail = job;
+        srv->pending++;
+        pthread_cond_signal(&srv->ready);
+        pthread_mutex_unlock(&srv->lock);
+    }
+
+    free(line);
+    client_release(client);
+}
+
+static void *serve_connection(void *arg)
+{
+    ServeConnection *conn = arg;
+    Server *srv = conn->server;
+    serve_read(srv, conn->client);
+    free(conn);
+
+    pthread_mutex_lock(&srv->lock);
+    srv->clients--;
+    pthread_cond_signal(&srv->slot);
+    pthread_mutex_unlock(&srv->lock);
+    return NULL;
+}
+
+static ServeClient *client_create(FILE *in, int out)
+{
+    ServeClient *client = calloc(1, sizeof(*client));
+    if (client == NULL) return NULL;
+
+    client->in = in;
+    client->out = out;
+    client->refs = 1;
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->drained, NULL);
+    return client;
+}
+
+// Accept connections until the process is stopped, each gets a reader thread feeding the pool
+static int serve_socket(Server *srv, const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    // A stale socket from an earlier run would make bind fail
+    // Created 0600, only the owner can connect
+    unlink(path);
+    mode_t mask = umask(0177);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+
+    if (bound != 0 || listen(fd, 64) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    // Writing to a client that hung up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Serving %zu rows on %s\n", srv->ds->cols->len, path);
+
+    while (true)
+    {
+        // Further connections stay in the listen backlog until one closes
+        pthread_mutex_lock(&srv->lock);
+        while (srv->clients >= SERVE_MAX_CLIENTS) pthread_cond_wait(&srv->slot, &srv->lock);
+        pthread_mutex_unlock(&srv->lock);
+
+        int conn_fd = accept(fd, NULL, NULL);
+        if (conn_fd < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        // Reading and writing go through separate descriptors so each side closes on its own
+        int out_fd = dup(conn_fd);
+        FILE *in = out_fd >= 0 ? fdopen(conn_fd, "r") : NULL;
+        ServeClient *client = in ? client_create(in, out_fd) : NULL;
+        ServeConnection *conn = client ? malloc(sizeof(*conn)) : NULL;
+        pthread_t tid;
+
+        if (conn)
+        {
+            conn->server = srv;
+            conn->client = client;
+        }
+
+        // Counted before the thread starts, it may be done before pthread_create returns
+        pthread_mutex_lock(&srv->lock);
+        srv->clients++;
+        pthread_mutex_unlock(&srv->lock);
+
+        if (conn == NULL || pthread_create(&tid, NULL, serve_connection, conn) != 0)
+        {
+            perror("Failed to start connection");
+            pthread_mutex_lock(&srv->lock);
+            srv->clients--;
+            pthread_mutex_unlock(&srv->lock);
+            free(conn);
+            if (client)
+            {
+                client_release(client);
+            } else 
+            {
+                if (in) fclose(in); else close(conn_fd);
+                if (out_fd >= 0) close(out_fd);
+            }
+            continue;
+        }
+
+        pthread_detach(tid);
+    }
+
+    close(fd);
+    unlink(path);
+    return -1;
+}
+
+// Every parameter name plus the distinct values of the name columns, tagged with their field
+static int serve_vocabulary(Server *srv)
+{
+    static const int name_fields[] = {48, 51, 52, 53, 12};  // local_site_name, county_name, city_name, cbsa_name, method_name
+    const Dataset *ds = srv->ds;
+    size_t total = ds->params->len;
+
+    for (size_t i = 0; i < sizeof(name_fields) / sizeof(name_fields[0]); i++)
+    {
+        total += ds->cols->cols[name_fields[i]].dict_len;
+    }
+
+    const char **names = malloc((total ? total : 1) * sizeof(*names));
+    size_t *lens = malloc((total ? total : 1) * sizeof(*lens));
+    srv->vocab_fields = malloc((total ? total : 1) * sizeof(*srv->vocab_fields));
+
+    if (names == NULL || lens == NULL || srv->vocab_fields == NULL)
+    {
+        free(names);
+        free(lens);
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < ds->params->len; i++)
+    {
+        names[n] = srv->names[i];
+        lens[n] = strlen(srv->names[i]);
+        srv->vocab_fields[n++] = 8;
+    }
+
+    // Straight out of the dictionary pools, empty values are left out
+    for (size_t i = 0; i < sizeof(name_fields) / sizeof(name_fields[0]); i++)
+    {
+        const Column *col = &ds->cols->cols[name_fields[i]];
+        for (size_t k = 0; k < col->dict_len; k++)
+        {
+            if (col->offsets[k + 1] == col->offsets[k]) continue;
+            names[n] = col->blob + col->offsets[k];
+            lens[n] = col->offsets[k + 1] - col->offsets[k];
+            srv->vocab_fields[n++] = name_fields[i];
+        }
+    }
+
+    srv->vocab = ngram_index_build(names, lens, n);
+    free(names);
+    free(lens);
+    return srv->vocab ? 0 : -1;
+}
+
+int serve(const Dataset *ds, const Options *opts)
+{
+    Server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.ds = ds;
+    srv.names = malloc((ds->params->len ? ds->params->len : 1) * sizeof(*srv.names));
+
+    if (srv.names == NULL)
+    {
+        perror("Failed to allocate parameter names");
+        return -1;
+    }
+
+    if (ds->params->len > 0) memcpy(srv.names, ds->params->names, ds->params->len * sizeof(*srv.names));
+    qsort(srv.names, ds->params->len, sizeof(*srv.names), comp);
+
+    // Search also without it, queries by name just fail
+    if (serve_vocabulary(&srv) != 0) fprintf(stderr, "Could not build the search index\n");
+
+    pthread_mutex_init(&srv.index_lock, NULL);
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.ready, NULL);
+    pthread_cond_init(&srv.idle, NULL);
+    pthread_cond_init(&srv.slot, NULL);
+
+    int workers = opts->threads;
+    pthread_t *tids = malloc(workers * sizeof(*tids));
+    int started = 0;
+
+    while (tids && started < workers && pthread_create(&tids[started], NULL, serve_worker, &srv) == 0)
+    {
+        started++;
+    }
+
+    int status = -1;
+    if (started == 0)
+    {
+        perror("Failed to start workers");
+    } else if (opts->socket_path)
+    {
+        status = serve_socket(&srv, opts->socket_path);
+    } else 
+    {
+        // stdin until end of input, then every queued request is answered before exiting
+        ServeClient *client = client_create(stdin, STDOUT_FILENO);
+        if (client)
+        {
+            fprintf(stderr, "Serving %zu rows on stdin\n", ds->cols->len);
+            serve_read(&srv, client);
+            status = 0;
+        }
+
+        pthread_mutex_lock(&srv.lock);
+        while (srv.pending > 0) pthread_cond_wait(&srv.idle, &srv.lock);
+        pthread_mutex_unlock(&srv.lock);
+    }
+
+    pthread_mutex_lock(&srv.lock);
+    srv.stopping = true;
+    pthread_cond_broadcast(&srv.ready);
+    pthread_mutex_unlock(&srv.lock);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+
+    ngram_index_free(srv.vocab);
+    free(srv.vocab_fields);
+    site_index_free(srv.sites);
+    for (int f = 0; f < MAX_FIELDS; f++)
+    {
+        time_index_free(srv.times[f]);
+    }
+
+    pthread_mutex_destroy(&srv.index_lock);
+    pthread_mutex_destroy(&srv.lock);
+    pthread_cond_destroy(&srv.ready);
+    pthread_cond_destroy(&srv.idle);
+    pthread_cond_destroy(&srv.slot);
+    free(tids);
+    free(srv.names);
+    return status;
+}
+
+#else
+
+int serve(const Dataset *ds, const Options *opts)
+{
+    fprintf(stderr, "--serve needs POSIX threads and sockets\n");
+    return -1;
+}
+
+#endif
+
+// * N-gram search * //
+
+// Byte as the index sees it, quotes are dropped
+static inline int ngram_char(char c)
+{
+    return c == '"' ? -1 : tolower((unsigned char)c);
+}
+
+// Lowercased, quote-free copy of up to cap bytes of s, returns its length
+static size_t ngram_normalize(const char *s, size_t len, char *out, size_t cap)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len && n < cap; i++)
+    {
+        int c = ngram_char(s[i]);
+        if (c >= 0) out[n++] = (char)c;
+    }
+
+    return n;
+}
+
+static inline uint32_t ngram_key(const char *p)
+{
+    return (uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 | (unsigned char)p[2];
+}
+
+static int comp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+NgramIndex *ngram_index_build(const char *const *names, const size_t *lens, size_t count)
+{
+    NgramIndex *index = calloc(1, sizeof(*index));
+    if (index == NULL) return NULL;
+
+    index->count = count;
+    index->names = malloc((count ? count : 1) * sizeof(*index->names));
+    index->lens = malloc((count ? count : 1) * sizeof(*index->lens));
+
+    size_t total = 0;
+    for (size_t i = 0; index->lens && i < count; i++)
+    {
+        index->lens[i] = lens ? lens[i] : strlen(names[i]);
+        total += index->lens[i];
+    }
+
+    // One (trigram, id) pair per position of " name ", sorted and deduplicated into the posting lists
+    uint64_t *pairs = malloc((total ? total : 1) * sizeof(*pairs));
+    char *padded = malloc(MAX_LENGTH + 2);
+
+    if (index->names == NULL || index->lens == NULL || pairs == NULL || padded == NULL)
+    {
+        free(pairs);
+        free(padded);
+        ngram_index_free(index);
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        index->names[i] = names[i];
+
+        size_t len = ngram_normalize(names[i], index->lens[i], padded + 1, MAX_LENGTH);
+        padded[0] = ' ';
+        padded[len + 1] = ' ';
+
+        for (size_t j = 0; j + 3 <= len + 2; j++)
+        {
+            pairs[n++] = (uint64_t)ngram_key(padded + j) << 32 | i;
+        }
+    }
+
+    qsort(pairs, n, sizeof(*pairs), comp_u64);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == 0 || pairs[i] != pairs[i - 1]) pairs[unique++] = pairs[i];
+    }
+
+    size_t keys = 0;
+    for (size_t i = 0; i < unique; i++)
+    {
+        if (i == 0 || pairs[i] >> 32 != pairs[i - 1] >> 32) keys++;
+    }
+
+    index->keys = malloc((keys ? keys : 1) * sizeof(*index->keys));
+    index->starts = malloc((keys + 1) * sizeof(*index->starts));
+    index->ids = malloc((unique ? unique : 1) * sizeof(*index->ids));
+
+    if (index->keys && index->starts && index->ids)
+    {
+        for (size_t i = 0; i < unique; i++)
+        {
+            uint32_t key = pairs[i] >> 32;
+            if (i == 0 || key != index->keys[index->key_count - 1])
+            {
+                index->keys[index->key_count] = key;
+                index->starts[index->key_count++] = i;
+            }
+            index->ids[i] = (uint32_t)pairs[i];
+        }
+        index->starts[index->key_count] = unique;
+    }
+
+    free(pairs);
+    free(padded);
+
+    if (index->keys == NULL || index->starts == NULL || index->ids == NULL)
+    {
+        ngram_index_free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+void ngram_index_free(NgramIndex *index)
+{
+    if (index == NULL) return;
+
+    free(index->names);
+    free(index->lens);
+    free(index->keys);
+    free(index->starts);
+    free(index->ids);
+    free(index);
+}
+
+// Fewest edits turning q into some substring of name (semi-global Levenshtein, name ends are free)
+static int substring_distance(const char *q, size_t m, const char *name, size_t len)
+{
+    int row[NGRAM_MAX_QUERY + 1];
+
+    for (size_t i = 0; i <= m; i++) row[i] = (int)i;
+    int best = row[m];
+
+    for (size_t j = 0; j < len; j++)
+    {
+        int c = ngram_char(name[j]);
+        if (c < 0) continue;
+
+        // row[i] becomes the cost of q[0 .. i) ending at name[j], starting anywhere
+        int diag = row[0];
+        row[0] = 0;
+
+        for (size_t i = 1; i <= m; i++)
+        {
+            int up = row[i];
+            int v = diag + ((unsigned char)q[i - 1] != c);
+            if (up + 1 < v) v = up + 1;
+            if (row[i - 1] + 1 < v) v = row[i - 1] + 1;
+            diag = up;
+            row[i] = v;
+        }
+
+        if (row[m] < best) best = row[m];
+    }
+
+    return best;
+}
+
+// Whether the normalized name starts with q
+static bool ngram_prefix(const char *q, size_t m, const char *name, size_t len)
+{
+    size_t i = 0;
+
+    for (size_t j = 0; j < len && i < m; j++)
+    {
+        int c = ngram_char(name[j]);
+        if (c < 0) continue;
+        if (c != (unsigned char)q[i++]) return false;
+    }
+
+    return i == m;
+}
+
+// Whether match x ranks before y
+static bool match_before(const NgramIndex *index, const NgramMatch *x, const NgramMatch *y)
+{
+    if (x->distance != y->distance) return x->distance < y->distance;
+    if (x->prefix != y->prefix) return x->prefix;
+    if (index->lens[x->id] != index->lens[y->id]) return index->lens[x->id] < index->lens[y->id];
+    return x->id < y->id;
+}
+
+// Keep out[0 .. *n) the best cap matches so far, best first
+static void match_insert(const NgramIndex *index, NgramMatch *out, size_t *n, size_t cap, const NgramMatch *match)
+{
+    if (*n == cap && !match_before(index, match, &out[cap - 1])) return;
+
+    size_t i = *n < cap ? (*n)++ : cap - 1;
+    while (i > 0 && match_before(index, match, &out[i - 1]))
+    {
+        out[i] = out[i - 1];
+        i--;
+    }
+    out[i] = *match;
+}
+
+size_t ngram_search(const NgramIndex *index, const char *query, size_t len, NgramMatch *out, size_t cap)
+{
+    char q[NGRAM_MAX_QUERY];
+    size_t m = ngram_normalize(query, len, q, sizeof(q));
+    size_t found = 0;
+
+    if (index == NULL || m == 0 || cap == 0) return 0;
+
+    // About one typo per four characters, none for very short queries
+    int limit = (int)(m / 4);
+
+    // Too short for a trigram, every name is a candidate for plain containment
+    if (m < 3)
+    {
+        for (size_t id = 0; id < index->count; id++)
+        {
+            NgramMatch match = {(uint32_t)id, 0, false};
+            if (substring_distance(q, m, index->names[id], index->lens[id]) != 0) continue;
+
+            match.prefix = ngram_prefix(q, m, index->names[id], index->lens[id]);
+            match_insert(index, out, &found, cap, &match);
+        }
+        return found;
+    }
+
+    // q has m - 2 trigrams, a substring within limit edits still shares all but 3 per edit
+    size_t grams = m - 2;
+    size_t need = grams > (size_t)limit * 3 ? grams - (size_t)limit * 3 : 1;
+
+    uint16_t *hits = calloc(index->count ? index->count : 1, sizeof(*hits));
+    uint32_t *touched = malloc((index->count ? index->count : 1) * sizeof(*touched));
+    size_t touched_count = 0;
+
+    if (hits == NULL || touched == NULL)
+    {
+        free(hits);
+        free(touched);
+        return 0;
+    }
+
+    for (size_t g = 0; g < grams; g++)
+    {
+        // A trigram repeated in the query is only counted once
+        uint32_t key = ngram_key(q + g);
+        bool repeat = false;
+        for (size_t k = 0; k < g && !repeat; k++) repeat = ngram_key(q + k) == key;
+        if (repeat) continue;
+
+        size_t lo = 0, hi = index->key_count;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (index->keys[mid] < key) lo = mid + 1; else hi = mid;
+        }
+        if (lo == index->key_count || index->keys[lo] != key) continue;
+
+        for (size_t p = index->starts[lo]; p < index->starts[lo + 1]; p++)
+        {
+            uint32_t id = index->ids[p];
+            if (hits[id]++ == 0) touched[touched_count++] = id;
+        }
+    }
+
+    // Only names sharing enough trigrams are scored
+    for (size_t t = 0; t < touched_count; t++)
+    {
+        uint32_t id = touched[t];
+        if (hits[id] < need) continue;
+
+        NgramMatch match = {id, substring_distance(q, m, index->names[id], index->lens[id]), false};
+        if (match.distance > limit) continue;
+
+        match.prefix = ngram_prefix(q, m, index->names[id], index->lens[id]);
+        match_insert(index, out, &found, cap, &match);
+    }
+
+    free(hits);
+    free(touched);
+    return found;
+}
+
+// * Quantile sketches * //
+
+// k1 scale function, centroids near the tails stay small so extreme quantiles keep their accuracy
+static double tdigest_k(double q)
+{
+    return TDIGEST_DELTA / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static double tdigest_k_inverse(double k)
+{
+    if (k >= TDIGEST_DELTA / 4.0) return 1;
+    return (sin(k * 2 * M_PI / TDIGEST_DELTA) + 1) / 2;
+}
+
+static int tdigest_reserve(TDigest *digest, size_t cap)
+{
+    if (cap <= digest->cap) return 0;
+
+    Centroid *centroids = realloc(digest->centroids, cap * sizeof(*centroids));
+    if (centroids == NULL) return -1;
+
+    digest->centroids = centroids;
+    digest->cap = cap;
+    return 0;
+}
+
+static int comp_centroid(const void *a, const void *b)
+{
+    double x = ((const Centroid *)a)->mean, y = ((const Centroid *)b)->mean;
+    return x < y ? -1 : x > y;
+}
+
+// Sort every centroid by mean and merge neighbours while the merged one stays within the scale limit
+static void tdigest_compress(TDigest *digest)
+{
+    if (digest->sorted == digest->len) return;
+
+    Centroid *c = digest->centroids;
+    qsort(c, digest->len, sizeof(*c), comp_centroid);
+
+    size_t out = 0;
+    double before = 0;  // weight of the centroids already closed
+    double limit = digest->total * tdigest_k_inverse(tdigest_k(0) + 1);
+
+    for (size_t i = 1; i < digest->len; i++)
+    {
+        if (before + c[out].weight + c[i].weight <= limit)
+        {
+            double merged = c[out].weight + c[i].weight;
+            c[out].mean += (c[i].mean - c[out].mean) * c[i].weight / merged;
+            c[out].weight = merged;
+        } else 
+        {
+            before += c[out].weight;
+            limit = digest->total * tdigest_k_inverse(tdigest_k(before / digest->total) + 1);
+            c[++out] = c[i];
+        }
+    }
+
+    digest->len = digest->len ? out + 1 : 0;
+    digest->sorted = digest->len;
+}
+
+void tdigest_add(TDigest *digest, double mean, double weight)
+{
+    if (!(weight > 0) || isnan(mean)) return;
+
+    if (digest->len == digest->cap)
+    {
+        // Room for a full buffer on top of a compressed digest, grown only as far as needed
+        if (digest->len >= TDIGEST_BUFFER + 2 * TDIGEST_DELTA) tdigest_compress(digest);
+        if (digest->len == digest->cap && tdigest_reserve(digest, digest->cap ? digest->cap * 2 : 16) != 0) return;
+    }
+
+    if (digest->total == 0 || mean < digest->min) digest->min = mean;
+    if (digest->total == 0 || mean > digest->max) digest->max = mean;
+
+    digest->centroids[digest->len++] = (Centroid){mean, weight};
+    digest->total += weight;
+}
+
+void tdigest_merge(TDigest *dst, const TDigest *src)
+{
+    if (src->total == 0) return;
+
+    double min = dst->total ? fmin(dst->min, src->min) : src->min;
+    double max = dst->total ? fmax(dst->max, src->max) : src->max;
+
+    for (size_t i = 0; i < src->len; i++)
+    {
+        tdigest_add(dst, src->centroids[i].mean, src->centroids[i].weight);
+    }
+
+    // The extremes may lie beyond every centroid mean
+    dst->min = min;
+    dst->max = max;
+}
+
+void tdigest_free(TDigest *digest)
+{
+    free(digest->centroids);
+    memset(digest, 0, sizeof(*digest));
+}
+
+double tdigest_quantile(TDigest *digest, double q)
+{
+    tdigest_compress(digest);
+
+    size_t n = digest->len;
+    const Centroid *c = digest->centroids;
+    if (n == 0) return NAN;
+    if (n == 1) return c[0].mean;
+
+    double target = q * digest->total;
+
+    // Between the minimum and the first centroid's centre
+    if (target <= c[0].weight / 2) return digest->min + (c[0].mean - digest->min) * target / (c[0].weight / 2);
+
+    // Linear between neighbouring centroid centres
+    double cum = 0;
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        double left = cum + c[i].weight / 2;
+        double right = cum + c[i].weight + c[i + 1].weight / 2;
+
+        if (target <= right) return c[i].mean + (c[i + 1].mean - c[i].mean) * (target - left) / (right - left);
+        cum += c[i].weight;
+    }
+
+    // Past the last centre, up to the maximum
+    double left = digest->total - c[n - 1].weight / 2;
+    return c[n - 1].mean + (digest->max - c[n - 1].mean) * (target - left) / (c[n - 1].weight / 2);
+}
+
+bool tdigest_add_row(TDigest *digest, const AQSColumns *cols, uint32_t row)
+{
+    // percentile_10 .. percentile_99 in ascending order, then first_max_value closes the top
+    static const int knot_fields[] = {47, 46, 45, 44, 43, 42, 41};
+    static const double knot_q[] = {0.10, 0.50, 0.75, 0.90, 0.95, 0.98, 0.99};
+    enum { KNOTS = sizeof(knot_fields) / sizeof(knot_fields[0]) };
+
+    double count, mean, max, v[KNOTS];
+    if (!column_number(&cols->cols[16], row, &count) || !(count > 0)) return false;
+
+    for (int k = 0; k < KNOTS; k++)
+    {
+        if (!column_number(&cols->cols[knot_fields[k]], row, &v[k])) return false;
+        if (k > 0 && v[k] < v[k - 1]) return false;
+    }
+
+    // Between two knots the observations are taken as spread evenly, a centroid at the middle
+    double sum = 0;
+    for (int k = 0; k + 1 < KNOTS; k++)
+    {
+        double w = (knot_q[k + 1] - knot_q[k]) * count;
+        tdigest_add(digest, (v[k] + v[k + 1]) / 2, w);
+        sum += w * (v[k] + v[k + 1]) / 2;
+    }
+
+    // Top 1% between percentile_99 and the year's maximum when it is known
+    bool has_max = column_number(&cols->cols[29], row, &max) && max >= v[KNOTS - 1];
+    double top = has_max ? (v[KNOTS - 1] + max) / 2 : v[KNOTS - 1];
+    tdigest_add(digest, top, 0.01 * count);
+    sum += 0.01 * count * top;
+
+    // The bottom 10% has no lower knot, it is placed where it keeps the row's arithmetic mean
+    // Kept within one p10 - p50 gap below percentile_10 so a skewed mean cannot drag it far
+    double low = 0.10 * count;
+    double bottom = v[0];
+    if (column_number(&cols->cols[27], row, &mean))
+    {
+        bottom = (mean * count - sum) / low;
+        if (bottom > v[0]) bottom = v[0];
+        if (bottom < 2 * v[0] - v[1]) bottom = 2 * v[0] - v[1];
+    }
+    tdigest_add(digest, bottom, low);
+
+    if (has_max && max > digest->max) digest->max = max;
+    return true;
+}
+
+// * Top-K * //
+
+// a ranks before b: higher value, then lower site key, then earlier row
+static bool top_before(const TopEntry *a, const TopEntry *b)
+{
+    if (a->value != b->value) return a->value > b->value;
+
+    int c = strcmp(a->site, b->site);
+    if (c != 0) return c < 0;
+
+    return a->seq < b->seq;
+}
+
+static int comp_top(const void *a, const void *b)
+{
+    const TopEntry *x = a, *y = b;
+    return top_before(x, y) ? -1 : top_before(y, x);
+}
+
+// "state-county-site" from the three key cells, truncated to fit
+static void top_site_key(char *out, const char *const parts[3], const size_t lens[3])
+{
+    snprintf(out, TOP_SITE_KEY, "%.*s-%.*s-%.*s", (int)lens[0], parts[0], (int)lens[1], parts[1], (int)lens[2], parts[2]);
+}
+
+int top_heap_init(TopHeap *heap, size_t k)
+{
+    heap->items = malloc((k ? k : 1) * sizeof(*heap->items));
+    heap->len = 0;
+    heap->k = k;
+    return heap->items ? 0 : -1;
+}
+
+void top_heap_free(TopHeap *heap)
+{
+    for (size_t i = 0; i < heap->len; i++)
+    {
+        free(heap->items[i].record);
+    }
+
+    free(heap->items);
+    heap->items = NULL;
+    heap->len = 0;
+}
+
+bool top_accepts(const TopHeap *heap, double value)
+{
+    // Equal values may still win on the site key, those are settled in top_push
+    return heap->k > 0 && (heap->len < heap->k || value >= heap->items[0].value);
+}
+
+// Root is the entry ranking last, sift down from i
+static void top_sift(TopHeap *heap, size_t i)
+{
+    TopEntry *items = heap->items;
+
+    while (true)
+    {
+        size_t worst = i, l = 2 * i + 1, r = l + 1;
+        if (l < heap->len && top_before(&items[worst], &items[l])) worst = l;
+        if (r < heap->len && top_before(&items[worst], &items[r])) worst = r;
+        if (worst == i) return;
+
+        TopEntry tmp = items[i];
+        items[i] = items[worst];
+        items[worst] = tmp;
+        i = worst;
+    }
+}
+
+bool top_push(TopHeap *heap, const TopEntry *entry)
+{
+    TopEntry *items = heap->items;
+
+    if (heap->len < heap->k)
+    {
+        // Sift up while the parent ranks before the new entry
+        size_t i = heap->len++;
+        while (i > 0 && top_before(&items[(i - 1) / 2], entry))
+        {
+            items[i] = items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        items[i] = *entry;
+        return true;
+    }
+
+    if (heap->k == 0 || !top_before(entry, &items[0])) return false;
+
+    free(items[0].record);
+    items[0] = *entry;
+    top_sift(heap, 0);
+    return true;
+}
+
+void top_heap_sort(TopHeap *heap)
+{
+    qsort(heap->items, heap->len, sizeof(*heap->items), comp_top);
+}
+
+// Per-thread heap over a slice of the selected rows
+typedef struct {
+    const AQSColumns *cols;
+    const uint32_t *rows;
+    size_t n;
+    int field;
+    TopHeap heap;
+} TopTask;
+
+static void *top_task(void *arg)
+{
+    TopTask *task = arg;
+    const Column *col = &task->cols->cols[task->field];
+
+    for (size_t i = 0; i < task->n; i++)
+    {
+        uint32_t row = task->rows[i];
+        TopEntry entry = {0};
+
+        // Most rows lose to the root on value alone, the site key is only built for contenders
+        if (!column_number(col, row, &entry.value) || !top_accepts(&task->heap, entry.value)) continue;
+
+        const char *parts[3];
+        size_t lens[3];
+        for (int k = 0; k < 3; k++)
+        {
+            parts[k] = column_str(&task->cols->cols[k], row, &lens[k]);
+        }
+
+        top_site_key(entry.site, parts, lens);
+        entry.seq = row;
+        top_push(&task->heap, &entry);
+    }
+
+    return NULL;
+}
+
+uint32_t *top_rows(const AQSColumns *cols, const uint32_t *rows, size_t *n, int field, size_t k, int threads)
+{
+    // Same slicing as group_rows, small selections are not worth a thread each
+    size_t per_thread = 1 << 14;
+    if (threads < 1) threads = 1;
+    if ((size_t)threads > *n / per_thread + 1) threads = *n / per_thread + 1;
+
+    TopTask *tasks = calloc(threads, sizeof(*tasks));
+    TopHeap merged = {0};
+    int status = tasks && top_heap_init(&merged, k) == 0 ? 0 : -1;
+
+    for (int t = 0; t < threads && status == 0; t++)
+    {
+        size_t begin = *n * t / threads;
+        size_t end = *n * (t + 1) / threads;
+
+        tasks[t].cols = cols;
+        tasks[t].rows = rows + begin;
+        tasks[t].n = end - begin;
+        tasks[t].field = field;
+        if (top_heap_init(&tasks[t].heap, k) != 0) status = -1;
+    }
+
+    if (status == 0) run_parallel(threads, top_task, tasks, sizeof(*tasks));
+
+    // At most threads * k survivors, merged through one more heap of k
+    for (int t = 0; tasks && t < threads; t++)
+    {
+        for (size_t i = 0; status == 0 && i < tasks[t].heap.len; i++)
+        {
+            top_push(&merged, &tasks[t].heap.items[i]);
+        }
+        top_heap_free(&tasks[t].heap);
+    }
+
+    free(tasks);
+
+    uint32_t *out = status == 0 ? malloc((merged.len ? merged.len : 1) * sizeof(*out)) : NULL;
+    if (out == NULL)
+    {
+        perror("Failed to rank rows");
+        top_heap_free(&merged);
+        return NULL;
+    }
+
+    top_heap_sort(&merged);
+    for (size_t i = 0; i < merged.len; i++)
+    {
+        out[i] = (uint32_t)merged.items[i].seq;
+    }
+
+    *n = merged.len;
+    top_heap_free(&merged);
+    return out;
+}
+
+int stream_top(char **files, int count, const char *param, const Filter *filter, int field, size_t k, FILE *out)
+{
+    size_t param_len = strlen(param);
+    char *wanted = malloc(param_len + 1);
+    TopHeap heap;
+
+    if (wanted == NULL || top_heap_init(&heap, k) != 0)
+    {
+        perror("Failed to allocate top-k state");
+        free(wanted);
+        return -1;
+    }
+    normalize_name(param, param_len, wanted);
+
+    char *header = NULL;
+    size_t header_len = 0;
+    uint64_t seq = 0;
+    int status = 0;
+
+    // The by column and the site key are located along with parameter_name and the filter's fields
+    int max_fields = field + 1 > 9 ? field + 1 : 9;
+    if (filter && filter->max_field >= max_fields) max_fields = filter->max_field + 1;
+
+    for (int f = 0; f < count && status == 0; f++)
+    {
+        RecordReader reader;
+        if (reader_open(&reader, files[f]) != 0)
+        {
+            status = -1;
+            break;
+        }
+
+        Filter local;
+        if (filter) local = *filter;
+
+        AQSRowView row;
+        size_t len;
+        bool first = true;
+        int fields;
+
+        while ((fields = reader_next(&reader, max_fields, &row, &len)) > 0)
+        {
+            const char *data = reader.buf;
+            const char *rec = data + row.offset;
+
+            // The first file's header heads the output, like --param
+            if (first)
+            {
+                first = false;
+                if (header == NULL && (header = malloc(len + 1)) != NULL)
+                {
+                    memcpy(header, rec, len);
+                    header_len = len;
+                }
+                continue;
+            }
+
+            seq++;
+            FieldView name = row_field(data, &row, 8);
+            if (!name_equals(wanted, data + name.offset, name.length)) continue;
+
+            // Only the by column is converted, every other field stays text
+            FieldView view = row_field(data, &row, field);
+            TopEntry entry = {0};
+            NumStatus parsed;
+            if (AQS_FIELDS[field].type == COL_INT)
+            {
+                int32_t value;
+                parsed = parse_int(data + view.offset, view.length, &value);
+                entry.value = value;
+            } else if (AQS_FIELDS[field].type == COL_TIME)
+            {
+                int64_t value;
+                parsed = parse_datetime(data + view.offset, view.length, &value, NULL);
+                entry.value = (double)value;
+            } else 
+            {
+                parsed = parse_double(data + view.offset, view.length, &entry.value);
+            }
+
+            if (parsed != NUM_OK || !top_accepts(&heap, entry.value)) continue;
+            if (filter && !filter_row(&local, data, &row)) continue;
+
+            // Key cells unescaped into one buffer, then the record is kept as it was read
+            char cells[3][TOP_SITE_KEY];
+            const char *parts[3];
+            size_t lens[3];
+            for (int c = 0; c < 3; c++)
+            {
+                lens[c] = copy_field(data, row_field(data, &row, c), cells[c], sizeof(cells[c]));
+                parts[c] = cells[c];
+            }
+
+            top_site_key(entry.site, parts, lens);
+            entry.seq = seq;
+
+            if ((entry.record = malloc(len)) == NULL)
+            {
+                perror("Failed to keep a record");
+                status = -1;
+                break;
+            }
+
+            memcpy(entry.record, rec, len);
+            entry.len = len;
+            if (!top_push(&heap, &entry)) free(entry.record);
+        }
+
+        if (fields < 0)
+        {
+            fprintf(stderr, "could not read the whole file %s\n", files[f]);
+            status = -1;
+        }
+
+        reader_close(&reader);
+    }
+
+    if (status == 0)
+    {
+        top_heap_sort(&heap);
+
+        if (header)
+        {
+            fwrite(header, 1, header_len, out);
+            if (header[header_len - 1] != '\n') fputc('\n', out);
+        }
+
+        for (size_t i = 0; i < heap.len; i++)
+        {
+            const TopEntry *e = &heap.items[i];
+            fwrite(e->record, 1, e->len, out);
+            if (e->record[e->len - 1] != '\n') fputc('\n', out);
+        }
+    }
+
+    free(header);
+    free(wanted);
+    top_heap_free(&heap);
+    return status;
 }
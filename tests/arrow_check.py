@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# Read an --export back with pyarrow and compare every cell with the CSV it came from
+# Usage: python3 tests/arrow_check.py [path/to/reduce]
+
+import csv
+import datetime
+import math
+import os
+import subprocess
+import sys
+import tempfile
+
+try:
+    import pyarrow as pa
+    import pyarrow.ipc as ipc
+except ImportError:
+    print("skip arrow_check: pyarrow is not installed (pip install pyarrow)")
+    sys.exit(0)
+
+REDUCE = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./reduce")
+PARAM = "pm2.5 - local conditions"  # more than one 65536-row batch at this size and seed
+
+
+def expected(field, text):
+    """The value a CSV cell should come back as, every empty cell is a null"""
+    if text == "":
+        return None
+    if pa.types.is_string(field.type) or pa.types.is_dictionary(field.type):
+        return text
+    if pa.types.is_int32(field.type):
+        return int(text)
+    if pa.types.is_float64(field.type):
+        return float(text)
+    if pa.types.is_timestamp(field.type):
+        return datetime.datetime.strptime(text, "%Y-%m-%d %H:%M")
+    raise ValueError(f"unexpected type {field.type} for {field.name}")
+
+
+def main():
+    with tempfile.TemporaryDirectory() as tmp:
+        data = os.path.join(tmp, "data.csv")
+        out = os.path.join(tmp, "out.arrow")
+
+        subprocess.run([REDUCE, "--generate", "300000", "--seed", "11", data], check=True, stdout=subprocess.DEVNULL)
+        subprocess.run([REDUCE, "--export", out, data], input=PARAM + "\n", text=True, check=True, stdout=subprocess.DEVNULL)
+
+        with open(data, newline="") as f:
+            reader = csv.reader(f)
+            next(reader)
+            rows = [r for r in reader if r[8].lower() == PARAM]
+
+        file = ipc.open_file(out)
+        table = file.read_all()
+        failures = 0
+
+        if table.num_rows != len(rows):
+            print(f"FAIL row count: {table.num_rows} exported, {len(rows)} in the CSV")
+            return 1
+
+        for c, field in enumerate(table.schema):
+            values = table.column(c).to_pylist()
+            for i, (got, row) in enumerate(zip(values, rows)):
+                want = expected(field, row[c])
+                same = got == want or (isinstance(got, float) and isinstance(want, float) and math.isclose(got, want, rel_tol=1e-15))
+                if not same:
+                    failures += 1
+                    if failures <= 10:
+                        print(f"FAIL row {i} {field.name}: exported {got!r}, CSV {want!r}")
+
+        if failures:
+            print(f"FAIL {failures} cells differ")
+            return 1
+
+        print(f"ok   arrow export: {table.num_rows} rows x {table.num_columns} columns in {file.num_record_batches} batches match the CSV")
+        return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
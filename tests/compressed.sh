@@ -0,0 +1,104 @@
+#!/bin/sh
+# Round trips through gzip and zip, plus truncated and corrupt archives that must fail the load
+# Usage: sh tests/compressed.sh [path/to/reduce]
+
+REDUCE=$(cd "$(dirname "${1:-./reduce}")" && pwd)/$(basename "${1:-./reduce}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+FAILED=0
+
+pass() { echo "ok   $1"; }
+fail() { echo "FAIL $1"; FAILED=1; }
+
+# Parameter listing and the rows of the first parameter, from every loader
+listing()
+{
+    for mode in "" --mmap --columnar; do
+        echo "$PARAM" | "$REDUCE" $mode "$1" 2>&1 || echo "exit $?"
+    done
+    "$REDUCE" --param "$PARAM" "$1" 2>&1 || echo "exit $?"
+}
+
+# Same output as the plain CSV
+same()
+{
+    if [ "$(listing "$1")" = "$EXPECTED" ]; then pass "$1"; else fail "$1"; fi
+}
+
+# Load fails with a non-zero exit, and --cache leaves no sidecar behind
+rejected()
+{
+    if echo | "$REDUCE" --cache "$1" >/dev/null 2>&1; then
+        fail "$1 loaded"
+    elif [ -e "$1.aqsc" ]; then
+        fail "$1 cached"
+    else
+        pass "$1 rejected"
+    fi
+}
+
+# Overwrite bytes at an offset
+patch() { printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null; }
+
+"$REDUCE" --generate 20000 --seed 7 data.csv >/dev/null || exit 1
+PARAM=$(echo | "$REDUCE" data.csv | sed -n 's/^Parameter 1: \(.*\) ([0-9]* rows)$/\1/p')
+EXPECTED=$(listing data.csv)
+cp data.csv inner.csv
+echo "not a csv" > notes.txt
+
+# gzip: one member, several members, trailing junk
+gzip -c data.csv > data.csv.gz
+same data.csv.gz
+
+head -n 5000 data.csv | gzip -c > multi.csv.gz
+tail -n +5001 data.csv | gzip -c >> multi.csv.gz
+same multi.csv.gz
+
+cp data.csv.gz junk.csv.gz
+echo "trailing junk" >> junk.csv.gz
+same junk.csv.gz
+
+# zip: deflated and stored, sizes in the local header or in data descriptors (written to a pipe), zip64
+zip -q deflated.zip notes.txt inner.csv && same deflated.zip
+zip -q -0 stored.zip notes.txt inner.csv && same stored.zip
+zip -q - notes.txt inner.csv | cat > streamed.zip && same streamed.zip
+zip -q -0 - notes.txt inner.csv | cat > streamed_stored.zip && same streamed_stored.zip
+zip -q -fz zip64.zip notes.txt inner.csv && same zip64.zip
+
+# Streamed zip64 entries, 8-byte sizes in the data descriptors
+python3 - <<'PY' && same zip64_streamed.zip
+import zipfile
+
+class Pipe:
+    def __init__(self, f): self.f = f
+    def write(self, b): return self.f.write(b)
+    def flush(self): pass
+
+with open("zip64_streamed.zip", "wb") as raw, zipfile.ZipFile(Pipe(raw), "w", zipfile.ZIP_STORED) as z:
+    with z.open("notes.txt", "w", force_zip64=True) as e: e.write(open("notes.txt", "rb").read())
+    with z.open("inner.csv", "w", force_zip64=True) as e: e.write(open("inner.csv", "rb").read())
+PY
+
+# Truncated and corrupt inputs
+SIZE=$(wc -c < data.csv.gz)
+head -c $((SIZE / 2)) data.csv.gz > truncated.csv.gz && rejected truncated.csv.gz
+cp data.csv.gz corrupt.csv.gz && patch corrupt.csv.gz $((SIZE / 2)) '\377\377\377\377' && rejected corrupt.csv.gz
+cp data.csv.gz badcrc.csv.gz && patch badcrc.csv.gz $((SIZE - 8)) '\000\000' && rejected badcrc.csv.gz
+
+SIZE=$(wc -c < deflated.zip)
+head -c $((SIZE / 2)) deflated.zip > truncated.zip && rejected truncated.zip
+head -c $((SIZE / 2)) streamed.zip > truncated_streamed.zip && rejected truncated_streamed.zip
+cp stored.zip corrupt.zip && patch corrupt.zip $((SIZE / 2)) 'XXXX' && rejected corrupt.zip
+
+# Uncompressed size in the local header one more than the data: the CRC passes, the length check must not
+cp stored.zip badsize.zip
+OFFSET=$(python3 -c "import zipfile; print(zipfile.ZipFile('stored.zip').getinfo('inner.csv').header_offset)")
+python3 -c "
+import struct
+f = open('badsize.zip', 'r+b'); f.seek($OFFSET + 22)
+size = struct.unpack('<I', f.read(4))[0]; f.seek($OFFSET + 22); f.write(struct.pack('<I', size + 1))"
+rejected badsize.zip
+
+exit $FAILED